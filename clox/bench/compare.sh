@@ -0,0 +1,64 @@
+#!/usr/bin/env bash
+# Builds clox with two sets of make variables and times both on the bench workloads.
+# With --flags the two sets are clox options instead, both run by the same build.
+#   usage: ./bench/compare.sh [-n <runs>] [--flags] <set-a> <set-b>   (from the clox directory)
+#   e.g.   ./bench/compare.sh "DISPATCH=switch" "DISPATCH=threaded"
+#          ./bench/compare.sh --flags "--backend=stack" "--backend=register"
+
+RUNS=5
+WORKLOADS=$(ls bench/*.lox)
+FLAGS=0
+USAGE="usage: $0 [-n <runs>] [--flags] <set-a> <set-b>"
+
+function error() {
+    echo -e "$1" 1>&2
+    exit 1
+}
+
+function build() {
+    local dir=$1 vars=$2
+    make -s -B BIN_DIR="$dir" OPT=2 $vars > /dev/null || error "failed to build with '$vars'"
+}
+
+# prints the best wall time (in seconds) of $RUNS runs
+function best_time() {
+    local exe=$1 flags=$2 file=$3 best=""
+    for ((i = 0; i < RUNS; i++)) ; do
+        local start=$(date +%s%N)
+        "$exe" $flags "$file" > /dev/null || error "'$exe $flags $file' failed"
+        local elapsed=$(( $(date +%s%N) - start ))
+        if [ -z "$best" ] || [ $elapsed -lt $best ] ; then
+            best=$elapsed
+        fi
+    done
+    awk -v ns=$best 'BEGIN { printf "%.3f", ns / 1e9 }'
+}
+
+if [ "$1" == "-n" ] ; then
+    RUNS=$2
+    shift 2
+fi
+if [ "$1" == "--flags" ] ; then
+    FLAGS=1
+    shift
+fi
+[ $# -eq 2 ] || error "$USAGE"
+
+if [ $FLAGS -eq 1 ] ; then
+    build bin/cmp-a ""
+    EXE_A=bin/cmp-a/clox FLAGS_A=$1
+    EXE_B=bin/cmp-a/clox FLAGS_B=$2
+else
+    build bin/cmp-a "$1"
+    build bin/cmp-b "$2"
+    EXE_A=bin/cmp-a/clox FLAGS_A=""
+    EXE_B=bin/cmp-b/clox FLAGS_B=""
+fi
+
+printf "%-16s %14s %14s %8s\n" "workload" "${1:-default}" "${2:-default}" "speedup"
+for file in $WORKLOADS ; do
+    a=$(best_time $EXE_A "$FLAGS_A" $file)
+    b=$(best_time $EXE_B "$FLAGS_B" $file)
+    awk -v name=$(basename $file) -v a=$a -v b=$b \
+        'BEGIN { printf "%-16s %13ss %13ss %7.2fx\n", name, a, b, a / b }'
+done
@@ -0,0 +1,79 @@
+// Micro-benchmark for the hash map: insert, lookup and delete churn.
+//   usage: make bench-map   (from the clox directory)
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/hash-map.h"
+#include "../src/utils.h"
+
+#define KEYS   200000
+#define ROUNDS 20
+
+static LoxString * make_key(size_t i) {
+    char buffer[32];
+    size_t length = snprintf(buffer, sizeof(buffer), "key-%zu", i);
+
+    LoxString * str = malloc(lox_str_size(length));
+    memcpy(str->chars, buffer, length + 1);
+    str->obj    = (LoxObject) { .type = OBJ_STRING, .is_marked = false, .next = NULL };
+    str->length = length;
+    str->hash   = str_hash(buffer, length);
+    return str;
+}
+
+static void report(const char * name, uint64_t start, size_t ops) {
+    uint64_t elapsed = time_monotonic_ns() - start;
+    printf("%-10s %8.2f ms %8.2f ns/op\n", name, elapsed / 1e6, (double) elapsed / ops);
+}
+
+int main(void) {
+    LoxString ** keys = malloc(sizeof(LoxString *) * KEYS);
+    for(size_t i = 0; i < KEYS; i++)
+        keys[i] = make_key(i);
+
+    HashMap map;
+    map_init(&map);
+    size_t hits = 0;
+
+    uint64_t start = time_monotonic_ns();
+    for(size_t i = 0; i < KEYS; i++)
+        map_set(&map, keys[i], NUMBER_VAL(i));
+    report("insert", start, KEYS);
+
+    start = time_monotonic_ns();
+    for(size_t r = 0; r < ROUNDS; r++) {
+        for(size_t i = 0; i < KEYS; i++)
+            hits += map_get(&map, keys[(i * 7919) % KEYS]) != NULL;
+    }
+    report("lookup", start, (size_t) KEYS * ROUNDS);
+
+    start = time_monotonic_ns();
+    for(size_t r = 0; r < ROUNDS; r++) {
+        for(size_t i = 0; i < KEYS; i++) {
+            LoxString * key = keys[i];
+            hits += map_find_str(&map, key->chars, key->length, key->hash) != NULL;
+        }
+    }
+    report("find_str", start, (size_t) KEYS * ROUNDS);
+
+    // deletes half of the keys and puts them back, the table's size stays the same
+    start = time_monotonic_ns();
+    for(size_t r = 0; r < ROUNDS; r++) {
+        for(size_t i = r % 2; i < KEYS; i += 2)
+            map_delete(&map, keys[i]);
+        for(size_t i = 0; i < KEYS; i++)
+            hits += map_get(&map, keys[i]) != NULL;
+        for(size_t i = r % 2; i < KEYS; i += 2)
+            map_set(&map, keys[i], NUMBER_VAL(i));
+    }
+    report("churn", start, (size_t) KEYS * ROUNDS * 2);
+
+    printf("entries: %zu, capacity: %zu, hits: %zu\n", map.length, map.capacity, hits);
+
+    map_destroy(&map);
+    for(size_t i = 0; i < KEYS; i++)
+        free(keys[i]);
+    free(keys);
+    return 0;
+}
@@ -0,0 +1,50 @@
+// Runs a command once and prints its wall time (ns) and peak resident set size (KB).
+//   usage: measure <exe> [args...]   (the command's stdout is discarded)
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+int main(int argc, char ** argv) {
+    if(argc < 2) {
+        fprintf(stderr, "usage: %s <exe> [args...]\n", argv[0]);
+        return 2;
+    }
+
+    uint64_t start = now_ns();
+    pid_t pid = fork();
+    if(pid < 0) {
+        perror("fork");
+        return 2;
+    }
+
+    if(pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        if(null >= 0) dup2(null, STDOUT_FILENO);
+        execvp(argv[1], &argv[1]);
+        perror("exec");
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    if(wait4(pid, &status, 0, &usage) < 0) {
+        perror("wait4");
+        return 2;
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    printf("%llu %ld\n", (unsigned long long) elapsed, usage.ru_maxrss);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
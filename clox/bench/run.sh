@@ -0,0 +1,91 @@
+#!/usr/bin/env bash
+# Runs every bench/*.lox workload N times and reports the median and p95 wall time, the
+# number of executed vm instructions, the average cost of one (median / instructions)
+# and the peak RSS. The timed build is the release one (make RELEASE=1). The results can be saved as a
+# baseline (machine specific, kept in bin/bench), which later runs compare against to
+# flag regressions.
+#   usage: ./bench/run.sh [-n <runs>] [-t <threshold %>] [--save] [--baseline <file>]   (from the clox directory)
+
+RUNS=10
+THRESHOLD=10
+SAVE=0
+BASELINE=bin/bench/baseline.txt
+BIN=bin/bench
+USAGE="usage: $0 [-n <runs>] [-t <threshold %>] [--save] [--baseline <file>]"
+
+function error() {
+    echo -e "$1" 1>&2
+    exit 1
+}
+
+while [ $# -gt 0 ] ; do
+    case "$1" in
+        -n) RUNS=$2; shift 2 ;;
+        -t) THRESHOLD=$2; shift 2 ;;
+        --save) SAVE=1; shift ;;
+        --baseline) BASELINE=$2; shift 2 ;;
+        *) error "invalid option '$1'\n$USAGE" ;;
+    esac
+done
+[ "$RUNS" -gt 0 ] 2> /dev/null || error "invalid number of runs '$RUNS'"
+
+make -s -B BIN_DIR=$BIN/timed RELEASE=1 > /dev/null || error "failed to build clox"
+${CC:-cc} -O2 -o $BIN/measure bench/measure.c || error "failed to build bench/measure.c"
+
+RESULTS=$(mktemp)
+trap "rm -f $RESULTS" EXIT
+
+printf "%-14s %10s %10s %14s %9s %10s" "workload" "median" "p95" "instructions" "ns/instr" "peak rss"
+[ -f "$BASELINE" ] && [ $SAVE -eq 0 ] && printf " %9s" "vs base"
+echo
+
+regressions=0
+for file in bench/*.lox ; do
+    name=$(basename $file .lox)
+
+    # counted by a separate run, --stats slows the vm down
+    instructions=$($BIN/timed/clox --stats=json $file 2>&1 > /dev/null | awk '/"instructions":/ { print $2 + 0 }')
+    [ -n "$instructions" ] || error "'$file' failed"
+
+    samples=$(for ((i = 0; i < RUNS; i++)) ; do
+        $BIN/measure $BIN/timed/clox $file || exit 1
+    done) || error "'$file' failed"
+
+    # nearest rank percentiles over the sorted wall times, the rss is the largest seen
+    read median p95 rss < <(echo "$samples" | sort -n | awk '
+        { wall[NR] = $1; if($2 > rss) rss = $2 }
+        END {
+            m = int((NR + 1) / 2); p = int(NR * 0.95 + 0.999999)
+            print wall[m], wall[p], rss
+        }')
+
+    echo "$name $median $p95 $instructions $rss" >> $RESULTS
+    line=$(awk -v n=$name -v m=$median -v p=$p95 -v i=$instructions -v r=$rss \
+        'BEGIN { printf "%-14s %8.1fms %8.1fms %14d %9.2f %8dKB", n, m / 1e6, p / 1e6, i, m / i, r }')
+
+    if [ -f "$BASELINE" ] && [ $SAVE -eq 0 ] ; then
+        base=$(awk -v n=$name '$1 == n { print $2, $4 }' $BASELINE)
+        if [ -n "$base" ] ; then
+            read base_median base_instructions <<< "$base"
+            verdict=$(awk -v m=$median -v b=$base_median -v i=$instructions -v bi=$base_instructions -v t=$THRESHOLD '
+                BEGIN {
+                    d = 100 * (m - b) / b
+                    flag = (d > t || i > bi) ? "  REGRESSION" : ""
+                    printf " %+8.1f%%%s", d, flag
+                }')
+            [[ "$verdict" == *REGRESSION* ]] && ((regressions++))
+            line+="$verdict"
+        else
+            line+=$(printf " %9s" "new")
+        fi
+    fi
+    echo "$line"
+done
+
+if [ $SAVE -eq 1 ] ; then
+    cp $RESULTS $BASELINE
+    echo "baseline saved to $BASELINE"
+elif [ $regressions -gt 0 ] ; then
+    echo "$regressions regression(s): median wall time over ${THRESHOLD}% slower or more instructions than $BASELINE"
+    exit 1
+fi
@@ -8,29 +8,14 @@
 
 void chunk_init(LoxChunk * p){
     da_init(&p->code);
+    da_init(&p->lines);
     da_init(&p->constants);
 }
 
-static void free_objects(LoxChunk * p) {
-    for(size_t i = 0; i < p->constants.length; i++) {
-        LoxValue val = p->constants.values[i];
-        if(VAL_IS_STRING(val)) {
-            LoxString * str = (LoxString *) val.as.object;
-            mem_dealloc((void *) str->chars);
-
-            str->chars    = NULL;
-            str->length   = 0;
-            str->obj.type = 0;
-            ASSERT(str->obj.next == NULL);
-
-            mem_dealloc(str);
-        }
-    }
-}
-
+// the constants are owned by the garbage collector, only the arrays are freed here
 void chunk_destroy(LoxChunk * p){
-    free_objects(p);
     da_destroy(&p->code);
+    da_destroy(&p->lines);
     da_destroy(&p->constants);
 }
 
@@ -44,24 +29,150 @@ size_t chunk_add_constant(LoxChunk * p, LoxValue value){
 }
 
 void chunk_add_instr(LoxChunk * p, uint8_t op_code, uint32_t line){
-    Instruction tmp = {
-        .op_code = op_code,
-        .line    = line
-    };
-    da_push(&p->code, tmp);
+    da_push(&p->code, op_code);
+
+    if(p->lines.length > 0 && p->lines.values[p->lines.length - 1].line == line) {
+        p->lines.values[p->lines.length - 1].length++;
+    } else {
+        LoxLineRun run = {
+            .line   = line,
+            .length = 1,
+        };
+        da_push(&p->lines, run);
+    }
+}
+
+static const char * opcode_names[] = {
+    [OP_CONST]                  = "OP_CONST",
+    [OP_CONST_LONG]             = "OP_CONST_LONG",
+    [OP_RETURN]                 = "OP_RETURN",
+    [OP_POP]                    = "OP_POP",
+    [OP_POPN]                   = "OP_POPN",
+    [OP_NEG]                    = "OP_NEG",
+    [OP_ADD]                    = "OP_ADD",
+    [OP_SUB]                    = "OP_SUB",
+    [OP_MULT]                   = "OP_MULT",
+    [OP_DIV]                    = "OP_DIV",
+    [OP_EQ]                     = "OP_EQ",
+    [OP_LESS]                   = "OP_LESS",
+    [OP_GREATER]                = "OP_GREATER",
+    [OP_NOT_EQ]                 = "OP_NOT_EQ",
+    [OP_LESS_EQ]                = "OP_LESS_EQ",
+    [OP_GREATER_EQ]             = "OP_GREATER_EQ",
+    [OP_NOT]                    = "OP_NOT",
+    [OP_NIL]                    = "OP_NIL",
+    [OP_TRUE]                   = "OP_TRUE",
+    [OP_FALSE]                  = "OP_FALSE",
+    [OP_PRINT]                  = "OP_PRINT",
+    [OP_DEFINE_GLOBAL_SLOT]     = "OP_DEFINE_GLOBAL_SLOT",
+    [OP_SET_GLOBAL_SLOT]        = "OP_SET_GLOBAL_SLOT",
+    [OP_GET_GLOBAL_SLOT]        = "OP_GET_GLOBAL_SLOT",
+    [OP_DEFINE_GLOBAL_SLOT_LONG] = "OP_DEFINE_GLOBAL_SLOT_LONG",
+    [OP_SET_GLOBAL_SLOT_LONG]   = "OP_SET_GLOBAL_SLOT_LONG",
+    [OP_GET_GLOBAL_SLOT_LONG]   = "OP_GET_GLOBAL_SLOT_LONG",
+    [OP_SET_LOCAL]              = "OP_SET_LOCAL",
+    [OP_GET_LOCAL]              = "OP_GET_LOCAL",
+    [OP_INC_LOCAL]              = "OP_INC_LOCAL",
+    [OP_SET_GLOBAL_SLOT_POP]    = "OP_SET_GLOBAL_SLOT_POP",
+    [OP_SET_GLOBAL_SLOT_LONG_POP] = "OP_SET_GLOBAL_SLOT_LONG_POP",
+    [OP_SET_LOCAL_POP]          = "OP_SET_LOCAL_POP",
+    [OP_INC_LOCAL_POP]          = "OP_INC_LOCAL_POP",
+    [OP_IF_FALSE]               = "OP_IF_FALSE",
+    [OP_JUMP_IF_FALSE_POP]      = "OP_JUMP_IF_FALSE_POP",
+    [OP_LESS_LOCAL_CONST_JUMP]  = "OP_LESS_LOCAL_CONST_JUMP",
+    [OP_JUMP]                   = "OP_JUMP",
+    [OP_LOOP]                   = "OP_LOOP",
+    [OP_CALL]                   = "OP_CALL",
+    [OP_ADD_NUM]                = "OP_ADD_NUM",
+    [OP_ADD_STR]                = "OP_ADD_STR",
+};
+_Static_assert(sizeof(opcode_names) / sizeof(opcode_names[0]) == OP_CODES_COUNT, "opcode names out of sync with OpCode");
+
+const char * chunk_opcode_name(uint8_t opcode) {
+    ASSERT(opcode < OP_CODES_COUNT);
+    return opcode_names[opcode];
+}
+
+// the instructions missing from here have no operands
+static const uint8_t opcode_lengths[OP_CODES_COUNT] = {
+    [OP_POPN]                     = 2,
+    [OP_CONST]                    = 2,
+    [OP_CONST_LONG]               = 4,
+    [OP_DEFINE_GLOBAL_SLOT]       = 2,
+    [OP_SET_GLOBAL_SLOT]          = 2,
+    [OP_GET_GLOBAL_SLOT]          = 2,
+    [OP_DEFINE_GLOBAL_SLOT_LONG]  = 4,
+    [OP_SET_GLOBAL_SLOT_LONG]     = 4,
+    [OP_GET_GLOBAL_SLOT_LONG]     = 4,
+    [OP_SET_LOCAL]                = 2,
+    [OP_GET_LOCAL]                = 2,
+    [OP_INC_LOCAL]                = 3,
+    [OP_SET_GLOBAL_SLOT_POP]      = 2,
+    [OP_SET_GLOBAL_SLOT_LONG_POP] = 4,
+    [OP_SET_LOCAL_POP]            = 2,
+    [OP_INC_LOCAL_POP]            = 3,
+    [OP_IF_FALSE]                 = 3,
+    [OP_JUMP_IF_FALSE_POP]        = 3,
+    [OP_LESS_LOCAL_CONST_JUMP]    = 5,
+    [OP_JUMP]                     = 3,
+    [OP_LOOP]                     = 3,
+    [OP_CALL]                     = 2,
+};
+
+size_t chunk_instr_length(uint8_t opcode) {
+    ASSERT(opcode < OP_CODES_COUNT);
+    return opcode_lengths[opcode] == 0 ? 1 : opcode_lengths[opcode];
+}
+
+// drops the code from `length` on, used by the compiler to replace what it just emitted
+void chunk_truncate(LoxChunk * p, size_t length) {
+    ASSERT(length <= p->code.length);
+    size_t extra   = p->code.length - length;
+    p->code.length = length;
+
+    while(extra > 0) {
+        LoxLineRun * last = &p->lines.values[p->lines.length - 1];
+        if(last->length > extra) {
+            last->length -= extra;
+            break;
+        }
+        extra -= last->length;
+        p->lines.length--;
+    }
+}
+
+// only meant for error reporting and debugging, it walks the whole line table
+uint32_t chunk_get_line(const LoxChunk * p, size_t offset){
+    ASSERTF(offset < p->code.length, "offset %zu out of the chunk code", offset);
+    for(size_t i = 0; i < p->lines.length; i++) {
+        LoxLineRun run = p->lines.values[i];
+        if(offset < run.length) return run.line;
+        offset -= run.length;
+    }
+    UNREACHABLE();
 }
 
 static size_t print_byte_instr(const char * name, const LoxChunk * p, size_t offset){
-    Instruction constant = da_get(&p->code, offset + 1);
-    printf("%-16s %4d\n", name, constant.op_code);
+    uint8_t constant = da_get(&p->code, offset + 1);
+    printf("%-16s %4d\n", name, constant);
     return offset + 2;
 }
 
-static size_t print_constant_instr(const char * name, const LoxChunk * p, size_t offset){
-    Instruction constant = da_get(&p->code, offset + 1);
-    printf("%-16s %4d ", name, constant.op_code);
+// the long operands are 24 bits wide, lowest byte first
+static size_t read_long_operand(const LoxChunk * p, size_t offset) {
+    return (size_t) da_get(&p->code, offset + 2) << 16 | (size_t) da_get(&p->code, offset + 1) << 8 | da_get(&p->code, offset);
+}
+
+static size_t print_long_instr(const char * name, const LoxChunk * p, size_t offset){
+    printf("%-16s %4zu\n", name, read_long_operand(p, offset + 1));
+    return offset + 4;
+}
+
+static size_t print_constant_instr(const char * name, const LoxChunk * p, size_t offset, bool wide){
+    size_t constant = wide ? read_long_operand(p, offset + 1) : da_get(&p->code, offset + 1);
+    printf("%-16s %4zu ", name, constant);
 
-    LoxValue value = da_get(&p->constants, constant.op_code);
+    LoxValue value = da_get(&p->constants, constant);
     if(VAL_IS_STRING(value)) {
         putchar('"');
         value_print(value);
@@ -70,41 +181,73 @@ static size_t print_constant_instr(const char * name, const LoxChunk * p, size_t
         value_print(value);
 
     putchar('\n');
-    return offset + 2;
+    return offset + (wide ? 4 : 2);
 }
 
 static size_t print_jump_instr(const char * name, const LoxChunk * p, size_t offset, int sign) {
-    size_t jump_length = (size_t) da_get(&p->code, offset + 2).op_code << 8 | da_get(&p->code, offset + 1).op_code;
+    size_t jump_length = (size_t) da_get(&p->code, offset + 2) << 8 | da_get(&p->code, offset + 1);
     size_t jump_target = offset + 3 + jump_length * sign;
     printf("%-16s %4zu (%04zu)", name, jump_length, jump_target);
     putchar('\n');
     return offset + 3;
 }
 
+static size_t print_local_const_instr(const char * name, const LoxChunk * p, size_t offset, bool jump) {
+    uint8_t slot     = da_get(&p->code, offset + 1);
+    uint8_t constant = da_get(&p->code, offset + 2);
+    printf("%-16s %4d ", name, slot);
+    value_print(da_get(&p->constants, constant));
+
+    if(jump) {
+        size_t jump_length = (size_t) da_get(&p->code, offset + 4) << 8 | da_get(&p->code, offset + 3);
+        printf(" (%04zu)", offset + 5 + jump_length);
+    }
+    putchar('\n');
+    return offset + (jump ? 5 : 3);
+}
+
 size_t chunk_instr_debug(const LoxChunk * p, size_t offset){
 #define SIMPLE_INSTR_CASE(opcode)       case opcode: puts(#opcode); break
-#define CONST_INSTR_CASE(opcode)        case opcode: return print_constant_instr(#opcode, p, offset)
+#define CONST_INSTR_CASE(opcode, wide)  case opcode: return print_constant_instr(#opcode, p, offset, wide)
 #define BYTE_INSTR_CASE(opcode)         case opcode: return print_byte_instr(#opcode, p, offset)
+#define LONG_INSTR_CASE(opcode)         case opcode: return print_long_instr(#opcode, p, offset)
 #define JUMP_INSTR_CASE(opcode, sign)   case opcode: return print_jump_instr(#opcode, p, offset, sign)
-    Instruction instr = da_get(&p->code, offset);
+    uint8_t instr = da_get(&p->code, offset);
+    uint32_t line = chunk_get_line(p, offset);
 
     printf("%04zu ", offset);
-    if(offset > 0 && da_get(&p->code, offset - 1).line == instr.line) {
+    if(offset > 0 && chunk_get_line(p, offset - 1) == line) {
         fputs("   | ", stdout);
     } else {
-        printf("%4d ", instr.line);
+        printf("%4d ", line);
     }
 
-    switch(instr.op_code) {
-        CONST_INSTR_CASE(OP_CONST);
-        CONST_INSTR_CASE(OP_SET_GLOBAL);
+    switch(instr) {
+        CONST_INSTR_CASE(OP_CONST, false);
+        CONST_INSTR_CASE(OP_CONST_LONG, true);
 
-        CONST_INSTR_CASE(OP_GET_GLOBAL);
-        CONST_INSTR_CASE(OP_DEFINE_GLOBAL);
+        BYTE_INSTR_CASE(OP_SET_GLOBAL_SLOT);
+        BYTE_INSTR_CASE(OP_GET_GLOBAL_SLOT);
+        BYTE_INSTR_CASE(OP_DEFINE_GLOBAL_SLOT);
+        LONG_INSTR_CASE(OP_SET_GLOBAL_SLOT_LONG);
+        LONG_INSTR_CASE(OP_GET_GLOBAL_SLOT_LONG);
+        LONG_INSTR_CASE(OP_DEFINE_GLOBAL_SLOT_LONG);
+
+        BYTE_INSTR_CASE(OP_SET_GLOBAL_SLOT_POP);
+        LONG_INSTR_CASE(OP_SET_GLOBAL_SLOT_LONG_POP);
 
         BYTE_INSTR_CASE(OP_SET_LOCAL);
+        BYTE_INSTR_CASE(OP_SET_LOCAL_POP);
         BYTE_INSTR_CASE(OP_GET_LOCAL);
         BYTE_INSTR_CASE(OP_CALL);
+        BYTE_INSTR_CASE(OP_POPN);
+
+        case OP_INC_LOCAL: 
+            return print_local_const_instr("OP_INC_LOCAL", p, offset, false);
+        case OP_INC_LOCAL_POP: 
+            return print_local_const_instr("OP_INC_LOCAL_POP", p, offset, false);
+        case OP_LESS_LOCAL_CONST_JUMP: 
+            return print_local_const_instr("OP_LESS_LOCAL_CONST_JUMP", p, offset, true);
 
         SIMPLE_INSTR_CASE(OP_POP);
         SIMPLE_INSTR_CASE(OP_PRINT);
@@ -118,7 +261,12 @@ size_t chunk_instr_debug(const LoxChunk * p, size_t offset){
         SIMPLE_INSTR_CASE(OP_EQ);
         SIMPLE_INSTR_CASE(OP_LESS);
         SIMPLE_INSTR_CASE(OP_GREATER);
+        SIMPLE_INSTR_CASE(OP_NOT_EQ);
+        SIMPLE_INSTR_CASE(OP_LESS_EQ);
+        SIMPLE_INSTR_CASE(OP_GREATER_EQ);
 
+        SIMPLE_INSTR_CASE(OP_ADD_NUM);
+        SIMPLE_INSTR_CASE(OP_ADD_STR);
         
         // boolean
         SIMPLE_INSTR_CASE(OP_NOT);
@@ -130,6 +278,7 @@ size_t chunk_instr_debug(const LoxChunk * p, size_t offset){
 
         JUMP_INSTR_CASE(OP_JUMP, 1);
         JUMP_INSTR_CASE(OP_IF_FALSE, 1);
+        JUMP_INSTR_CASE(OP_JUMP_IF_FALSE_POP, 1);
         JUMP_INSTR_CASE(OP_LOOP, -1);
 
         default: UNREACHABLE();
@@ -140,6 +289,7 @@ size_t chunk_instr_debug(const LoxChunk * p, size_t offset){
 #undef SIMPLE_INSTR_CASE
 #undef CONST_INSTR_CASE
 #undef BYTE_INSTR_CASE
+#undef LONG_INSTR_CASE
 #undef JUMP_INSTR_CASE
 }
 
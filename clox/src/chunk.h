@@ -10,8 +10,10 @@
 
 typedef enum {
     OP_CONST,
+    OP_CONST_LONG,     // <24 bit constant> for the constants past the first 256
     OP_RETURN,
     OP_POP,
+    OP_POPN,           // <count>
 
     // arithmetic horsemans
     OP_NEG,
@@ -24,6 +26,9 @@ typedef enum {
     OP_EQ,
     OP_LESS,
     OP_GREATER,
+    OP_NOT_EQ,
+    OP_LESS_EQ,
+    OP_GREATER_EQ,
     
     // boolean
     OP_NOT,
@@ -36,20 +41,41 @@ typedef enum {
     // print
     OP_PRINT,
 
-    // variables
-    OP_DEFINE_GLOBAL,
-    OP_SET_GLOBAL,
-    OP_GET_GLOBAL,
+    // variables (the globals' operand is their slot, see globals.h)
+    OP_DEFINE_GLOBAL_SLOT,
+    OP_SET_GLOBAL_SLOT,
+    OP_GET_GLOBAL_SLOT,
+    OP_DEFINE_GLOBAL_SLOT_LONG, // same as the above with a 24 bit slot
+    OP_SET_GLOBAL_SLOT_LONG,
+    OP_GET_GLOBAL_SLOT_LONG,
 
     OP_SET_LOCAL,
     OP_GET_LOCAL,
+    OP_INC_LOCAL,      // <slot> <constant>: `local = local + constant`
+
+    // the stores above followed by an OP_POP, only emitted by the optimizer
+    OP_SET_GLOBAL_SLOT_POP,
+    OP_SET_GLOBAL_SLOT_LONG_POP,
+    OP_SET_LOCAL_POP,
+    OP_INC_LOCAL_POP,
 
     // control flow
     OP_IF_FALSE,
+    OP_JUMP_IF_FALSE_POP,
+    OP_LESS_LOCAL_CONST_JUMP, // <slot> <constant> <jump>: jumps unless `local < constant`
     OP_JUMP,
     OP_LOOP,
 
     OP_CALL,
+
+    // Quickened forms of OP_ADD, never emitted by the compiler: it rewrites itself into
+    // one of these once it sees the operand types, and they rewrite themselves back (and
+    // run OP_ADD) when their guard fails, see vm_run. The other arithmetic and comparison
+    // instructions only take numbers, a quickened form would check just what they do.
+    OP_ADD_NUM,
+    OP_ADD_STR,
+
+    OP_CODES_COUNT, // not an instruction, keep it last
 } OpCode;
 
 // WARN: please don't alter the order <values>, <length>, <size> of the inner structs, this is crucial!
@@ -57,8 +83,12 @@ void chunk_init(LoxChunk * c);
 size_t chunk_add_constant(LoxChunk * c, LoxValue value);
 LoxValue chunk_get_constant(const LoxChunk * c, size_t idx);
 void chunk_add_instr(LoxChunk * c, uint8_t value, uint32_t line);
+void chunk_truncate(LoxChunk * c, size_t length);
+uint32_t chunk_get_line(const LoxChunk * c, size_t offset);
 void chunk_destroy(LoxChunk * c);
 
+const char * chunk_opcode_name(uint8_t opcode);
+size_t chunk_instr_length(uint8_t opcode); // opcode and operands, in bytes
 void chunk_debug(const LoxChunk * c, const char * title);
 size_t chunk_instr_debug(const LoxChunk * c, size_t offset);
 
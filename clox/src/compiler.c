@@ -1,6 +1,7 @@
 #include "compiler.h"
 #include "chunk.h"
 #include "scanner.h"
+#include "memory.h"
 #include "utils.h"
 
 #include <stdint.h>
@@ -16,11 +17,24 @@ typedef struct {
     uint32_t scope;
 } LocalVar;
 
+#define CONST_INDEX_EMPTY UINT32_MAX
+
+// Finds the constants already in the chunk of the function being compiled, so the
+// same value is only added once. Values are matched by identity (see `value_identical`).
+typedef struct {
+    uint32_t * slots; // constant index, CONST_INDEX_EMPTY when free
+    size_t capacity;  // a power of two
+    size_t length;
+} ConstIndex;
+
 typedef struct {
     LoxScanner in;
+    LoxGC * gc;
     HashMap * strings;
+    LoxGlobals * globals;
 
     LoxFunction * script;
+    ConstIndex constants; // of `script`
 
     Token previous;
     Token current;
@@ -30,6 +44,16 @@ typedef struct {
     bool in_panic_mode;
     bool can_assign;
 
+    // where the left operand of the infix operator being compiled starts, in the code
+    // and in the constants (see `cpl_fold`)
+    size_t operand_offset;
+    size_t operand_constants;
+
+    // the last OP_POP/OP_POPN emitted in `script` (SIZE_MAX if none) and the furthest
+    // offset a forward jump of `script` lands on, see `cpl_emit_pops`
+    size_t pops_offset;
+    size_t jump_target;
+
     LocalVar locals[MAX_LOCALS * MAX_STACK_FRAMES];
     uint32_t localsCount;
     uint32_t currentScope;
@@ -58,13 +82,71 @@ typedef struct {
     ExprPrecedence precedence;
 } LoxParserRule;
 
-static LoxParserRule * get_parse_rule(TokenType tt);
+static const LoxParserRule * get_parse_rule(TokenType tt);
 static void cpl_compile_expression(LoxSPCompiler * cpl);
 static void cpl_compile_declaration(LoxSPCompiler * cpl);
 
-static void cpl_init(LoxSPCompiler * cpl, const char * source, HashMap * strings) {
+static void const_index_init(ConstIndex * index) {
+    index->slots    = NULL;
+    index->capacity = 0;
+    index->length   = 0;
+}
+
+static void const_index_destroy(ConstIndex * index) {
+    mem_dealloc(index->slots);
+    const_index_init(index);
+}
+
+static uint32_t * const_index_find(const ConstIndex * index, const LoxChunk * chunk, LoxValue value) {
+    size_t mask = index->capacity - 1;
+    for(size_t i = value_identity_hash(value) & mask;; i = (i + 1) & mask) {
+        uint32_t idx = index->slots[i];
+        if(idx == CONST_INDEX_EMPTY || value_identical(chunk->constants.values[idx], value))
+            return &index->slots[i];
+    }
+}
+
+// linear probing deletion: the entries after the freed slot that can't be reached
+// anymore are moved back into it
+static void const_index_remove(ConstIndex * index, const LoxChunk * chunk, LoxValue value) {
+    size_t mask = index->capacity - 1;
+    size_t hole = const_index_find(index, chunk, value) - index->slots;
+    index->slots[hole] = CONST_INDEX_EMPTY;
+    index->length--;
+
+    for(size_t i = (hole + 1) & mask; index->slots[i] != CONST_INDEX_EMPTY; i = (i + 1) & mask) {
+        size_t home = value_identity_hash(chunk->constants.values[index->slots[i]]) & mask;
+        // moves unless `home` lies cyclically within (hole, i]
+        if(((i - home) & mask) >= ((i - hole) & mask)) {
+            index->slots[hole] = index->slots[i];
+            index->slots[i]    = CONST_INDEX_EMPTY;
+            hole = i;
+        }
+    }
+}
+
+static void const_index_grow(ConstIndex * index, const LoxChunk * chunk) {
+    uint32_t * old_slots = index->slots;
+    size_t old_capacity  = index->capacity;
+
+    index->capacity = old_capacity < 16 ? 16 : old_capacity * 2;
+    index->slots    = mem_alloc(index->capacity * sizeof(uint32_t));
+    for(size_t i = 0; i < index->capacity; i++)
+        index->slots[i] = CONST_INDEX_EMPTY;
+
+    for(size_t i = 0; i < old_capacity; i++) {
+        uint32_t idx = old_slots[i];
+        if(idx != CONST_INDEX_EMPTY)
+            *const_index_find(index, chunk, chunk->constants.values[idx]) = idx;
+    }
+    mem_dealloc(old_slots);
+}
+
+static void cpl_init(LoxSPCompiler * cpl, const char * source, LoxGC * gc, HashMap * strings, LoxGlobals * globals) {
     sc_init(&cpl->in, source);
+    cpl->gc       = gc;
     cpl->strings  = strings;
+    cpl->globals  = globals;
     cpl->previous = cpl->current = (Token) {0};
 
     cpl->error_found   = false;
@@ -75,13 +157,23 @@ static void cpl_init(LoxSPCompiler * cpl, const char * source, HashMap * strings
     cpl->localsCount     = 0;
     cpl->currentScope    = 0;
     cpl->funcLocalsStart = 0;
-    cpl->script          = lox_func_create(NULL, FUNC_SCRIPT);
+    cpl->script          = lox_func_create(gc, NULL, FUNC_SCRIPT);
+    cpl->pops_offset     = SIZE_MAX;
+    cpl->jump_target     = 0;
+    const_index_init(&cpl->constants);
+
+    // functions being compiled are only reachable from here
+    gc_push_root(gc, OBJ_VAL(cpl->script));
 }
 
 static inline LoxChunk * cpl_chunk(LoxSPCompiler * cpl) {
     return &cpl->script->chunk;
 }
 
+static inline size_t cpl_current_offset(LoxSPCompiler * cpl) {
+    return cpl_chunk(cpl)->code.length;
+}
+
 // helper functions
 static void cpl_error_at(LoxSPCompiler * cpl, Token * pos, const char * msg) {
     if(cpl->in_panic_mode) return;
@@ -106,22 +198,163 @@ static void cpl_emit_bytes(LoxSPCompiler * cpl, uint8_t byte1, uint8_t byte2) {
     cpl_emit_byte(cpl, byte2);
 }
 
-static uint8_t cpl_add_constant(LoxSPCompiler * cpl, LoxValue constant) {
-    size_t constant_idx = chunk_add_constant(cpl_chunk(cpl), constant);
-    if(constant_idx > UINT8_MAX) {
+// emits the short form of `op` when the operand fits in a byte, the long one otherwise
+static void cpl_emit_operand(LoxSPCompiler * cpl, uint8_t op, uint8_t long_op, size_t operand) {
+    if(operand <= UINT8_MAX) {
+        cpl_emit_bytes(cpl, op, operand);
+    } else {
+        cpl_emit_bytes(cpl, long_op, operand & 0xff);
+        cpl_emit_bytes(cpl, (operand >> 8) & 0xff, (operand >> 16) & 0xff);
+    }
+}
+
+static size_t cpl_add_constant(LoxSPCompiler * cpl, LoxValue constant) {
+    LoxChunk * chunk   = cpl_chunk(cpl);
+    ConstIndex * index = &cpl->constants;
+
+    if((index->length + 1) * 4 > index->capacity * 3)
+        const_index_grow(index, chunk);
+
+    uint32_t * slot = const_index_find(index, chunk, constant);
+    if(*slot != CONST_INDEX_EMPTY)
+        return *slot;
+
+    size_t constant_idx = chunk_add_constant(chunk, constant);
+    if(constant_idx >= MAX_CONSTANTS) {
         cpl_error_at(cpl, &cpl->previous, "too many constants for current chunk (?)");
-        constant_idx = 0;
+        return 0;
     }
+
+    *slot = constant_idx;
+    index->length++;
     return constant_idx;
 }
 
-static inline uint8_t cpl_add_str_constant(LoxSPCompiler * cpl, const char * chars, size_t length) {
-    return cpl_add_constant(cpl, OBJ_VAL(lox_str_intern(cpl->strings, chars, length)));
+// the name is reachable through the globals table as soon as it gets its slot
+static size_t cpl_global_slot(LoxSPCompiler * cpl, const Token * name) {
+    const LoxString * str = lox_str_intern(cpl->gc, cpl->strings, name->start, name->length);
+    size_t slot = globals_resolve(cpl->globals, str);
+    if(slot >= MAX_GLOBALS) {
+        cpl_error_at(cpl, &cpl->previous, "too many global variables");
+        slot = 0;
+    }
+    return slot;
 }
 
 static void cpl_emit_constant(LoxSPCompiler * cpl, LoxValue constant) {
-    uint8_t constant_idx = cpl_add_constant(cpl, constant);
-    cpl_emit_bytes(cpl, OP_CONST, constant_idx);
+    cpl_emit_operand(cpl, OP_CONST, OP_CONST_LONG, cpl_add_constant(cpl, constant));
+}
+
+// Constant folding: an operator whose operands each compiled to a single constant
+// instruction is evaluated right away. Nothing is folded that could fail at runtime,
+// so those expressions still report their error when (and if) they run.
+
+// true if the code in [start, end) is exactly one instruction loading a constant
+static bool cpl_constant_at(LoxSPCompiler * cpl, size_t start, size_t end, LoxValue * value) {
+    LoxChunk * chunk     = cpl_chunk(cpl);
+    const uint8_t * code = &chunk->code.values[start];
+    if(start >= end) return false;
+
+    switch(code[0]) {
+        case OP_NIL   : *value = NIL_VAL;         return end - start == 1;
+        case OP_TRUE  : *value = BOOL_VAL(true);  return end - start == 1;
+        case OP_FALSE : *value = BOOL_VAL(false); return end - start == 1;
+        case OP_CONST :
+            if(end - start != 2) return false;
+            *value = chunk->constants.values[code[1]];
+            return true;
+        case OP_CONST_LONG :
+            if(end - start != 4) return false;
+            *value = chunk->constants.values[code[1] | code[2] << 8 | code[3] << 16];
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool cpl_is_falsy(LoxValue value) {
+    return VAL_IS_NIL(value) || (VAL_IS_BOOL(value) && !VAL_AS_BOOL(value));
+}
+
+// `+` on constants, following vm_add_strings when a string is involved
+static bool cpl_fold_add(LoxSPCompiler * cpl, LoxValue a, LoxValue b, LoxValue * result) {
+    if(VAL_IS_NUMBER(a) && VAL_IS_NUMBER(b)) {
+        *result = NUMBER_VAL(VAL_AS_NUMBER(a) + VAL_AS_NUMBER(b));
+        return true;
+    }
+
+    // strings concatenate with strings, numbers, booleans and nil
+    bool a_str = VAL_IS_STRING(a), b_str = VAL_IS_STRING(b);
+    if(!(a_str || b_str) || (VAL_IS_OBJ(a) && !a_str) || (VAL_IS_OBJ(b) && !b_str))
+        return false;
+
+    char a_buffer[VALUE_FORMAT_MAX], b_buffer[VALUE_FORMAT_MAX];
+    const char * a_chars = a_str ? VAL_AS_CSTRING(a) : a_buffer;
+    const char * b_chars = b_str ? VAL_AS_CSTRING(b) : b_buffer;
+    size_t a_length = a_str ? VAL_AS_STRING(a)->length : value_format(a, a_buffer);
+    size_t b_length = b_str ? VAL_AS_STRING(b)->length : value_format(b, b_buffer);
+
+    char * chars = mem_alloc(a_length + b_length);
+    memcpy(chars, a_chars, a_length);
+    memcpy(chars + a_length, b_chars, b_length);
+    *result = OBJ_VAL(lox_str_intern(cpl->gc, cpl->strings, chars, a_length + b_length));
+    mem_dealloc(chars);
+    return true;
+}
+
+static bool cpl_fold_binary(LoxSPCompiler * cpl, TokenType op, LoxValue a, LoxValue b, LoxValue * result) {
+    switch(op) {
+        case TOKEN_PLUS         : return cpl_fold_add(cpl, a, b, result);
+        case TOKEN_EQUAL_EQUAL  : *result = BOOL_VAL(value_eq(a, b));  return true;
+        case TOKEN_BANG_EQUAL   : *result = BOOL_VAL(!value_eq(a, b)); return true;
+        default:
+            break;
+    }
+
+    if(!VAL_IS_NUMBER(a) || !VAL_IS_NUMBER(b)) return false;
+    double x = VAL_AS_NUMBER(a), y = VAL_AS_NUMBER(b);
+
+    switch(op) {
+        case TOKEN_MINUS         : *result = NUMBER_VAL(x - y); break;
+        case TOKEN_STAR          : *result = NUMBER_VAL(x * y); break;
+        case TOKEN_SLASH         : *result = NUMBER_VAL(x / y); break;
+        case TOKEN_LESS          : *result = BOOL_VAL(x < y);   break;
+        case TOKEN_GREATER       : *result = BOOL_VAL(x > y);   break;
+        // the vm's OP_LESS_EQ and OP_GREATER_EQ (NaN included)
+        case TOKEN_LESS_EQUAL    : *result = BOOL_VAL(!(x > y)); break;
+        case TOKEN_GREATER_EQUAL : *result = BOOL_VAL(!(x < y)); break;
+        default:
+            UNREACHABLE();
+    }
+    return true;
+}
+
+static void cpl_emit_value(LoxSPCompiler * cpl, LoxValue value) {
+    if(VAL_IS_NIL(value))
+        cpl_emit_byte(cpl, OP_NIL);
+    else if(VAL_IS_BOOL(value))
+        cpl_emit_byte(cpl, VAL_AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    else
+        cpl_emit_constant(cpl, value);
+}
+
+// Drops the code from `offset` on. The constants added since `constants` were only
+// used by that code, so they go too.
+static void cpl_drop(LoxSPCompiler * cpl, size_t offset, size_t constants) {
+    LoxChunk * chunk = cpl_chunk(cpl);
+    chunk_truncate(chunk, offset);
+    while(chunk->constants.length > constants) {
+        const_index_remove(&cpl->constants, chunk, chunk->constants.values[chunk->constants.length - 1]);
+        chunk->constants.length--;
+    }
+}
+
+// replaces the code from `offset` on by `value`
+static void cpl_fold(LoxSPCompiler * cpl, size_t offset, size_t constants, LoxValue value) {
+    gc_push_root(cpl->gc, value);
+    cpl_drop(cpl, offset, constants);
+    cpl_emit_value(cpl, value);
+    gc_pop_root(cpl->gc);
 }
 
 // parsing related helping procedures
@@ -158,18 +391,22 @@ static inline void cpl_consume_semicolon(LoxSPCompiler * cpl) {
 
 static void cpl_parse_precedence(LoxSPCompiler * cpl, ExprPrecedence prec) {
     cpl_advance(cpl);
-    LoxParserRule * rule = get_parse_rule(cpl->previous.type);
+    const LoxParserRule * rule = get_parse_rule(cpl->previous.type);
     if(rule->prefix == NULL) {
         cpl_error_at(cpl, &cpl->previous, "expected expression");
         return;
     }
 
-    cpl->can_assign = prec <= PREC_ASSIGNMENT;
+    size_t offset    = cpl_current_offset(cpl);
+    size_t constants = cpl_chunk(cpl)->constants.length;
+    cpl->can_assign  = prec <= PREC_ASSIGNMENT;
     rule->prefix(cpl);
 
     while((rule = get_parse_rule(cpl->current.type))->precedence >= prec) {
         ASSERTF(rule->infix != NULL, "BUG: rule->infix is NULL (token = %s)", tt2str(cpl->current.type));
         cpl_advance(cpl);
+        cpl->operand_offset    = offset;
+        cpl->operand_constants = constants;
         rule->infix(cpl);
     }
 
@@ -213,16 +450,43 @@ static inline void cpl_begin_scope(LoxSPCompiler * cpl) {
     cpl->currentScope++;
 }
 
+// Pops `count` values with a single instruction. Pops that directly follow other pops
+// (e.g. an expression statement or an inner block closing right before its enclosing
+// block) are merged into them, unless a jump lands in between.
+static void cpl_emit_pops(LoxSPCompiler * cpl, size_t count) {
+    LoxChunk * chunk = cpl_chunk(cpl);
+    if(count == 0) return;
+
+    size_t last = cpl->pops_offset;
+    if(last < chunk->code.length && cpl->jump_target <= last) {
+        uint8_t op = chunk->code.values[last];
+        if((op == OP_POP || op == OP_POPN) && last + chunk_instr_length(op) == chunk->code.length) {
+            size_t merged = count + (op == OP_POP ? 1 : chunk->code.values[last + 1]);
+            if(merged <= UINT8_MAX) {
+                chunk_truncate(chunk, last);
+                count = merged;
+            }
+        }
+    }
+
+    cpl->pops_offset = cpl_current_offset(cpl);
+    if(count == 1)
+        cpl_emit_byte(cpl, OP_POP);
+    else
+        cpl_emit_bytes(cpl, OP_POPN, (uint8_t) count);
+}
+
+// the locals of a function are left for its OP_RETURN, which drops its whole frame
 static void cpl_end_scope(LoxSPCompiler * cpl, bool of_func) {
     ASSERT(cpl->currentScope > 0);
 
-    // FIXME: use a OP_POP_N instruction
     ssize_t i;
-    for(i = (ssize_t) cpl->localsCount - 1; i >= 0 && cpl->locals[i].scope == cpl->currentScope; i--) {
-        if(!of_func) cpl_emit_byte(cpl, OP_POP);
-    }
+    for(i = (ssize_t) cpl->localsCount - 1; i >= 0 && cpl->locals[i].scope == cpl->currentScope; i--)
+        ;
+    size_t count = cpl->localsCount - (i + 1);
+    if(!of_func) cpl_emit_pops(cpl, count);
 
-    cpl->localsCount -= cpl->localsCount - (i + 1);
+    cpl->localsCount -= count;
     cpl->currentScope--;
 }
 
@@ -279,16 +543,12 @@ static void cpl_alloc_local_var(LoxSPCompiler * cpl, Token name) {
     }
 }
 
-static inline size_t cpl_current_offset(LoxSPCompiler * cpl) {
-    return cpl_chunk(cpl)->code.length;
-}
-
 static void cpl_write_jump_length(LoxSPCompiler * cpl, size_t offset, size_t length) {
     if(length > UINT16_MAX) {
         cpl_error_at(cpl, &cpl->previous, "jump length larger than 65535");
     } else {
-        da_get_ptr(&cpl_chunk(cpl)->code, offset - 1)->op_code = length >> 8 & 0xFF;
-        da_get_ptr(&cpl_chunk(cpl)->code, offset - 2)->op_code = length & 0xFF;
+        da_set(&cpl_chunk(cpl)->code, offset - 1, length >> 8 & 0xFF);
+        da_set(&cpl_chunk(cpl)->code, offset - 2, length & 0xFF);
     }
 }
 
@@ -307,6 +567,43 @@ static void cpl_emit_loop(LoxSPCompiler * cpl, size_t target_instr_offset) {
 static inline void cpl_complete_jump(LoxSPCompiler * cpl, size_t jump_op_offset) {
     size_t length = cpl_chunk(cpl)->code.length - jump_op_offset;
     cpl_write_jump_length(cpl, jump_op_offset, length);
+    cpl->jump_target = cpl_current_offset(cpl);
+}
+
+// Emits the jump taken when the condition compiled from `cond_offset` on is false,
+// the condition is popped either way. A `local < constant` condition is replaced by
+// a single OP_LESS_LOCAL_CONST_JUMP.
+static size_t cpl_emit_cond_jump(LoxSPCompiler * cpl, size_t cond_offset) {
+    LoxChunk * chunk    = cpl_chunk(cpl);
+    const uint8_t * code = &chunk->code.values[cond_offset];
+
+    if(chunk->code.length - cond_offset == 5 && code[0] == OP_GET_LOCAL && code[2] == OP_CONST && code[4] == OP_LESS) {
+        uint8_t slot = code[1], constant = code[3];
+        chunk_truncate(chunk, cond_offset);
+        cpl_emit_bytes(cpl, OP_LESS_LOCAL_CONST_JUMP, slot);
+        cpl_emit_byte(cpl, constant);
+        cpl_emit_bytes(cpl, 0, 0);
+        return chunk->code.length;
+    }
+
+    return cpl_emit_jump(cpl, OP_JUMP_IF_FALSE_POP);
+}
+
+// replaces the value of `local = local + constant` (compiled from `value_offset` on)
+// by a single OP_INC_LOCAL, which also stores it
+static bool cpl_fuse_local_increment(LoxSPCompiler * cpl, size_t value_offset, uint8_t slot) {
+    LoxChunk * chunk     = cpl_chunk(cpl);
+    const uint8_t * code = &chunk->code.values[value_offset];
+
+    if(chunk->code.length - value_offset != 5 || code[0] != OP_GET_LOCAL || code[1] != slot 
+        || code[2] != OP_CONST || code[4] != OP_ADD)
+        return false;
+
+    uint8_t constant = code[3];
+    chunk_truncate(chunk, value_offset);
+    cpl_emit_bytes(cpl, OP_INC_LOCAL, slot);
+    cpl_emit_byte(cpl, constant);
+    return true;
 }
 
 // actually parsing stuffs
@@ -315,7 +612,7 @@ static void cpl_compile_string(LoxSPCompiler * cpl) {
     const char * chars = &token->start[1];
     size_t length = token->length - 2;
 
-    cpl_emit_bytes(cpl, OP_CONST, cpl_add_str_constant(cpl, chars, length));
+    cpl_emit_constant(cpl, OBJ_VAL(lox_str_intern(cpl->gc, cpl->strings, chars, length)));
 }
 
 static void cpl_compile_number(LoxSPCompiler * cpl) {
@@ -329,16 +626,22 @@ static void cpl_compile_variable(LoxSPCompiler * cpl) {
 
     Token * name = &cpl->previous;
     if(cpl_in_global_scope(cpl) || (idx = cpl_find_local_var(cpl, name)) == NO_LOCAL_VAR) {
-        idx = cpl_add_str_constant(cpl, name->start, name->length);
+        idx = cpl_global_slot(cpl, name);
         is_global = true;
     }
 
-    ASSERT(idx <= UINT8_MAX && idx >= 0);
+    ASSERT(idx >= 0 && (is_global || idx <= UINT8_MAX));
     if(cpl->can_assign && cpl_match(cpl, TOKEN_EQUAL)) {
+        size_t value_offset = cpl_current_offset(cpl);
         cpl_compile_expression(cpl);
-        cpl_emit_bytes(cpl, is_global ? OP_SET_GLOBAL : OP_SET_LOCAL, (uint8_t) idx);
+        if(is_global)
+            cpl_emit_operand(cpl, OP_SET_GLOBAL_SLOT, OP_SET_GLOBAL_SLOT_LONG, idx);
+        else if(!cpl_fuse_local_increment(cpl, value_offset, (uint8_t) idx))
+            cpl_emit_bytes(cpl, OP_SET_LOCAL, (uint8_t) idx);
+    } else if(is_global) {
+        cpl_emit_operand(cpl, OP_GET_GLOBAL_SLOT, OP_GET_GLOBAL_SLOT_LONG, idx);
     } else {
-        cpl_emit_bytes(cpl, is_global ? OP_GET_GLOBAL : OP_GET_LOCAL, (uint8_t) idx);
+        cpl_emit_bytes(cpl, OP_GET_LOCAL, (uint8_t) idx);
     }
 }
 
@@ -371,8 +674,22 @@ static void cpl_compile_primary(LoxSPCompiler * cpl) {
 
 static void cpl_compile_unary(LoxSPCompiler * cpl) {
     TokenType op = cpl->previous.type;
+    size_t offset    = cpl_current_offset(cpl);
+    size_t constants = cpl_chunk(cpl)->constants.length;
     cpl_parse_precedence(cpl, PREC_UNARY);
 
+    LoxValue value;
+    if(cpl_constant_at(cpl, offset, cpl_current_offset(cpl), &value)) {
+        if(op == TOKEN_MINUS && VAL_IS_NUMBER(value)) {
+            cpl_fold(cpl, offset, constants, NUMBER_VAL(-VAL_AS_NUMBER(value)));
+            return;
+        }
+        if(op == TOKEN_BANG && VAL_IS_BOOL(value)) {
+            cpl_fold(cpl, offset, constants, BOOL_VAL(!VAL_AS_BOOL(value)));
+            return;
+        }
+    }
+
     switch(op) {
         case TOKEN_MINUS: cpl_emit_byte(cpl, OP_NEG); break;
         case TOKEN_BANG : cpl_emit_byte(cpl, OP_NOT); break;
@@ -388,10 +705,36 @@ static void cpl_compile_grouping(LoxSPCompiler * cpl){
 static void cpl_compile_binary(LoxSPCompiler * cpl) {
     TokenType op = cpl->previous.type;
     ExprPrecedence prec = get_parse_rule(op)->precedence;
+    size_t left_offset    = cpl->operand_offset;
+    size_t left_constants = cpl->operand_constants;
+    size_t right_offset   = cpl_current_offset(cpl);
 
-    if(prec != PREC_AND && prec != PREC_OR)
+    if(prec != PREC_AND && prec != PREC_OR) {
         cpl_parse_precedence(cpl, prec + 1);
 
+        LoxValue a, b, result;
+        if(cpl_constant_at(cpl, left_offset, right_offset, &a)
+            && cpl_constant_at(cpl, right_offset, cpl_current_offset(cpl), &b)
+            && cpl_fold_binary(cpl, op, a, b, &result)) {
+            cpl_fold(cpl, left_offset, left_constants, result);
+            return;
+        }
+    } else {
+        // a constant left operand decides which side is the result, the other one
+        // is compiled (for its errors) and dropped
+        LoxValue a;
+        if(cpl_constant_at(cpl, left_offset, right_offset, &a)) {
+            if((op == TOKEN_AND) == cpl_is_falsy(a)) {
+                cpl_parse_precedence(cpl, prec + 1);
+                cpl_fold(cpl, left_offset, left_constants, a);
+            } else {
+                cpl_drop(cpl, left_offset, left_constants);
+                cpl_parse_precedence(cpl, prec + 1);
+            }
+            return;
+        }
+    }
+
     switch(op) {
         // arithmetic
         case TOKEN_PLUS  : cpl_emit_byte(cpl, OP_ADD);  break;
@@ -417,11 +760,11 @@ static void cpl_compile_binary(LoxSPCompiler * cpl) {
 
         // comparison
         case TOKEN_EQUAL_EQUAL   : cpl_emit_byte(cpl, OP_EQ);                       break;
-        case TOKEN_BANG_EQUAL    : cpl_emit_bytes(cpl, OP_EQ, OP_NOT);      break;
+        case TOKEN_BANG_EQUAL    : cpl_emit_byte(cpl, OP_NOT_EQ);                   break;
         case TOKEN_GREATER       : cpl_emit_byte(cpl, OP_GREATER);                  break;
         case TOKEN_LESS          : cpl_emit_byte(cpl, OP_LESS);                     break;
-        case TOKEN_GREATER_EQUAL : cpl_emit_bytes(cpl, OP_LESS, OP_NOT);    break;
-        case TOKEN_LESS_EQUAL    : cpl_emit_bytes(cpl, OP_GREATER, OP_NOT); break;
+        case TOKEN_GREATER_EQUAL : cpl_emit_byte(cpl, OP_GREATER_EQ);               break;
+        case TOKEN_LESS_EQUAL    : cpl_emit_byte(cpl, OP_LESS_EQ);                  break;
 
         default: UNREACHABLE();
     }
@@ -433,8 +776,7 @@ static void cpl_compile_expression(LoxSPCompiler * cpl){
 
 static void cpl_define_var(LoxSPCompiler * cpl, Token name) {
     if(cpl_in_global_scope(cpl)) {
-        uint8_t idx = cpl_add_str_constant(cpl, name.start, name.length);
-        cpl_emit_bytes(cpl, OP_DEFINE_GLOBAL, idx);
+        cpl_emit_operand(cpl, OP_DEFINE_GLOBAL_SLOT, OP_DEFINE_GLOBAL_SLOT_LONG, cpl_global_slot(cpl, &name));
     } else {
         cpl_alloc_local_var(cpl, name);
     }
@@ -466,24 +808,20 @@ static void cpl_compile_statement(LoxSPCompiler * cpl) {
         cpl_end_scope(cpl, false);
     } else if(cpl_match(cpl, TOKEN_IF)) { // if statement
         cpl_consume(cpl, TOKEN_LEFT_PAREN, "expected '(' after if keyword");
+        size_t cond_offset = cpl_current_offset(cpl);
         cpl_compile_expression(cpl);
         cpl_consume(cpl, TOKEN_RIGHT_PAREN, "expected ')' after if expression");
 
-        size_t if_jump_offset = cpl_emit_jump(cpl, OP_IF_FALSE);
-        cpl_emit_byte(cpl, OP_POP);
+        size_t if_jump_offset = cpl_emit_cond_jump(cpl, cond_offset);
         cpl_compile_statement(cpl);
 
         if(cpl_match(cpl, TOKEN_ELSE)) {
             size_t else_jump_offset = cpl_emit_jump(cpl, OP_JUMP);
             cpl_complete_jump(cpl, if_jump_offset);
-            cpl_emit_byte(cpl, OP_POP);
             cpl_compile_statement(cpl);
             cpl_complete_jump(cpl, else_jump_offset);
         } else {
-            size_t silly_jump = cpl_emit_jump(cpl, OP_JUMP);
             cpl_complete_jump(cpl, if_jump_offset);
-            cpl_emit_byte(cpl, OP_POP);
-            cpl_complete_jump(cpl, silly_jump);
         }
 
     } else if(cpl_match(cpl, TOKEN_FOR)) { // for statement
@@ -496,7 +834,7 @@ static void cpl_compile_statement(LoxSPCompiler * cpl) {
                     cpl_compile_var_declaration(cpl);
                 else {
                     cpl_compile_expression(cpl);
-                    cpl_emit_byte(cpl, OP_POP);
+                    cpl_emit_pops(cpl, 1);
                 }
                 cpl_consume(cpl, TOKEN_SEMICOLON, "expected ';' after for loop initialization");
             }
@@ -509,8 +847,7 @@ static void cpl_compile_statement(LoxSPCompiler * cpl) {
                 cpl_emit_byte(cpl, OP_TRUE);
             }
 
-            size_t jump_to_end_offset  = cpl_emit_jump(cpl, OP_IF_FALSE);
-            cpl_emit_byte(cpl, OP_POP);
+            size_t jump_to_end_offset  = cpl_emit_cond_jump(cpl, cond_offset);
             size_t jump_to_body_offset = cpl_emit_jump(cpl, OP_JUMP);
 
             size_t end_offset = cpl_current_offset(cpl);
@@ -526,7 +863,6 @@ static void cpl_compile_statement(LoxSPCompiler * cpl) {
             cpl_emit_loop(cpl, end_offset);
 
             cpl_complete_jump(cpl, jump_to_end_offset);
-            cpl_emit_byte(cpl, OP_POP); // for `for's condition`
 
         cpl_end_scope(cpl, false);
     } else if(cpl_match(cpl, TOKEN_WHILE)) { // while statement
@@ -536,13 +872,11 @@ static void cpl_compile_statement(LoxSPCompiler * cpl) {
         cpl_compile_expression(cpl);
         cpl_consume(cpl, TOKEN_RIGHT_PAREN, "expected ')' after while expression");
 
-        size_t while_jump_offset = cpl_emit_jump(cpl, OP_IF_FALSE);
-        cpl_emit_byte(cpl, OP_POP);
+        size_t while_jump_offset = cpl_emit_cond_jump(cpl, while_expr_offset);
         cpl_compile_statement(cpl);
         cpl_emit_loop(cpl, while_expr_offset);
 
         cpl_complete_jump(cpl, while_jump_offset);
-        cpl_emit_byte(cpl, OP_POP);
     } else if (cpl_match(cpl, TOKEN_RETURN)) {
         if(cpl->script->type == FUNC_SCRIPT)
             cpl_error_at(cpl, &cpl->previous, "cannot return from the top level");
@@ -555,20 +889,27 @@ static void cpl_compile_statement(LoxSPCompiler * cpl) {
         }
     } else { // expression statement
         cpl_compile_expression(cpl);
-        cpl_emit_byte(cpl, OP_POP);
+        cpl_emit_pops(cpl, 1);
         cpl_consume_semicolon(cpl);
     }
 }
 
 static void cpl_compile_function_body(LoxSPCompiler * cpl, const LoxString * func_name, LoxFuncType type) {
-    LoxFunction * func     = lox_func_create(func_name, type);
-    cpl_emit_bytes(cpl, OP_CONST, cpl_add_constant(cpl, OBJ_VAL(func)));
+    LoxFunction * func     = lox_func_create(cpl->gc, func_name, type);
+    gc_push_root(cpl->gc, OBJ_VAL(func));
+    cpl_emit_constant(cpl, OBJ_VAL(func));
 
     if(type == FUNC_ORDINARY) 
         cpl_define_var(cpl, cpl->previous);
 
     LoxFunction * backup   = cpl->script;
-    cpl->script = func;
+    ConstIndex backup_constants = cpl->constants;
+    size_t backup_pops_offset   = cpl->pops_offset;
+    size_t backup_jump_target   = cpl->jump_target;
+    cpl->script      = func;
+    cpl->pops_offset = SIZE_MAX;
+    cpl->jump_target = 0;
+    const_index_init(&cpl->constants);
     uint32_t lastLocalsStart = cpl_begin_func(cpl);
     cpl_consume(cpl, TOKEN_LEFT_PAREN, "expected '(' before function parameters");
     if(!cpl_match(cpl, TOKEN_RIGHT_PAREN)) {
@@ -586,7 +927,12 @@ static void cpl_compile_function_body(LoxSPCompiler * cpl, const LoxString * fun
     cpl_consume(cpl, TOKEN_RIGHT_BRACE, "expected '}' after function body");
     cpl_emit_bytes(cpl, OP_NIL, OP_RETURN);
     cpl_end_func(cpl, lastLocalsStart); // TODO: fix this
-    cpl->script = backup;
+    const_index_destroy(&cpl->constants);
+    cpl->script    = backup;
+    cpl->constants = backup_constants;
+    cpl->pops_offset = backup_pops_offset;
+    cpl->jump_target = backup_jump_target;
+    gc_pop_root(cpl->gc);
 }
 
 static void cpl_compile_anonymous_function(LoxSPCompiler * cpl) {
@@ -599,8 +945,10 @@ static void cpl_compile_declaration(LoxSPCompiler * cpl) {
         cpl_consume_semicolon(cpl);
     } else if (cpl_match(cpl, TOKEN_FUN)) {
         cpl_consume(cpl, TOKEN_IDENTIFIER, "expected identifier after 'fun' keyword");
-        const LoxString * name = lox_str_intern(cpl->strings, cpl->previous.start, cpl->previous.length);
+        const LoxString * name = lox_str_intern(cpl->gc, cpl->strings, cpl->previous.start, cpl->previous.length);
+        gc_push_root(cpl->gc, OBJ_VAL(name));
         cpl_compile_function_body(cpl, name, FUNC_ORDINARY);
+        gc_pop_root(cpl->gc);
     } else {
         cpl_compile_statement(cpl);
     }
@@ -611,14 +959,19 @@ static void cpl_destroy(LoxSPCompiler * cpl) {
     sc_destroy(&cpl->in);
 
     cpl->strings  = NULL;
+    cpl->globals  = NULL;
     memset(&cpl->previous, 0, sizeof(Token));
     memset(&cpl->current, 0, sizeof(Token));
 
     cpl->error_found   = false;
     cpl->in_panic_mode = false;
+    const_index_destroy(&cpl->constants);
+
+    gc_pop_root(cpl->gc);
+    cpl->gc = NULL;
 }
 
-static LoxParserRule rules[] = {
+static const LoxParserRule rules[] = {
     [TOKEN_LEFT_PAREN]    = { cpl_compile_grouping, cpl_compile_call, PREC_PRIMARY },
     [TOKEN_RIGHT_PAREN]   = { NULL, NULL, PREC_NONE },
     [TOKEN_LEFT_BRACE]    = { NULL, NULL, PREC_NONE },
@@ -667,7 +1020,7 @@ static LoxParserRule rules[] = {
     [TOKEN_EOF]           = { NULL, NULL, PREC_NONE },
 };
 
-static LoxParserRule * get_parse_rule(TokenType tt){ 
+static const LoxParserRule * get_parse_rule(TokenType tt){ 
     ASSERTF(tt < sizeof(rules) / sizeof(LoxParserRule), "invalid token type");
     return &rules[tt];
 }
@@ -678,20 +1031,19 @@ static LoxFunction * cpl_compile(LoxSPCompiler * cpl) {
         while(!cpl_match(cpl, TOKEN_EOF)){
             cpl_compile_declaration(cpl);
         }
-        cpl_emit_bytes(cpl, OP_POP, OP_RETURN);
+        cpl_emit_pops(cpl, 1);
+        cpl_emit_byte(cpl, OP_RETURN);
     cpl_end_func(cpl, 0);
     return cpl->script;
 }
 
-LoxFunction * compile(const char * source, HashMap * strings) {
+LoxFunction * compile(const char * source, LoxGC * gc, HashMap * strings, LoxGlobals * globals) {
     LoxSPCompiler cpl;
-    cpl_init(&cpl, source, strings);
+    cpl_init(&cpl, source, gc, strings, globals);
 
+    // on error the script is simply left for the collector
     LoxFunction * script = cpl_compile(&cpl);
-    if(cpl.error_found) {
-        lox_obj_destroy((LoxObject*) script);
-        script = NULL;
-    }
+    if(cpl.error_found) script = NULL;
 
     cpl_destroy(&cpl);
     return script;
@@ -5,7 +5,9 @@
 #include "chunk.h"
 #include "function.h"
 #include "hash-map.h"
+#include "gc.h"
+#include "globals.h"
 
-LoxFunction * compile(const char * source, HashMap * strings);
+LoxFunction * compile(const char * source, LoxGC * gc, HashMap * strings, LoxGlobals * globals);
 
 #endif 
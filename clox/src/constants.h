@@ -1,5 +1,25 @@
 #include <stdint.h>
 
 #define MAX_LOCALS (UINT8_MAX + 1)
-#define MAX_STACK_FRAMES 64
+#define MAX_STACK_FRAMES 64 // nested function declarations the compiler keeps locals for
 #define MAX_ARGS UINT8_MAX
+#define MAX_CONSTANTS (1 << 24) // per chunk, the long operands are 24 bits wide
+#define MAX_GLOBALS   (1 << 24)
+
+// the vm stack and call frames start this small and grow on demand
+#define VM_STACK_INITIAL  256
+#define VM_FRAMES_INITIAL 16
+#define VM_MAX_FRAMES     100000 // default limit of nested calls, see `LoxVMConfig`
+#define VM_TRACE_FRAMES   32     // deeper runtime error traces only show both ends
+
+// garbage collector defaults, see `LoxGC`
+#define GC_MIN_HEAP         (1024 * 1024)
+#define GC_HEAP_GROW_FACTOR 2.0
+#define GC_NURSERY_SIZE     (256 * 1024)
+#define GC_NURSERY_MAX_OBJ  (GC_NURSERY_SIZE / 16) // bigger objects are born old
+
+// sampling profiler (--profile), see `LoxProfiler`
+#define PROFILE_HZ         1000
+#define PROFILE_MAX_DEPTH  128       // innermost frames kept of deeper stacks
+#define PROFILE_MAX_STACKS (1 << 14) // distinct stacks, must be a power of two
+#define PROFILE_MAX_FRAMES (1 << 18)
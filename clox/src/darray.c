@@ -44,6 +44,23 @@ void da_push(DaArrayAny * array, const void * elem) {
     memcpy(ptr, elem, array->elem_size);
 }
 
+// pushes `count` elements at once, growing the array at most once
+void da_push_all(DaArrayAny * array, const void * elems, size_t count) {
+    if(count == 0) return;
+
+    if(array->length + count > array->size) {
+        size_t size = array->size;
+        while(size < array->length + count)
+            size = GROW_CAPACITY(size);
+
+        array->size   = size;
+        array->values = mem_realloc(array->values, array->size * array->elem_size);
+    }
+
+    memcpy(array->values + array->length * array->elem_size, elems, count * array->elem_size);
+    array->length += count;
+}
+
 void * da_pop(DaArrayAny * array) {
     ASSERTF(array->length > 0 , "called `da_pop()` from an empty array");
     void * ptr = da_get_ptr(array, array->length - 1);
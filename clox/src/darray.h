@@ -14,6 +14,7 @@ typedef DaArray(void) DaArrayAny;
 
 void da_init(DaArrayAny * array, size_t elem_size);
 void da_push(DaArrayAny * array, const void * elem);
+void da_push_all(DaArrayAny * array, const void * elems, size_t count);
 void * da_pop(DaArrayAny * array);
 void * da_get_elem(const DaArrayAny * array, size_t idx);
 void da_set(DaArrayAny * array, size_t idx, const void * value);
@@ -36,6 +37,7 @@ void da_destroy(DaArrayAny * array);
                                         da_basic_type(array) __e__ = elem;        \
                                         da_push((DaArrayAny *) array, &__e__);    \
                                     } while(0)
+#define da_push_all(array, elems, count) da_push_all((DaArrayAny *) (array), (elems), (count))
 #define da_set(array, idx, value)  do {                                           \
                                         da_basic_type(array) __e__ = value;       \
                                         da_set((DaArrayAny *) array, idx, &__e__); \
@@ -1,3 +1,4 @@
 #ifdef DEBUG
 #define DEBUG_TRACE_EXECUTION
+#define DEBUG_LOG_GC
 #endif
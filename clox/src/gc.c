@@ -0,0 +1,343 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "gc.h"
+#include "chunk.h"
+#include "regcode.h"
+#include "memory.h"
+#include "constants.h"
+#include "debug.h"
+#include "utils.h"
+
+#define GC_ALIGN(size) (((size) + 7) & ~(size_t) 7)
+
+void gc_init(LoxGC * gc, HashMap * strings, GcMarkRoots mark_roots, void * roots_ctx) {
+    gc->objects = NULL;
+    da_init(&gc->gray);
+
+    uint8_t * nursery = mem_alloc(GC_NURSERY_SIZE);
+    gc->nursery = (LoxNursery) {
+        .start = nursery,
+        .top   = nursery,
+        .end   = nursery + GC_NURSERY_SIZE,
+    };
+    gc->collecting_young = false;
+    da_init(&gc->temp_roots);
+
+    gc->strings    = strings;
+    gc->mark_roots = mark_roots;
+    gc->roots_ctx  = roots_ctx;
+
+    gc->bytes_allocated = 0;
+    gc->stats           = (LoxGCStats) {0};
+    gc_configure(gc, GC_MIN_HEAP, GC_HEAP_GROW_FACTOR);
+}
+
+void gc_configure(LoxGC * gc, size_t min_heap, double grow_factor) {
+    ASSERTF(grow_factor >= 1, "heap grow factor should be at least 1 (got %g)", grow_factor);
+    gc->min_heap    = min_heap;
+    gc->grow_factor = grow_factor;
+    gc->next_gc     = min_heap;
+}
+
+static void gc_free_object(LoxGC * gc, LoxObject * obj) {
+    switch(obj->type) {
+        case OBJ_STRING: {
+            LoxString * str = (LoxString *) obj;
+            gc_realloc(gc, str, lox_str_size(str->length), 0);
+        } break;
+        case OBJ_FUNC: {
+            LoxFunction * func = (LoxFunction *) obj;
+            chunk_destroy(&func->chunk);
+            regcode_free(func->reg);
+            gc_realloc(gc, func, sizeof(LoxFunction), 0);
+        } break;
+        case OBJ_NATIVE_FN:
+            gc_realloc(gc, obj, sizeof(LoxNativeFn), 0);
+            break;
+        default:
+            UNREACHABLE();
+    }
+}
+
+void gc_destroy(LoxGC * gc) {
+    for(LoxObject * curr = gc->objects; curr;) {
+        LoxObject * next = curr->next;
+        gc_free_object(gc, curr);
+        curr = next;
+    }
+    gc->objects = NULL;
+
+    // young objects own no other memory, dropping the arena is enough
+    mem_dealloc(gc->nursery.start);
+    gc->nursery = (LoxNursery) {0};
+
+    da_destroy(&gc->gray);
+    da_destroy(&gc->temp_roots);
+    gc->strings = NULL;
+}
+
+static void * gc_realloc_no_collect(LoxGC * gc, void * ptr, size_t old_size, size_t new_size) {
+    if(new_size > old_size) {
+        gc->bytes_allocated += new_size - old_size;
+        gc->stats.bytes_allocated_total += new_size - old_size;
+    } else {
+        gc->bytes_allocated -= old_size - new_size;
+        gc->stats.bytes_freed_total += old_size - new_size;
+    }
+
+    if(new_size == 0) {
+        mem_dealloc(ptr);
+        return NULL;
+    }
+    return mem_realloc(ptr, new_size);
+}
+
+void * gc_realloc(LoxGC * gc, void * ptr, size_t old_size, size_t new_size) {
+#ifdef DEBUG_STRESS_GC
+    if(new_size > old_size) gc_collect(gc);
+#else
+    if(new_size > old_size && gc->bytes_allocated + (new_size - old_size) > gc->next_gc)
+        gc_collect(gc);
+#endif
+    return gc_realloc_no_collect(gc, ptr, old_size, new_size);
+}
+
+static void gc_link_object(LoxGC * gc, LoxObject * obj, LoxObjectType type) {
+    obj->type      = type;
+    obj->is_marked = false;
+    obj->next      = gc->objects;
+    gc->objects    = obj;
+}
+
+LoxObject * gc_alloc_object(LoxGC * gc, size_t size, LoxObjectType type) {
+    LoxObject * obj = gc_realloc(gc, NULL, 0, size);
+    gc_link_object(gc, obj, type);
+    return obj;
+}
+
+#ifdef GC_NO_NURSERY
+// every object is born old, only there to measure what the nursery buys (see `make bench-nursery`)
+LoxObject * gc_alloc_young(__attribute__((unused)) LoxGC * gc, __attribute__((unused)) size_t size,
+                           __attribute__((unused)) LoxObjectType type) {
+    return NULL;
+}
+#else
+// returns NULL when the object is too big to be born young
+LoxObject * gc_alloc_young(LoxGC * gc, size_t size, LoxObjectType type) {
+    LoxNursery * nursery = &gc->nursery;
+
+    size = GC_ALIGN(size);
+    if(size > GC_NURSERY_MAX_OBJ) return NULL;
+
+#ifdef DEBUG_STRESS_GC
+    gc_collect(gc);
+#else
+    if(nursery->top + size > nursery->end) {
+        gc_minor_collect(gc);
+        // the promoted objects may have pushed the old generation over its limit
+        if(gc->bytes_allocated > gc->next_gc) gc_collect(gc);
+    }
+#endif
+
+    LoxObject * obj = (LoxObject *) nursery->top;
+    nursery->top += size;
+    gc->stats.young_bytes_allocated_total += size;
+
+    obj->type      = type;
+    obj->is_marked = false;
+    obj->next      = NULL;
+    return obj;
+}
+#endif
+
+static size_t gc_young_size(const LoxObject * obj) {
+    switch(obj->type) {
+        case OBJ_STRING: return GC_ALIGN(lox_str_size(((const LoxString *) obj)->length));
+        default:
+            // only strings are allocated young, see `lox_str_alloc`
+            UNREACHABLE();
+    }
+}
+
+// copies a young object to the old generation (at most once)
+static LoxObject * gc_promote(LoxGC * gc, LoxObject * obj) {
+    if(obj->next != NULL) return obj->next;
+
+    LoxObject * promoted;
+    switch(obj->type) {
+        case OBJ_STRING: {
+            size_t size = lox_str_size(((LoxString *) obj)->length);
+            promoted    = gc_realloc_no_collect(gc, NULL, 0, size);
+            memcpy(promoted, obj, size);
+        } break;
+        default:
+            UNREACHABLE();
+    }
+
+    gc_link_object(gc, promoted, obj->type);
+    gc->stats.young_bytes_promoted_total += gc_young_size(obj);
+    obj->next = promoted;
+    return promoted;
+}
+
+void gc_push_root(LoxGC * gc, LoxValue value) {
+    da_push(&gc->temp_roots, value);
+}
+
+void gc_pop_root(LoxGC * gc) {
+    ASSERTF(gc->temp_roots.length > 0, "no temporary root to pop");
+    gc->temp_roots.length--;
+}
+
+void gc_mark_object(LoxGC * gc, LoxObject * obj) {
+    if(obj == NULL || obj->is_marked) return;
+    obj->is_marked = true;
+    da_push(&gc->gray, obj);
+}
+
+// marks the root on a full collection, on a minor one it promotes the young object
+// the slot refers to and updates the slot with its new address
+void gc_visit_root(LoxGC * gc, LoxValue * slot) {
+    if(!gc->collecting_young)
+        gc_mark_value(gc, *slot);
+    else if(gc_is_young_value(gc, *slot))
+        *slot = OBJ_VAL(gc_promote(gc, VAL_AS_OBJ(*slot)));
+}
+
+void gc_mark_value(LoxGC * gc, LoxValue value) {
+    if(VAL_IS_OBJ(value)) gc_mark_object(gc, VAL_AS_OBJ(value));
+}
+
+void gc_mark_map(LoxGC * gc, const HashMap * map) {
+    for(size_t i = 0; i < map->capacity; i++) {
+        HashMapEntry * entry = &map->entries[i];
+        if(entry->key == NULL) continue;
+        gc_mark_object(gc, (LoxObject *) entry->key);
+        gc_mark_value(gc, entry->value);
+    }
+}
+
+static void gc_blacken_object(LoxGC * gc, LoxObject * obj) {
+    switch(obj->type) {
+        case OBJ_STRING:
+        case OBJ_NATIVE_FN:
+            break;
+        case OBJ_FUNC: {
+            LoxFunction * func = (LoxFunction *) obj;
+            gc_mark_object(gc, (LoxObject *) func->name);
+            for(size_t i = 0; i < func->chunk.constants.length; i++)
+                gc_mark_value(gc, func->chunk.constants.values[i]);
+        } break;
+        default:
+            UNREACHABLE();
+    }
+}
+
+static void gc_sweep(LoxGC * gc) {
+    LoxObject ** link = &gc->objects;
+    while(*link) {
+        LoxObject * obj = *link;
+        if(obj->is_marked) {
+            obj->is_marked = false;
+            link = &obj->next;
+        } else {
+            *link = obj->next;
+            gc_free_object(gc, obj);
+        }
+    }
+}
+
+void gc_minor_collect(LoxGC * gc) {
+    LoxNursery * nursery = &gc->nursery;
+    if(nursery->top == nursery->start) return;
+
+    uint64_t start = time_monotonic_ns();
+    gc->collecting_young = true;
+
+    for(size_t i = 0; i < gc->temp_roots.length; i++)
+        gc_visit_root(gc, &gc->temp_roots.values[i]);
+    if(gc->mark_roots != NULL)
+        gc->mark_roots(gc, gc->roots_ctx, true);
+
+    // the intern table holds weak references: it follows the survivors and forgets the rest
+    for(uint8_t * ptr = nursery->start; ptr < nursery->top; ptr += gc_young_size((LoxObject *) ptr)) {
+        LoxObject * obj = (LoxObject *) ptr;
+        if(obj->type != OBJ_STRING || gc->strings == NULL) continue;
+
+        if(obj->next != NULL)
+            map_replace_key(gc->strings, (LoxString *) obj, (LoxString *) obj->next);
+        else
+            map_delete(gc->strings, (LoxString *) obj);
+    }
+
+#ifdef DEBUG_STRESS_GC
+    memset(nursery->start, 0xAB, nursery->top - nursery->start); // makes stale young pointers blow up
+#endif
+    nursery->top = nursery->start;
+    gc->collecting_young = false;
+
+    gc->stats.minor_collections++;
+    gc->stats.minor_pause_ns_total += time_monotonic_ns() - start;
+}
+
+void gc_collect(LoxGC * gc) {
+    // only the old generation is traced, so the nursery is emptied first
+    gc_minor_collect(gc);
+
+    uint64_t start = time_monotonic_ns();
+#ifdef DEBUG_LOG_GC
+    size_t before = gc->bytes_allocated;
+#endif
+
+    for(size_t i = 0; i < gc->temp_roots.length; i++)
+        gc_visit_root(gc, &gc->temp_roots.values[i]);
+    if(gc->mark_roots != NULL)
+        gc->mark_roots(gc, gc->roots_ctx, false);
+
+    while(gc->gray.length > 0) {
+        LoxObject * obj = da_pop(&gc->gray);
+        gc_blacken_object(gc, obj);
+    }
+
+    if(gc->strings != NULL)
+        map_remove_unmarked(gc->strings);
+    gc_sweep(gc);
+
+    size_t next_gc = gc->bytes_allocated * gc->grow_factor;
+    gc->next_gc    = next_gc > gc->min_heap ? next_gc : gc->min_heap;
+
+    uint64_t pause = time_monotonic_ns() - start;
+    gc->stats.collections++;
+    gc->stats.last_pause_ns   = pause;
+    gc->stats.total_pause_ns += pause;
+    if(pause > gc->stats.max_pause_ns) gc->stats.max_pause_ns = pause;
+
+#ifdef DEBUG_LOG_GC
+    fprintf(stderr, "-- gc: collected %zu bytes (from %zu to %zu) next at %zu, took %.3f ms\n",
+        before - gc->bytes_allocated, before, gc->bytes_allocated, gc->next_gc, pause / 1e6);
+#endif
+}
+
+void gc_freeze(LoxGC * gc) {
+    ASSERTF(gc->nursery.top == gc->nursery.start, "young objects can't be frozen");
+    for(LoxObject * obj = gc->objects; obj != NULL; obj = obj->next)
+        obj->is_marked = true;
+}
+
+void gc_print_stats(const LoxGC * gc, FILE * out) {
+    const LoxGCStats * stats = &gc->stats;
+    double avg_pause = stats->collections == 0 ? 0 : (double) stats->total_pause_ns / stats->collections;
+
+    fprintf(out, "=== gc stats ===\n");
+    fprintf(out, "collections         : %zu\n", stats->collections);
+    fprintf(out, "bytes allocated     : %zu\n", stats->bytes_allocated_total);
+    fprintf(out, "bytes freed         : %zu\n", stats->bytes_freed_total);
+    fprintf(out, "bytes live          : %zu\n", gc->bytes_allocated);
+    fprintf(out, "pause (ms)          : last %.3f, avg %.3f, max %.3f, total %.3f\n",
+        stats->last_pause_ns / 1e6, avg_pause / 1e6, stats->max_pause_ns / 1e6, stats->total_pause_ns / 1e6);
+    fprintf(out, "minor collections   : %zu\n", stats->minor_collections);
+    fprintf(out, "young bytes         : %zu\n", stats->young_bytes_allocated_total);
+    fprintf(out, "young bytes promoted: %zu\n", stats->young_bytes_promoted_total);
+    fprintf(out, "minor pause (ms)    : total %.3f\n", stats->minor_pause_ns_total / 1e6);
+}
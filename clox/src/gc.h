@@ -0,0 +1,107 @@
+#ifndef CLOX_GC_H
+#define CLOX_GC_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "value.h"
+#include "hash-map.h"
+#include "darray.h"
+
+struct __lox_gc__;
+
+// `young_only` is set for minor collections, where only the roots that may point
+// into the nursery have to be visited (see `gc_visit_root`)
+typedef void (*GcMarkRoots)(struct __lox_gc__ * gc, void * ctx, bool young_only);
+
+typedef struct {
+    size_t collections;
+    size_t bytes_allocated_total;
+    size_t bytes_freed_total;
+    uint64_t last_pause_ns;
+    uint64_t max_pause_ns;
+    uint64_t total_pause_ns;
+
+    size_t minor_collections;
+    size_t young_bytes_allocated_total;
+    size_t young_bytes_promoted_total;
+    uint64_t minor_pause_ns_total;
+} LoxGCStats;
+
+// Young generation: new objects are bump allocated here and the survivors of a
+// minor collection are copied (promoted) to the regular heap, after which the
+// whole arena is reused. A young object's `next` field is its forwarding pointer.
+typedef struct {
+    uint8_t * start;
+    uint8_t * top;
+    uint8_t * end;
+} LoxNursery;
+
+typedef struct __lox_gc__ {
+    LoxObject * objects;
+    LoxNursery nursery;
+    bool collecting_young;
+    DaArray(LoxObject *) gray;
+    DaArray(LoxValue) temp_roots;
+
+    // weak reference: entries whose key wasn't marked are dropped before sweeping
+    HashMap * strings;
+
+    GcMarkRoots mark_roots;
+    void * roots_ctx;
+
+    size_t bytes_allocated;
+    size_t next_gc;
+
+    // heap growth trigger: after a collection the next one happens once the heap
+    // reaches `max(live bytes * grow_factor, min_heap)`
+    size_t min_heap;
+    double grow_factor;
+
+    LoxGCStats stats;
+} LoxGC;
+
+void gc_init(LoxGC * gc, HashMap * strings, GcMarkRoots mark_roots, void * roots_ctx);
+void gc_configure(LoxGC * gc, size_t min_heap, double grow_factor);
+void gc_destroy(LoxGC * gc);
+
+void * gc_realloc(LoxGC * gc, void * ptr, size_t old_size, size_t new_size);
+LoxObject * gc_alloc_object(LoxGC * gc, size_t size, LoxObjectType type);
+LoxObject * gc_alloc_young(LoxGC * gc, size_t size, LoxObjectType type);
+
+static inline bool gc_is_young(const LoxGC * gc, const LoxObject * obj) {
+    return (const uint8_t *) obj >= gc->nursery.start && (const uint8_t *) obj < gc->nursery.end;
+}
+
+// the write barrier: stores of these values into anything that isn't a root
+// scanned by every minor collection must be remembered by the mutator
+static inline bool gc_is_young_value(const LoxGC * gc, LoxValue value) {
+    return VAL_IS_OBJ(value) && gc_is_young(gc, VAL_AS_OBJ(value));
+}
+
+// values that are only referenced from C code while the collector might run
+void gc_push_root(LoxGC * gc, LoxValue value);
+void gc_pop_root(LoxGC * gc);
+
+void gc_visit_root(LoxGC * gc, LoxValue * slot);
+void gc_mark_value(LoxGC * gc, LoxValue value);
+void gc_mark_object(LoxGC * gc, LoxObject * obj);
+void gc_mark_map(LoxGC * gc, const HashMap * map);
+
+void gc_collect(LoxGC * gc);
+
+// Collections unmark everything they keep, so outside of one only frozen objects are marked
+static inline bool gc_is_frozen(const LoxObject * obj) {
+    return obj->is_marked;
+}
+
+// Marks every object for good, after which the heap must not change nor be collected
+// again. Collections of other heaps can then reach these objects without tracing them
+// or writing to them, which is what lets several vms share them from their own threads.
+void gc_freeze(LoxGC * gc);
+void gc_minor_collect(LoxGC * gc);
+void gc_print_stats(const LoxGC * gc, FILE * out);
+
+#endif
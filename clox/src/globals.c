@@ -0,0 +1,38 @@
+#include "globals.h"
+#include "utils.h"
+
+void globals_init(LoxGlobals * globals) {
+    map_init(&globals->slots);
+    da_init(&globals->names);
+    da_init(&globals->values);
+}
+
+void globals_destroy(LoxGlobals * globals) {
+    map_destroy(&globals->slots);
+    da_destroy(&globals->names);
+    da_destroy(&globals->values);
+}
+
+ssize_t globals_find(const LoxGlobals * globals, const LoxString * name) {
+    const LoxValue * slot = map_get(&globals->slots, name);
+    return slot == NULL ? -1 : (ssize_t) VAL_AS_NUMBER(*slot);
+}
+
+size_t globals_resolve(LoxGlobals * globals, const LoxString * name) {
+    ssize_t slot = globals_find(globals, name);
+    if(slot >= 0) return slot;
+
+    slot = globals->values.length;
+    map_set(&globals->slots, name, NUMBER_VAL(slot));
+    da_push(&globals->names, name);
+    da_push(&globals->values, UNDEFINED_VAL);
+    return slot;
+}
+
+// the names are the keys of `slots` as well, so marking them covers the map
+void globals_mark(LoxGC * gc, const LoxGlobals * globals) {
+    for(size_t i = 0; i < globals->values.length; i++) {
+        gc_mark_object(gc, (LoxObject *) globals->names.values[i]);
+        gc_mark_value(gc, globals->values.values[i]);
+    }
+}
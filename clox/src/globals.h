@@ -0,0 +1,30 @@
+#ifndef CLOX_GLOBALS_H
+#define CLOX_GLOBALS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "value.h"
+#include "hash-map.h"
+#include "darray.h"
+#include "gc.h"
+
+// Global variables live in a flat array of slots. The compiler resolves every global
+// name to its slot once, so the vm never hashes a name at runtime. The slot of a name
+// that was referenced but not defined (yet) holds UNDEFINED_VAL.
+typedef struct {
+    HashMap slots;                    // name => NUMBER_VAL(slot)
+    DaArray(const LoxString *) names; // slot => name (for error messages)
+    DaArray(LoxValue) values;
+} LoxGlobals;
+
+void globals_init(LoxGlobals * globals);
+void globals_destroy(LoxGlobals * globals);
+
+// returns the slot of `name`, creating an undefined one if there isn't any
+size_t globals_resolve(LoxGlobals * globals, const LoxString * name);
+ssize_t globals_find(const LoxGlobals * globals, const LoxString * name);
+
+void globals_mark(LoxGC * gc, const LoxGlobals * globals);
+
+#endif
@@ -1,60 +1,105 @@
 #include <stdio.h>
+#include <string.h>
 
 #include "hash-map.h"
 #include "memory.h"
 #include "utils.h"
 
 #define MAP_MAX_LOAD 0.75
+// capacities are always powers of two, so probing masks the hash instead of using `%`
 #define GROW_CAPACITY(capacity) ((capacity) < 8 ? 8 : (capacity) * 2)
 
-static HashMapEntry * find_entry(HashMapEntry * entries, size_t capacity, const LoxString * key) {
-    ASSERTF(entries != NULL, "invalid entries list");
+// Robin Hood hashing: while inserting, a key takes the slot of any entry that is
+// closer to its home slot than the key already is (the evicted entry carries on
+// probing). This keeps the probe sequences short and lets lookups stop as soon as
+// they meet an entry closer to home than the key would be. Deletion shifts the
+// following entries back one slot, so there are no tombstones.
 
-    size_t idx = key->hash % capacity;
-    HashMapEntry * deleted = NULL;
-    for(;;) {
-        HashMapEntry * current = &entries[idx];
+static inline size_t home_distance(const LoxString * key, size_t idx, size_t mask) {
+    return (idx - (key->hash & mask)) & mask;
+}
+
+static HashMapEntry * find_entry(const HashMap * map, const LoxString * key) {
+    if(map->length == 0) return NULL;
+
+    size_t mask = map->capacity - 1;
+    size_t idx  = key->hash & mask;
+    for(size_t dist = 0;; dist++) {
+        HashMapEntry * current = &map->entries[idx];
 
         if(current->key == key)
             return current;
 
+        if(current->key == NULL || home_distance(current->key, idx, mask) < dist)
+            return NULL;
+
+        idx = (idx + 1) & mask;
+    }
+}
+
+// `key` must not be in `entries` yet
+static void insert_entry(HashMapEntry * entries, size_t mask, const LoxString * key, LoxValue value) {
+    size_t idx = key->hash & mask;
+    for(size_t dist = 0;; dist++) {
+        HashMapEntry * current = &entries[idx];
+
         if(current->key == NULL) {
-            if(VAL_IS_NIL(current->value)) 
-                return deleted ? deleted : current;
-            else if(deleted != NULL)
-                deleted = deleted;
-        } 
+            current->key   = key;
+            current->value = value;
+            return;
+        }
+
+        size_t current_dist = home_distance(current->key, idx, mask);
+        if(current_dist < dist) {
+            HashMapEntry evicted = *current;
+            current->key   = key;
+            current->value = value;
+
+            key   = evicted.key;
+            value = evicted.value;
+            dist  = current_dist;
+        }
+
+        idx = (idx + 1) & mask;
+    }
+}
+
+static void remove_entry(HashMap * map, size_t idx) {
+    size_t mask = map->capacity - 1;
+    for(;;) {
+        size_t next = (idx + 1) & mask;
+        HashMapEntry * entry = &map->entries[next];
+        if(entry->key == NULL || home_distance(entry->key, next, mask) == 0)
+            break;
 
-        idx = (idx + 1) % capacity;
+        map->entries[idx] = *entry;
+        idx = next;
     }
 
+    map->entries[idx].key   = NULL;
+    map->entries[idx].value = NIL_VAL;
+    map->length--;
 }
 
 static void map_adjust_capacity(HashMap * map, size_t new_capacity){
+    ASSERTF((new_capacity & (new_capacity - 1)) == 0, "capacity %zu isn't a power of two", new_capacity);
     HashMapEntry * new_entries = mem_alloc(sizeof(HashMapEntry) * new_capacity);
 
-    // TODO: consider use memset(new_entries, 0, sizeof(HashMapEntry) * new_capacity);
     for(size_t i = 0; i < new_capacity; i++){
         new_entries[i].key   = NULL;
         new_entries[i].value = NIL_VAL;
     }
 
-    size_t new_length = 0;
     for(size_t i = 0; i < map->capacity; i++){
         HashMapEntry * current = &map->entries[i];
-        if(current->key == NULL) continue;
-
-        HashMapEntry * entry = find_entry(new_entries, new_capacity, current->key);
-        entry->key   = current->key;
-        entry->value = current->value;
-        new_length++;
+        if(current->key != NULL)
+            insert_entry(new_entries, new_capacity - 1, current->key, current->value);
     }
 
     mem_dealloc(map->entries);
 
     map->entries  = new_entries;
     map->capacity = new_capacity;
-    map->length   = new_length;
 }
 
 void map_init(HashMap * map) {
@@ -64,20 +109,20 @@ void map_init(HashMap * map) {
 }
 
 bool map_set(HashMap * map, const LoxString * key, LoxValue value) {
+    HashMapEntry * entry = find_entry(map, key);
+    if(entry != NULL) {
+        entry->value = value;
+        return false;
+    }
+
     if(map->length + 1 > map->capacity * MAP_MAX_LOAD ) {
         size_t new_capacity = GROW_CAPACITY(map->capacity);
         map_adjust_capacity(map, new_capacity);
     }
 
-    HashMapEntry * entry = find_entry(map->entries, map->capacity, key);
-
-    bool is_new  = entry->key == NULL;
-    entry->key   = key;
-    entry->value = value;
-
-    if(is_new) 
-        map->length++;
-    return is_new;
+    insert_entry(map->entries, map->capacity - 1, key, value);
+    map->length++;
+    return true;
 }
 
 void map_add_all(HashMap * map, const HashMap * from) {
@@ -91,46 +136,57 @@ void map_add_all(HashMap * map, const HashMap * from) {
 const LoxString * map_find_str(const HashMap * map, const char* chars, size_t length, uint32_t hash) {
     if(map->length == 0) return NULL;
 
-    size_t idx = hash % map->capacity;
-    LoxString tmp = {
-        .obj    = {0},
-        .length = length,
-        .chars  = chars,
-        .hash   = hash,
-    };
+    size_t mask = map->capacity - 1;
+    size_t idx  = hash & mask;
+    for(size_t dist = 0;; dist++) {
+        const LoxString * key = map->entries[idx].key;
+        if(key == NULL || home_distance(key, idx, mask) < dist)
+            return NULL;
 
-    for(;;) {
-        const HashMapEntry * entry = &map->entries[idx];
-        if(entry->key == NULL) {
-            if(VAL_IS_NIL(entry->value))  // stop at non-deleted entry
-                return NULL;
-        } else if(lox_str_eq(&tmp, entry->key))  {
-            return entry->key;
-        }
-        idx = (idx + 1) % map->capacity;
-    }
+        if(key->hash == hash && key->length == length && memcmp(key->chars, chars, length) == 0)
+            return key;
 
+        idx = (idx + 1) & mask;
+    }
 }
 
 const LoxValue * map_get(const HashMap * map, const LoxString * key) {
-    HashMapEntry * entry;
-    return 
-        map->length > 0 &&
-        (entry = find_entry(map->entries, map->capacity, key))->key != NULL
-        ? &entry->value : NULL;
+    HashMapEntry * entry = find_entry(map, key);
+    return entry != NULL ? &entry->value : NULL;
 }
 
 bool map_delete(HashMap * map, const LoxString * key) {
-    HashMapEntry * entry;
-    if(map->length == 0 || (entry = find_entry(map->entries, map->capacity, key))->key == NULL) 
+    HashMapEntry * entry = find_entry(map, key);
+    if(entry == NULL) 
+        return false;
+
+    remove_entry(map, entry - map->entries);
+    return true;
+}
+
+// `new_key` must hash to the same value as `old_key` (e.g. a copy of it)
+bool map_replace_key(HashMap * map, const LoxString * old_key, const LoxString * new_key) {
+    ASSERT(old_key->hash == new_key->hash);
+    HashMapEntry * entry = find_entry(map, old_key);
+    if(entry == NULL)
         return false;
 
-    // marked as deleted c:
-    entry->key   = NULL;
-    entry->value = BOOL_VAL(true);
+    entry->key = new_key;
     return true;
 }
 
+// drops every entry whose key wasn't reached by the collector
+void map_remove_unmarked(HashMap * map) {
+    for(size_t i = 0; i < map->capacity;) {
+        HashMapEntry * entry = &map->entries[i];
+        // removing shifts the next entries back, so the slot is checked again
+        if(entry->key != NULL && !entry->key->obj.is_marked)
+            remove_entry(map, i);
+        else
+            i++;
+    }
+}
+
 void map_destroy(HashMap * map) {
     mem_dealloc(map->entries);
     map->capacity = 0;
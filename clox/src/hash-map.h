@@ -29,6 +29,8 @@ static inline LoxValue * map_get_mut(const HashMap * map, const LoxString * key)
 }
 
 bool map_delete(HashMap * map, const LoxString * key);
+void map_remove_unmarked(HashMap * map);
+bool map_replace_key(HashMap * map, const LoxString * old_key, const LoxString * new_key);
 
 const LoxString * map_find_str(const HashMap * map, const char* chars, size_t length, uint32_t hash);
 void map_destroy(HashMap * map);
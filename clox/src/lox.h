@@ -0,0 +1,134 @@
+#ifndef CLOX_LOX_H
+#define CLOX_LOX_H
+
+// Embedding API. A LoxVM keeps its globals and interned strings between evaluations,
+// so a host can create one, register its natives and then evaluate many scripts:
+//
+//     LoxVM * vm = lox_vm_create(NULL);
+//     lox_vm_define_native(vm, "answer", answer, 0);
+//     LoxHandle * name = lox_vm_string(vm, "clox", 4);
+//     lox_vm_set_global(vm, "name", name);
+//     lox_handle_release(vm, name);
+//     lox_vm_eval(vm, "print name + \" \" + answer();");
+//     lox_vm_destroy(vm);
+//
+// The host never holds a value itself, only a LoxHandle to it: the collector moves the
+// young objects (e.g. a string a script just built, as `lox_vm_get_global` returns it),
+// so a bare value would go stale on the first call that can allocate. The vm keeps the
+// value of every handle alive and up to date until the handle is released, or until
+// `lox_vm_destroy` for the ones that never are. What a handle points into isn't covered:
+// the characters of `lox_handle_as_string` are only valid until the next call that can
+// allocate (creating a handle, evaluating, setting a global) or the release of the handle.
+//
+// A native is a `void native(LoxVM * vm)` that reads its arguments with `lox_native_arg`
+// and hands its result to `lox_native_return`, exactly once (checked unless the library
+// is built with NDEBUG, as RELEASE=1 does). The handles a native gets while it runs are
+// released when it returns:
+//
+//     void answer(LoxVM * vm) {
+//         lox_native_return(vm, lox_vm_number(vm, 42));
+//     }
+//
+// There's no global state, vms are independent of each other and each one can run on
+// its own thread (one thread per vm at a time). Code that many vms need can be compiled
+// once into a LoxShared and every isolate created from it starts off with it:
+//
+//     LoxShared * prelude = lox_shared_create("fun twice(x) { return 2 * x; }", NULL);
+//     // on any number of threads
+//     LoxVM * vm = lox_vm_create_isolate(NULL, prelude);
+//     lox_vm_eval(vm, "print twice(21);");
+//     lox_vm_destroy(vm);
+//     // once all of them are destroyed
+//     lox_shared_destroy(prelude);
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct __lox_vm__ LoxVM;
+typedef struct __lox_handle__ LoxHandle;
+typedef struct __lox_shared__ LoxShared;
+typedef void (*LoxNative)(LoxVM * vm);
+
+typedef enum {
+    STATS_NONE,
+    STATS_TABLE,
+    STATS_JSON,
+} LoxStatsFormat;
+
+// both run the same compiled code, the register one lowers it first (see regcode.h)
+typedef enum {
+    BACKEND_STACK,
+    BACKEND_REGISTER,
+} LoxBackend;
+
+typedef struct {
+    size_t gc_min_heap;
+    double gc_grow_factor;
+    size_t max_frames; // nested calls allowed before a stack overflow error
+    bool gc_stats; // print the collector counters once the vm is done
+    const char * profile_path; // where to write the folded stacks, NULL to not profile
+    LoxStatsFormat stats;      // execution counters printed once the vm is done
+    const char * cache_path;   // compiled script cache (.loxc) of the source, NULL to always compile
+    int64_t source_mtime;      // modification time (ns) of the source, part of the cache key
+    FILE * out;                // where `print` writes, NULL for stdout
+    bool optimize;             // run the peephole optimizer on the compiled code (-O)
+    LoxBackend backend;        // interpreter loop, the --stats opcode counters only cover the stack one
+} LoxVMConfig;
+
+typedef enum {
+  INTERPRET_OK,
+  INTERPRET_COMPILE_ERROR,
+  INTERPRET_RUNTIME_ERROR
+} LoxInterpretResult;
+
+void vm_config_init(LoxVMConfig * config);
+
+// runs `source` in a vm of its own, the only one that uses the cache fields of `config`
+LoxInterpretResult interpret(const char * source, const LoxVMConfig * config);
+
+// `config` may be NULL for the defaults, the profiler and the stats (if enabled) cover
+// the whole life of the vm and are reported by `lox_vm_destroy`
+LoxVM * lox_vm_create(const LoxVMConfig * config);
+void lox_vm_destroy(LoxVM * vm);
+
+// The strings, functions and constants of the shared code are never written nor
+// collected by the isolates, which only read them. The shared script itself runs again
+// in every isolate, so each one gets its own copy of the globals it defines.
+// `lox_shared_create` returns NULL if `source` doesn't compile and
+// `lox_vm_create_isolate` if running it fails. Of the `config` of the shared code (may
+// be NULL) only `optimize` matters, the isolates bring the rest of theirs.
+LoxShared * lox_shared_create(const char * source, const LoxVMConfig * config);
+void lox_shared_destroy(LoxShared * shared);
+
+LoxVM * lox_vm_create_isolate(const LoxVMConfig * config, const LoxShared * shared);
+
+// the globals defined by `source` stay around for the next evaluations
+LoxInterpretResult lox_vm_eval(LoxVM * vm, const char * source);
+
+void lox_vm_define_native(LoxVM * vm, const char * name, LoxNative native, uint8_t arity);
+LoxHandle * lox_native_arg(LoxVM * vm, uint8_t arity, uint8_t idx);
+void lox_native_return(LoxVM * vm, const LoxHandle * result);
+
+// NULL if `name` isn't a defined global
+LoxHandle * lox_vm_get_global(LoxVM * vm, const char * name);
+void lox_vm_set_global(LoxVM * vm, const char * name, const LoxHandle * value);
+
+LoxHandle * lox_vm_nil(LoxVM * vm);
+LoxHandle * lox_vm_bool(LoxVM * vm, bool value);
+LoxHandle * lox_vm_number(LoxVM * vm, double value);
+LoxHandle * lox_vm_string(LoxVM * vm, const char * chars, size_t length);
+void lox_handle_release(LoxVM * vm, LoxHandle * handle);
+
+bool lox_handle_is_nil(const LoxHandle * handle);
+bool lox_handle_is_bool(const LoxHandle * handle);
+bool lox_handle_is_number(const LoxHandle * handle);
+bool lox_handle_is_string(const LoxHandle * handle);
+
+// the handle must hold a value of the type, `length` may be NULL
+bool lox_handle_as_bool(const LoxHandle * handle);
+double lox_handle_as_number(const LoxHandle * handle);
+const char * lox_handle_as_string(const LoxHandle * handle, size_t * length);
+
+#endif
@@ -0,0 +1,351 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "loxc.h"
+#include "chunk.h"
+#include "memory.h"
+#include "utils.h"
+
+// Layout: the header, the global names (slot order) and then the script function.
+// A function is its type, arity and name followed by the code, the line runs and the
+// constants, where nested functions are written in place. Strings are a u32 length
+// followed by the characters and every integer is in the writer's byte order.
+
+#define LOXC_MAGIC "LOXC"
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t opcodes; // OP_CODES_COUNT of the writer
+    uint32_t globals;
+    uint32_t flags;   // LOXC_FLAG_*
+    uint32_t reserved;
+    uint64_t source_hash;
+    int64_t source_mtime;
+} LoxcHeader;
+
+#define LOXC_FLAG_OPTIMIZED (1u << 0)
+
+typedef enum {
+    LOXC_NIL,
+    LOXC_FALSE,
+    LOXC_TRUE,
+    LOXC_NUMBER,
+    LOXC_STRING,
+    LOXC_FUNC,
+} LoxcConstTag;
+
+// 64 bit FNV-1a, the 32 bit `str_hash` would collide too easily for a cache key
+uint64_t loxc_source_hash(const char * source, size_t length) {
+    uint64_t hash = 14695981039346656037u;
+    for(size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t) source[i];
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
+
+static LoxcHeader loxc_header(LoxcKey key, uint32_t globals) {
+    LoxcHeader header = {
+        .version      = LOXC_VERSION,
+        .opcodes      = OP_CODES_COUNT,
+        .globals      = globals,
+        .flags        = key.optimized ? LOXC_FLAG_OPTIMIZED : 0,
+        .source_hash  = key.source_hash,
+        .source_mtime = key.source_mtime,
+    };
+    memcpy(header.magic, LOXC_MAGIC, sizeof(header.magic));
+    return header;
+}
+
+// writing
+
+static void write_u8(FILE * out, uint8_t value) {
+    fputc(value, out);
+}
+
+static void write_u32(FILE * out, uint32_t value) {
+    fwrite(&value, sizeof(value), 1, out);
+}
+
+static void write_string(FILE * out, const LoxString * str) {
+    write_u32(out, str->length);
+    fwrite(str->chars, 1, str->length, out);
+}
+
+static void write_function(FILE * out, const LoxFunction * func) {
+    const LoxChunk * chunk = &func->chunk;
+
+    write_u8(out, func->type);
+    write_u8(out, func->arity);
+    write_u8(out, func->name != NULL);
+    if(func->name != NULL) write_string(out, func->name);
+
+    write_u32(out, chunk->code.length);
+    fwrite(chunk->code.values, 1, chunk->code.length, out);
+
+    write_u32(out, chunk->lines.length);
+    for(size_t i = 0; i < chunk->lines.length; i++) {
+        write_u32(out, chunk->lines.values[i].line);
+        write_u32(out, chunk->lines.values[i].length);
+    }
+
+    write_u32(out, chunk->constants.length);
+    for(size_t i = 0; i < chunk->constants.length; i++) {
+        LoxValue value = chunk->constants.values[i];
+
+        if(VAL_IS_NIL(value)) {
+            write_u8(out, LOXC_NIL);
+        } else if(VAL_IS_BOOL(value)) {
+            write_u8(out, VAL_AS_BOOL(value) ? LOXC_TRUE : LOXC_FALSE);
+        } else if(VAL_IS_NUMBER(value)) {
+            double number = VAL_AS_NUMBER(value);
+            write_u8(out, LOXC_NUMBER);
+            fwrite(&number, sizeof(number), 1, out);
+        } else if(VAL_IS_STRING(value)) {
+            write_u8(out, LOXC_STRING);
+            write_string(out, VAL_AS_STRING(value));
+        } else if(VAL_IS_FUNC(value)) {
+            write_u8(out, LOXC_FUNC);
+            write_function(out, VAL_AS_FUNC(value));
+        } else {
+            UNREACHABLE();
+        }
+    }
+}
+
+// The file is written next to its final path and renamed over it, so a concurrent
+// run never maps a half written cache. The temporary name is unique per call (not per
+// process) since the threads of a pool may save the same script at once.
+bool loxc_save(const char * path, LoxcKey key, const LoxFunction * script, const LoxGlobals * globals) {
+    char tmp_path[4096];
+    if(snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path) >= (int) sizeof(tmp_path))
+        return false;
+
+    int fd = mkstemp(tmp_path);
+    if(fd < 0) return false;
+
+    FILE * out = fdopen(fd, "wb");
+    if(out == NULL) {
+        close(fd);
+        remove(tmp_path);
+        return false;
+    }
+
+    LoxcHeader header = loxc_header(key, globals->names.length);
+    fwrite(&header, sizeof(header), 1, out);
+    for(size_t i = 0; i < globals->names.length; i++)
+        write_string(out, globals->names.values[i]);
+    write_function(out, script);
+
+    bool ok = !ferror(out);
+    ok = fclose(out) == 0 && ok;
+    if(ok) ok = rename(tmp_path, path) == 0;
+    if(!ok) remove(tmp_path);
+    return ok;
+}
+
+void loxc_use_cache(LoxVMConfig * config, const char * path) {
+    struct stat st;
+    if(stat(path, &st) != 0) return;
+
+    size_t length = strlen(path);
+    bool lox_ext  = length >= 4 && strcmp(&path[length - 4], ".lox") == 0;
+
+    char * cache = malloc(length + 6);
+    if(cache == NULL) return;
+    sprintf(cache, lox_ext ? "%sc" : "%s.loxc", path);
+
+    config->cache_path   = cache;
+    config->source_mtime = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+// loading
+
+typedef struct {
+    const uint8_t * pos;
+    const uint8_t * end;
+    LoxGC * gc;
+    HashMap * strings;
+} LoxcReader;
+
+static const uint8_t * read_bytes(LoxcReader * in, size_t size) {
+    if((size_t) (in->end - in->pos) < size) return NULL;
+    const uint8_t * bytes = in->pos;
+    in->pos += size;
+    return bytes;
+}
+
+static bool read_u8(LoxcReader * in, uint8_t * value) {
+    const uint8_t * bytes = read_bytes(in, sizeof(*value));
+    if(bytes != NULL) *value = *bytes;
+    return bytes != NULL;
+}
+
+static bool read_u32(LoxcReader * in, uint32_t * value) {
+    const uint8_t * bytes = read_bytes(in, sizeof(*value));
+    if(bytes != NULL) memcpy(value, bytes, sizeof(*value));
+    return bytes != NULL;
+}
+
+// the characters of a string stay in the file, see `read_string`
+static bool read_chars(LoxcReader * in, const char ** chars, uint32_t * length) {
+    if(!read_u32(in, length)) return false;
+    *chars = (const char *) read_bytes(in, *length);
+    return *chars != NULL;
+}
+
+static const LoxString * read_string(LoxcReader * in) {
+    const char * chars;
+    uint32_t length;
+    if(!read_chars(in, &chars, &length)) return NULL;
+    return lox_str_intern(in->gc, in->strings, chars, length);
+}
+
+static bool read_constant(LoxcReader * in, LoxChunk * chunk);
+
+static LoxFunction * read_function(LoxcReader * in) {
+    uint8_t type, arity, has_name;
+    if(!read_u8(in, &type) || !read_u8(in, &arity) || !read_u8(in, &has_name))
+        return NULL;
+    if(type > FUNC_ANONYMOUS) return NULL;
+
+    const LoxString * name = NULL;
+    if(has_name && (name = read_string(in)) == NULL)
+        return NULL;
+
+    if(name != NULL) gc_push_root(in->gc, OBJ_VAL(name));
+    LoxFunction * func = lox_func_create(in->gc, name, type);
+    if(name != NULL) gc_pop_root(in->gc);
+
+    func->arity = arity;
+    gc_push_root(in->gc, OBJ_VAL(func));
+
+    LoxChunk * chunk = &func->chunk;
+    bool ok = false;
+    uint32_t length;
+    const uint8_t * bytes;
+
+    if(!read_u32(in, &length) || (bytes = read_bytes(in, length)) == NULL)
+        goto done;
+    da_push_all(&chunk->code, bytes, length);
+
+    if(!read_u32(in, &length) || (bytes = read_bytes(in, (size_t) length * 2 * sizeof(uint32_t))) == NULL)
+        goto done;
+    for(uint32_t i = 0; i < length; i++) {
+        LoxLineRun run;
+        memcpy(&run.line, bytes + (2 * i) * sizeof(uint32_t), sizeof(uint32_t));
+        memcpy(&run.length, bytes + (2 * i + 1) * sizeof(uint32_t), sizeof(uint32_t));
+        da_push(&chunk->lines, run);
+    }
+
+    if(!read_u32(in, &length)) goto done;
+    for(uint32_t i = 0; i < length; i++) {
+        if(!read_constant(in, chunk)) goto done;
+    }
+    ok = true;
+
+done:
+    gc_pop_root(in->gc);
+    return ok ? func : NULL;
+}
+
+// the new constant is added to `chunk` right away, which keeps it alive
+static bool read_constant(LoxcReader * in, LoxChunk * chunk) {
+    uint8_t tag;
+    if(!read_u8(in, &tag)) return false;
+
+    LoxValue value;
+    switch(tag) {
+        case LOXC_NIL:   value = NIL_VAL;          break;
+        case LOXC_FALSE: value = BOOL_VAL(false);  break;
+        case LOXC_TRUE:  value = BOOL_VAL(true);   break;
+        case LOXC_NUMBER: {
+            double number;
+            const uint8_t * bytes = read_bytes(in, sizeof(number));
+            if(bytes == NULL) return false;
+            memcpy(&number, bytes, sizeof(number));
+            value = NUMBER_VAL(number);
+        } break;
+        case LOXC_STRING: {
+            const LoxString * str = read_string(in);
+            if(str == NULL) return false;
+            value = OBJ_VAL(str);
+        } break;
+        case LOXC_FUNC: {
+            LoxFunction * func = read_function(in);
+            if(func == NULL) return false;
+            value = OBJ_VAL(func);
+        } break;
+        default:
+            return false;
+    }
+
+    chunk_add_constant(chunk, value);
+    return true;
+}
+
+// The code refers to globals by slot, so the names must map to the same slots they
+// had when the cache was written. The slots the vm already has (e.g. the natives)
+// have to match, the remaining ones are created in order.
+static bool read_globals(LoxcReader * in, uint32_t count, LoxGlobals * globals) {
+    for(uint32_t slot = 0; slot < count; slot++) {
+        if(slot < globals->names.length) {
+            const char * chars;
+            uint32_t length;
+            if(!read_chars(in, &chars, &length)) return false;
+
+            const LoxString * name = globals->names.values[slot];
+            if(name->length != length || memcmp(name->chars, chars, length) != 0)
+                return false;
+        } else {
+            const LoxString * name = read_string(in);
+            if(name == NULL || globals_resolve(globals, name) != slot)
+                return false;
+        }
+    }
+    return true;
+}
+
+LoxFunction * loxc_load(const char * path, LoxcKey key, LoxGC * gc, HashMap * strings, LoxGlobals * globals) {
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return NULL;
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(LoxcHeader)) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t size = st.st_size;
+    void * data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED) return NULL;
+
+    LoxcReader in = {
+        .pos     = data,
+        .end     = (const uint8_t *) data + size,
+        .gc      = gc,
+        .strings = strings,
+    };
+
+    LoxcHeader header;
+    memcpy(&header, read_bytes(&in, sizeof(header)), sizeof(header));
+
+    LoxcHeader expected = loxc_header(key, header.globals);
+    LoxFunction * script = NULL;
+    if(memcmp(&header, &expected, sizeof(header)) == 0 && read_globals(&in, header.globals, globals)) {
+        script = read_function(&in);
+        if(script != NULL && (in.pos != in.end || script->type != FUNC_SCRIPT))
+            script = NULL;
+    }
+
+    munmap(data, size);
+    return script;
+}
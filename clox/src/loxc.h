@@ -0,0 +1,39 @@
+#ifndef CLOX_LOXC_H
+#define CLOX_LOXC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "lox.h"
+#include "value.h"
+#include "hash-map.h"
+#include "gc.h"
+#include "globals.h"
+
+// Compiled scripts can be cached in .loxc files so running an unchanged script skips
+// the compiler. A cache file holds the function tree of the script (code, line runs,
+// constants and nested functions) plus the global names its slots were resolved to,
+// and it's only reused while the hash and the modification time of the source match.
+//
+// The format is meant for the clox build that wrote it (native byte order, its own
+// opcode numbering), anything else is rejected and the script compiled again.
+#define LOXC_VERSION 2
+
+typedef struct {
+    uint64_t source_hash;
+    int64_t source_mtime; // nanoseconds
+    bool optimized;       // whether the code went through the optimizer (-O)
+} LoxcKey;
+
+uint64_t loxc_source_hash(const char * source, size_t length);
+
+// returns NULL if there's no cache at `path` or it can't be used for `key`
+LoxFunction * loxc_load(const char * path, LoxcKey key, LoxGC * gc, HashMap * strings, LoxGlobals * globals);
+bool loxc_save(const char * path, LoxcKey key, const LoxFunction * script, const LoxGlobals * globals);
+
+// Points `config` at the cache of the script at `path`, which lives next to it
+// (`script.lox` => `script.loxc`). The caller frees `config->cache_path`, which is
+// left alone if the script can't be stat'ed.
+void loxc_use_cache(LoxVMConfig * config, const char * path);
+
+#endif
@@ -7,44 +7,99 @@
 
 #include <sys/stat.h>
 #include <ctype.h>
+#include <dirent.h>
 
 #include "utils.h"
-#include "vm.h"
+#include "darray.h"
+#include "lox.h"
+#include "loxc.h"
+#include "pool.h"
 
-static char * read_file(const char * path){
+#define DEFAULT_PROFILE_PATH "clox-profile.folded"
 
-    FILE * file = fopen(path, "r");
-    if(file == NULL){
+static char * read_source(const char * path){
+    char * source = read_file(path);
+    if(source == NULL){
         fprintf(stderr, "Error opening '%s': %s\n", path, strerror(errno));
         exit(1);
     }
+    return source;
+}
 
-    struct stat st;
-    fstat(fileno(file), &st);
-
-    char * file_data = malloc(st.st_size + 1);
-    if(file_data == NULL){
-        fprintf(stderr, "Unable to reserve enough space for file '%s'\n", path);
-        exit(1);
-    }
-
-    // should I ... size_t read_bytes = ... if(read_bytes < st.st_size ) ...
-    fread(file_data, sizeof(char), st.st_size, file);
-    fclose(file);
+static void run_file(const char * path, const LoxVMConfig * config, bool use_cache){
+    char * file_data = read_source(path);
 
-    file_data[st.st_size] = 0;
-    return file_data;
-}
+    LoxVMConfig file_config = *config;
+    if(use_cache) loxc_use_cache(&file_config, path);
 
-static void run_file(const char * path){
-    char * file_data = read_file(path);
-    LoxInterpretResult res = interpret(file_data);
+    LoxInterpretResult res = interpret(file_data, &file_config);
+    free((char *) file_config.cache_path);
     free(file_data);
 
     // TODO: print status
     if(res != INTERPRET_OK) exit(1);
 }
 
+static int lox_file_filter(const struct dirent * entry) {
+    size_t length = strlen(entry->d_name);
+    return length > 4 && strcmp(&entry->d_name[length - 4], ".lox") == 0;
+}
+
+typedef DaArray(char *) ScriptList;
+
+// `paths` are scripts or directories, which stand for the .lox files in them (sorted)
+static void add_scripts(ScriptList * scripts, char ** paths, size_t count) {
+    for(size_t i = 0; i < count; i++) {
+        struct stat st;
+        if(stat(paths[i], &st) != 0 || !S_ISDIR(st.st_mode)) {
+            da_push(scripts, strdup(paths[i]));
+            continue;
+        }
+
+        struct dirent ** entries;
+        int length = scandir(paths[i], &entries, lox_file_filter, alphasort);
+        if(length < 0) {
+            fprintf(stderr, "Error reading '%s': %s\n", paths[i], strerror(errno));
+            exit(1);
+        }
+
+        for(int j = 0; j < length; j++) {
+            char * script = malloc(strlen(paths[i]) + strlen(entries[j]->d_name) + 2);
+            sprintf(script, "%s/%s", paths[i], entries[j]->d_name);
+            da_push(scripts, script);
+            free(entries[j]);
+        }
+        free(entries);
+    }
+}
+
+// every script runs in an isolate of its own, all of them starting off with the prelude
+static void run_pool(char ** paths, size_t count, unsigned jobs, const char * prelude_path,
+                     const LoxVMConfig * config, bool use_cache) {
+    ScriptList scripts;
+    da_init(&scripts);
+    add_scripts(&scripts, paths, count);
+
+    LoxShared * prelude = NULL;
+    if(prelude_path != NULL) {
+        char * source = read_source(prelude_path);
+        prelude = lox_shared_create(source, config);
+        free(source);
+        if(prelude == NULL) exit(1);
+    }
+
+    size_t failed = pool_run((const char * const *) scripts.values, scripts.length, jobs, config, prelude, use_cache);
+    if(failed > 0)
+        fprintf(stderr, "pool: %zu of %zu scripts failed\n", failed, scripts.length);
+
+    if(prelude != NULL) lox_shared_destroy(prelude);
+    for(size_t i = 0; i < scripts.length; i++)
+        free(scripts.values[i]);
+    da_destroy(&scripts);
+
+    if(failed > 0) exit(1);
+}
+
 static inline void prompt(){
     printf("> "); 
     fflush(stdout);
@@ -55,7 +110,9 @@ static bool is_empty(const char * str){
     return *str == '\0';
 }
 
-static void repl(){
+// every line runs in the same vm, so what one defines the next ones can use
+static void repl(const LoxVMConfig * config){
+    LoxVM * vm = lox_vm_create(config);
     char line[1024];
     for(;;){
 
@@ -66,20 +123,104 @@ static void repl(){
         }
 
         if(!is_empty(line))
-            interpret(line);
+            lox_vm_eval(vm, line);
     }
 
+    lox_vm_destroy(vm);
+}
+
+static void usage(const char * program) {
+    fprintf(stderr, "usage: %s [options] [path]\n", program);
+    fprintf(stderr, "       %s --jobs=<n> [--prelude=<file>] [options] <path>...\n", program);
+    fputs(
+        "options:\n"
+        "  -O                      run the peephole optimizer on the compiled code\n"
+        "  --backend=stack|register  interpreter loop running the code (default: stack),\n"
+        "                          --stats needs the stack one\n"
+        "  --gc-stats              print the garbage collector counters at exit\n"
+        "  --gc-min-heap=<bytes>   heap size below which no collection happens\n"
+        "  --gc-grow-factor=<n>    next collection at <n> times the live heap\n"
+        "  --max-depth=<n>         nested calls allowed before a stack overflow error\n"
+        "  --no-cache              always compile the script instead of reusing <path>c\n"
+        "  --stats[=table|json]    print the opcode, opcode pair and call counters at exit\n"
+        "  --profile[=<file>]      sample the running functions and write their folded\n"
+        "                          stacks to <file> (default: " DEFAULT_PROFILE_PATH ")\n"
+        "  --jobs=<n>              run the scripts (or the .lox files of the directories)\n"
+        "                          on <n> threads, each in a vm of its own\n"
+        "  --prelude=<file>        with --jobs, code compiled once and run before every script\n",
+        stderr
+    );
+    exit(1);
+}
+
+static const char * option_value(const char * arg, const char * option) {
+    size_t length = strlen(option);
+    return strncmp(arg, option, length) == 0 && arg[length] == '=' ? &arg[length + 1] : NULL;
 }
 
 int main(int argc, char ** argv){
+    LoxVMConfig config;
+    vm_config_init(&config);
+
+    char ** paths = malloc(argc * sizeof(char *));
+    size_t paths_count = 0;
+    unsigned jobs = 0;
+    const char * prelude_path = NULL;
+    bool use_cache    = true;
+    for(int i = 1; i < argc; i++) {
+        const char * arg = argv[i];
+        const char * value;
+
+        if(strcmp(arg, "-O") == 0)
+            config.optimize = true;
+        else if(strcmp(arg, "--backend=stack") == 0)
+            config.backend = BACKEND_STACK;
+        else if(strcmp(arg, "--backend=register") == 0)
+            config.backend = BACKEND_REGISTER;
+        else if(strcmp(arg, "--gc-stats") == 0)
+            config.gc_stats = true;
+        else if(strcmp(arg, "--no-cache") == 0)
+            use_cache = false;
+        else if(strcmp(arg, "--stats") == 0 || strcmp(arg, "--stats=table") == 0)
+            config.stats = STATS_TABLE;
+        else if(strcmp(arg, "--stats=json") == 0)
+            config.stats = STATS_JSON;
+        else if(strcmp(arg, "--profile") == 0)
+            config.profile_path = DEFAULT_PROFILE_PATH;
+        else if((value = option_value(arg, "--profile")) != NULL && *value != '\0')
+            config.profile_path = value;
+        else if((value = option_value(arg, "--gc-min-heap")) != NULL)
+            config.gc_min_heap = strtoull(value, NULL, 10);
+        else if((value = option_value(arg, "--max-depth")) != NULL && strtoull(value, NULL, 10) > 0)
+            config.max_frames = strtoull(value, NULL, 10);
+        else if((value = option_value(arg, "--gc-grow-factor")) != NULL && strtod(value, NULL) >= 1)
+            config.gc_grow_factor = strtod(value, NULL);
+        else if((value = option_value(arg, "--jobs")) != NULL && strtoul(value, NULL, 10) > 0)
+            jobs = strtoul(value, NULL, 10);
+        else if((value = option_value(arg, "--prelude")) != NULL && *value != '\0')
+            prelude_path = value;
+        else if(arg[0] == '-')
+            usage(argv[0]);
+        else
+            paths[paths_count++] = argv[i];
+    }
 
-    if(argc == 1){
-        repl();
-    } else if(argc == 2){
-        run_file(argv[1]);
+    // the profiler and the counters are per vm, there's no one report for a whole pool
+    bool reports = config.gc_stats || config.stats != STATS_NONE || config.profile_path != NULL;
+    if(jobs > 0 ? paths_count == 0 || reports : paths_count > 1 || prelude_path != NULL)
+        usage(argv[0]);
+    // the register code has no opcode counters
+    if(config.backend == BACKEND_REGISTER && config.stats != STATS_NONE)
+        usage(argv[0]);
+
+    if(jobs > 0){
+        run_pool(paths, paths_count, jobs, prelude_path, &config, use_cache);
+    } else if(paths_count == 0){
+        repl(&config);
     } else {
-        fprintf(stderr, "usage: %s <path>\n", argv[0]);
+        run_file(paths[0], &config, use_cache);
     }
 
+    free(paths);
     return 0;
 }
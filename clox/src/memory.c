@@ -3,7 +3,15 @@
 #include <string.h>
 #include <errno.h>
 
+// per thread, so vms running on different threads neither race on it nor count each other's
+static _Thread_local size_t allocations = 0;
+
+size_t mem_allocations(void) {
+    return allocations;
+}
+
 void * mem_realloc(void * old, size_t new_size) {
+    if(new_size != 0) allocations++;
     void * ptr = realloc(old, new_size);
     if(new_size != 0 && ptr == NULL){
         fprintf(stderr, "Failed to %sallocate %zu bytes: %s\n", old == NULL ? "" : "re", new_size, strerror(errno));
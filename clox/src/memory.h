@@ -5,6 +5,7 @@
 #include <stdlib.h>
 
 void * mem_realloc(void * old, size_t new_size);
+size_t mem_allocations(void);
 
 static inline void * mem_alloc(size_t size) {
     return mem_realloc(NULL, size);
@@ -1,7 +1,31 @@
 #include "native-fn.h"
+#include "memory.h"
+#include "utils.h"
 
 #include <time.h>
 
+static double timespec_seconds(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// seconds since the epoch, like jlox's `clock` (with sub-millisecond precision)
 void lox_clock(LoxVM *vm) {
-    vm_stack_push(vm, NUMBER_VAL(time(NULL)));
+    vm_stack_push(vm, NUMBER_VAL(timespec_seconds(CLOCK_REALTIME)));
+}
+
+// monotonic nanoseconds, only meaningful as the difference of two calls
+void lox_clock_ns(LoxVM * vm) {
+    vm_stack_push(vm, NUMBER_VAL((double) time_monotonic_ns()));
+}
+
+// processor time used by the interpreter, in seconds
+void lox_cpu_time(LoxVM * vm) {
+    vm_stack_push(vm, NUMBER_VAL(timespec_seconds(CLOCK_PROCESS_CPUTIME_ID)));
+}
+
+// number of heap (re)allocations so far (nursery allocations aren't counted)
+void lox_alloc_count(LoxVM * vm) {
+    vm_stack_push(vm, NUMBER_VAL((double) mem_allocations()));
 }
@@ -5,6 +5,9 @@
 #include "vm.h"
 
 void lox_clock(LoxVM * vm);
+void lox_clock_ns(LoxVM * vm);
+void lox_cpu_time(LoxVM * vm);
+void lox_alloc_count(LoxVM * vm);
 
 static inline void load_native_funcs(LoxVM * vm) {
     struct {
@@ -12,7 +15,10 @@ static inline void load_native_funcs(LoxVM * vm) {
         Fn executor;
         uint8_t arity;
     } natives[] = {
-        { .name = "clock", .executor = lox_clock, .arity = 0 }
+        { .name = "clock",       .executor = lox_clock,       .arity = 0 },
+        { .name = "clock_ns",    .executor = lox_clock_ns,    .arity = 0 },
+        { .name = "cpu_time",    .executor = lox_cpu_time,    .arity = 0 },
+        { .name = "alloc_count", .executor = lox_alloc_count, .arity = 0 },
     };
 
     size_t defined_fns = sizeof(natives) / sizeof(natives[0]);
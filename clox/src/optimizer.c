@@ -0,0 +1,304 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "optimizer.h"
+#include "chunk.h"
+#include "memory.h"
+#include "utils.h"
+
+// The code is decoded into its instructions, with the jump targets as absolute offsets
+// of the original code. The rewrites only mark instructions dead or change their
+// opcode, the new code is encoded once they're done and the rounds go on while one
+// of them finds something to do (e.g. dropping dead code can leave a jump to the
+// next instruction behind).
+
+typedef struct {
+    size_t offset; // in the original code
+    size_t length;
+    uint32_t line;
+    size_t target; // offset jumped to, jumps only
+    uint8_t op;
+    bool live;
+} OptInstr;
+
+typedef struct {
+    const LoxChunk * chunk;
+    OptInstr * instrs;
+    size_t count;
+    size_t * index; // instruction starting at each offset of the code
+} OptCode;
+
+static bool is_jump(uint8_t op) {
+    return op == OP_JUMP || op == OP_LOOP || op == OP_IF_FALSE || op == OP_JUMP_IF_FALSE_POP
+        || op == OP_LESS_LOCAL_CONST_JUMP;
+}
+
+// the jumps that never fall through
+static bool is_unconditional(uint8_t op) {
+    return op == OP_JUMP || op == OP_LOOP || op == OP_RETURN;
+}
+
+// where the 16 bit jump length is in the instruction
+static size_t jump_operand(uint8_t op) {
+    return op == OP_LESS_LOCAL_CONST_JUMP ? 3 : 1;
+}
+
+static inline size_t instr_end(const OptInstr * instr) {
+    return instr->offset + instr->length;
+}
+
+static void opt_decode(OptCode * code, const LoxChunk * chunk) {
+    const uint8_t * bytes = chunk->code.values;
+    code->chunk  = chunk;
+    code->instrs = mem_alloc(chunk->code.length * sizeof(OptInstr));
+    code->index  = mem_alloc(chunk->code.length * sizeof(size_t));
+    code->count  = 0;
+
+    size_t run = 0, run_left = chunk->lines.values[0].length;
+    for(size_t offset = 0; offset < chunk->code.length;) {
+        OptInstr * instr = &code->instrs[code->count];
+        instr->offset = offset;
+        instr->op     = bytes[offset];
+        instr->length = chunk_instr_length(instr->op);
+        instr->line   = chunk->lines.values[run].line;
+        instr->live   = true;
+
+        if(is_jump(instr->op)) {
+            const uint8_t * operand = &bytes[offset + jump_operand(instr->op)];
+            size_t length = (size_t) operand[1] << 8 | operand[0];
+            instr->target = instr->op == OP_LOOP ? instr_end(instr) - length : instr_end(instr) + length;
+        }
+
+        for(size_t i = 0; i < instr->length; i++) {
+            code->index[offset + i] = code->count;
+            // an instruction never spans two runs, `run` can only run out at its end
+            if(--run_left == 0 && offset + i + 1 < chunk->code.length)
+                run_left = chunk->lines.values[++run].length;
+        }
+        offset += instr->length;
+        code->count++;
+    }
+}
+
+static void opt_destroy(OptCode * code) {
+    mem_dealloc(code->instrs);
+    mem_dealloc(code->index);
+}
+
+static inline OptInstr * opt_instr_at(const OptCode * code, size_t offset) {
+    return &code->instrs[code->index[offset]];
+}
+
+// The jumps are followed as long as they land on an unconditional one (or, for
+// OP_IF_FALSE, on another OP_IF_FALSE which sees the same value and jumps too). Only
+// OP_JUMP and OP_LOOP can turn into each other, so the conditional jumps stop at the
+// last target ahead of them, and none can get longer than its 16 bit length.
+static bool opt_thread_jumps(OptCode * code) {
+    bool changed = false;
+
+    for(size_t i = 0; i < code->count; i++) {
+        OptInstr * instr = &code->instrs[i];
+        if(!instr->live || !is_jump(instr->op)) continue;
+
+        bool backwards_ok = instr->op == OP_JUMP || instr->op == OP_LOOP;
+        size_t target     = instr->target;
+        size_t best       = target;
+
+        // bounded, a loop of jumps (e.g. `for(;;) {}`) never ends on its own
+        for(size_t hops = 0; hops < code->count; hops++) {
+            const OptInstr * next = opt_instr_at(code, target);
+            bool follows = next->op == OP_JUMP || next->op == OP_LOOP
+                || (instr->op == OP_IF_FALSE && next->op == OP_IF_FALSE);
+            if(!follows || next == instr) break;
+
+            target = next->target;
+            size_t end      = instr_end(instr);
+            size_t distance = target >= end ? target - end : end - target;
+            if(distance <= UINT16_MAX && (backwards_ok || target >= end))
+                best = target;
+        }
+
+        if(best != instr->target) {
+            instr->target = best;
+            if(backwards_ok) instr->op = best >= instr_end(instr) ? OP_JUMP : OP_LOOP;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+// drops what can't be reached from the first instruction
+static bool opt_remove_dead_code(OptCode * code) {
+    bool * reached = mem_alloc(code->count * sizeof(bool));
+    size_t * work  = mem_alloc(code->count * sizeof(size_t));
+    size_t work_length = 0;
+    for(size_t i = 0; i < code->count; i++) reached[i] = false;
+
+#define REACH(idx) do {                                   \
+        size_t __idx__ = (idx);                           \
+        if(!reached[__idx__]) {                           \
+            reached[__idx__] = true;                      \
+            work[work_length++] = __idx__;                \
+        }                                                 \
+    } while(0)
+
+    REACH(0);
+    while(work_length > 0) {
+        size_t i = work[--work_length];
+        const OptInstr * instr = &code->instrs[i];
+
+        if(!is_unconditional(instr->op) && i + 1 < code->count) REACH(i + 1);
+        if(is_jump(instr->op)) REACH(code->index[instr->target]);
+    }
+#undef REACH
+
+    bool changed = false;
+    for(size_t i = 0; i < code->count; i++) {
+        if(code->instrs[i].live && !reached[i]) {
+            code->instrs[i].live = false;
+            changed = true;
+        }
+    }
+    mem_dealloc(reached);
+    mem_dealloc(work);
+    return changed;
+}
+
+// the first live instruction from `offset` on, which is where jumping to `offset` ends up
+static size_t opt_resolve(const OptCode * code, size_t offset) {
+    size_t i = code->index[offset];
+    while(!code->instrs[i].live) i++;
+    return i;
+}
+
+// A jump over nothing but dead code does nothing, except for OP_JUMP_IF_FALSE_POP
+// which still pops and OP_LESS_LOCAL_CONST_JUMP which still checks its operands.
+static bool opt_drop_noop_jumps(OptCode * code) {
+    bool changed = false;
+
+    for(size_t i = 0; i < code->count; i++) {
+        OptInstr * instr = &code->instrs[i];
+        if(!instr->live) continue;
+        if(instr->op != OP_JUMP && instr->op != OP_IF_FALSE && instr->op != OP_JUMP_IF_FALSE_POP) continue;
+        if(instr->target < instr_end(instr)) continue;
+
+        // the target was reached, so neither search runs off the code
+        if(opt_resolve(code, instr_end(instr)) != opt_resolve(code, instr->target))
+            continue;
+
+        if(instr->op == OP_JUMP_IF_FALSE_POP) {
+            instr->op     = OP_POP;
+            instr->length = 1;
+        } else {
+            instr->live = false;
+        }
+        changed = true;
+    }
+    return changed;
+}
+
+static uint8_t store_pop_op(uint8_t op) {
+    switch(op) {
+        case OP_SET_GLOBAL_SLOT      : return OP_SET_GLOBAL_SLOT_POP;
+        case OP_SET_GLOBAL_SLOT_LONG : return OP_SET_GLOBAL_SLOT_LONG_POP;
+        case OP_SET_LOCAL            : return OP_SET_LOCAL_POP;
+        case OP_INC_LOCAL            : return OP_INC_LOCAL_POP;
+        default:
+            return op;
+    }
+}
+
+// a store followed by an OP_POP that no jump lands on
+static bool opt_fuse_store_pop(OptCode * code) {
+    bool * targeted = mem_alloc(code->count * sizeof(bool));
+    for(size_t i = 0; i < code->count; i++) targeted[i] = false;
+    for(size_t i = 0; i < code->count; i++) {
+        const OptInstr * instr = &code->instrs[i];
+        if(instr->live && is_jump(instr->op)) targeted[opt_resolve(code, instr->target)] = true;
+    }
+
+    bool changed = false;
+    for(size_t i = 0; i < code->count; i++) {
+        OptInstr * instr = &code->instrs[i];
+        if(!instr->live || store_pop_op(instr->op) == instr->op) continue;
+
+        size_t next = opt_resolve(code, instr_end(instr));
+        if(code->instrs[next].op == OP_POP && !targeted[next]) {
+            instr->op = store_pop_op(instr->op);
+            code->instrs[next].live = false;
+            changed = true;
+        }
+    }
+    mem_dealloc(targeted);
+    return changed;
+}
+
+// writes the live instructions into `chunk`, in place of the code `code` was decoded from
+static void opt_encode(const OptCode * code, LoxChunk * chunk) {
+    // new offset of each instruction, the dead ones get the one of the next live
+    // instruction since that's where jumping to them would end up
+    size_t * offsets = mem_alloc((code->count + 1) * sizeof(size_t));
+    size_t length = 0;
+    for(size_t i = 0; i < code->count; i++) {
+        offsets[i] = length;
+        if(code->instrs[i].live) length += code->instrs[i].length;
+    }
+    offsets[code->count] = length;
+
+    LoxChunk out;
+    chunk_init(&out);
+    for(size_t i = 0; i < code->count; i++) {
+        const OptInstr * instr = &code->instrs[i];
+        if(!instr->live) continue;
+
+        uint8_t bytes[8];
+        ASSERT(instr->length <= sizeof(bytes));
+        memcpy(bytes, &chunk->code.values[instr->offset], instr->length);
+        bytes[0] = instr->op;
+
+        if(is_jump(instr->op)) {
+            size_t end    = offsets[i] + instr->length;
+            size_t target = offsets[code->index[instr->target]];
+            size_t jump   = instr->op == OP_LOOP ? end - target : target - end;
+            ASSERTF(jump <= UINT16_MAX, "jump length %zu out of range", jump);
+            bytes[jump_operand(instr->op)]     = jump & 0xFF;
+            bytes[jump_operand(instr->op) + 1] = jump >> 8 & 0xFF;
+        }
+
+        for(size_t b = 0; b < instr->length; b++)
+            chunk_add_instr(&out, bytes[b], instr->line);
+    }
+    mem_dealloc(offsets);
+
+    da_destroy(&chunk->code);
+    da_destroy(&chunk->lines);
+    chunk->code  = out.code;
+    chunk->lines = out.lines;
+    da_destroy(&out.constants);
+}
+
+static void optimize_chunk(LoxChunk * chunk) {
+    for(bool changed = true; changed && chunk->code.length > 0;) {
+        OptCode code;
+        opt_decode(&code, chunk);
+
+        changed  = opt_thread_jumps(&code);
+        changed |= opt_remove_dead_code(&code);
+        changed |= opt_drop_noop_jumps(&code);
+        changed |= opt_fuse_store_pop(&code);
+
+        if(changed) opt_encode(&code, chunk);
+        opt_destroy(&code);
+    }
+}
+
+void optimize_function(LoxFunction * func) {
+    LoxChunk * chunk = &func->chunk;
+    optimize_chunk(chunk);
+
+    for(size_t i = 0; i < chunk->constants.length; i++) {
+        LoxValue value = chunk->constants.values[i];
+        if(VAL_IS_FUNC(value)) optimize_function(VAL_AS_FUNC(value));
+    }
+}
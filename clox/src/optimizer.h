@@ -0,0 +1,16 @@
+#ifndef CLOX_OPTIMIZER_H
+#define CLOX_OPTIMIZER_H
+
+#include "value.h"
+
+// Peephole pass over the finished code of `func` and of the functions it defines (-O).
+// The compiler emits each statement once and never looks back, this cleans up what
+// that leaves behind:
+//   - code that can't be reached (e.g. after an OP_RETURN) is removed
+//   - jumps landing on jumps go straight to the final target
+//   - jumps to the next instruction are dropped
+//   - a store followed by an OP_POP becomes the store that discards its value
+// Jump lengths and the line runs are rewritten to match the new code.
+void optimize_function(LoxFunction * func);
+
+#endif
@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "pool.h"
+#include "vm.h"
+#include "loxc.h"
+#include "utils.h"
+
+typedef struct {
+    const char * const * paths;
+    size_t count;
+    const LoxVMConfig * config;
+    const LoxShared * shared;
+    bool use_cache;
+
+    atomic_size_t next;   // index of the next script to run
+    atomic_size_t failed;
+    pthread_mutex_t stdout_lock;
+} LoxPool;
+
+static bool pool_run_script(LoxPool * pool, const char * path, FILE * out) {
+    char * source = read_file(path);
+    if(source == NULL) {
+        fprintf(stderr, "Error opening '%s': %s\n", path, strerror(errno));
+        return false;
+    }
+
+    LoxVMConfig config = *pool->config;
+    config.cache_path  = NULL;
+    config.out         = out;
+    if(pool->use_cache) loxc_use_cache(&config, path);
+
+    LoxInterpretResult res = INTERPRET_RUNTIME_ERROR;
+    LoxVM * vm = pool->shared != NULL
+        ? lox_vm_create_isolate(&config, pool->shared)
+        : lox_vm_create(&config);
+    if(vm != NULL) {
+        res = vm_eval_cached(vm, source);
+        lox_vm_destroy(vm);
+    }
+
+    free((char *) config.cache_path);
+    free(source);
+    return res == INTERPRET_OK;
+}
+
+static void * pool_worker(void * arg) {
+    LoxPool * pool = arg;
+
+    for(;;) {
+        size_t idx = atomic_fetch_add(&pool->next, 1);
+        if(idx >= pool->count) return NULL;
+
+        char * output = NULL;
+        size_t length = 0;
+        FILE * out    = open_memstream(&output, &length);
+
+        bool ok = out != NULL && pool_run_script(pool, pool->paths[idx], out);
+        if(out != NULL) fclose(out);
+
+        pthread_mutex_lock(&pool->stdout_lock);
+        fwrite(output, sizeof(char), length, stdout);
+        fflush(stdout);
+        pthread_mutex_unlock(&pool->stdout_lock);
+        free(output);
+
+        if(!ok) atomic_fetch_add(&pool->failed, 1);
+    }
+}
+
+// The calling thread is one of the workers, so the scripts still run (on fewer
+// threads) if some of the others can't be started.
+size_t pool_run(
+    const char * const * paths, size_t count, unsigned jobs,
+    const LoxVMConfig * config, const LoxShared * shared, bool use_cache
+) {
+    LoxPool pool = {
+        .paths     = paths,
+        .count     = count,
+        .config    = config,
+        .shared    = shared,
+        .use_cache = use_cache,
+    };
+    atomic_init(&pool.next, 0);
+    atomic_init(&pool.failed, 0);
+    pthread_mutex_init(&pool.stdout_lock, NULL);
+
+    if(jobs > count) jobs = count;
+    pthread_t * threads = jobs > 1 ? malloc((jobs - 1) * sizeof(pthread_t)) : NULL;
+
+    unsigned started = 0;
+    while(threads != NULL && started < jobs - 1 && pthread_create(&threads[started], NULL, pool_worker, &pool) == 0)
+        started++;
+
+    pool_worker(&pool);
+    for(unsigned i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    free(threads);
+    pthread_mutex_destroy(&pool.stdout_lock);
+    return atomic_load(&pool.failed);
+}
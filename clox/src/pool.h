@@ -0,0 +1,21 @@
+#ifndef CLOX_POOL_H
+#define CLOX_POOL_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "lox.h"
+
+// Runs every script in an isolate of its own (see `lox_vm_create_isolate`), spread over
+// `jobs` threads. The output of a script is buffered and written to stdout in one go
+// once it finishes, so the scripts' outputs never interleave, but they come out in the
+// order the scripts finish. Errors go to stderr as they happen.
+//
+// `config` is used for every isolate, except for its cache fields (`use_cache` gives
+// each script its own) and `out`. `shared` may be NULL. Returns how many scripts failed.
+size_t pool_run(
+    const char * const * paths, size_t count, unsigned jobs,
+    const LoxVMConfig * config, const LoxShared * shared, bool use_cache
+);
+
+#endif
@@ -0,0 +1,194 @@
+#include "profiler.h"
+#include "vm.h"
+#include "memory.h"
+#include "constants.h"
+
+#include <signal.h>
+#include <errno.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <sys/time.h>
+
+// the signal handler has no other way to get to it
+// SIGPROF and its timer belong to the whole process, so only one vm can be profiled at a time
+static LoxProfiler * _Atomic active_profiler = NULL;
+
+// field by field, the padding of LoxProfileFrame is garbage
+static uint32_t hash_frames(const LoxProfileFrame * frames, uint32_t depth) {
+    uint32_t hash = 2166136261u;
+    for(uint32_t i = 0; i < depth; i++) {
+        hash = (hash ^ (uint32_t) ((uintptr_t) frames[i].func >> 4)) * 16777619;
+        hash = (hash ^ frames[i].line) * 16777619;
+    }
+    return hash;
+}
+
+static bool frames_equal(const LoxProfileFrame * a, const LoxProfileFrame * b, uint32_t depth) {
+    for(uint32_t i = 0; i < depth; i++) {
+        if(a[i].func != b[i].func || a[i].line != b[i].line) return false;
+    }
+    return true;
+}
+
+static void profiler_record(LoxProfiler * prof, const LoxProfileFrame * frames, uint32_t depth) {
+    uint32_t hash = hash_frames(frames, depth);
+    size_t mask   = PROFILE_MAX_STACKS - 1;
+
+    for(size_t idx = hash & mask, probes = 0; probes < PROFILE_MAX_STACKS; idx = (idx + 1) & mask, probes++) {
+        LoxProfileStack * stack = &prof->stacks[idx];
+
+        if(stack->depth == 0) {
+            if(prof->frames_length + depth > PROFILE_MAX_FRAMES) break;
+
+            for(uint32_t i = 0; i < depth; i++)
+                prof->frames[prof->frames_length + i] = frames[i];
+            stack->hash    = hash;
+            stack->first   = prof->frames_length;
+            stack->samples = 1;
+            prof->frames_length += depth;
+            // the slot is only seen as used once it is complete
+            atomic_signal_fence(memory_order_release);
+            stack->depth = depth;
+            prof->samples++;
+            return;
+        }
+
+        if(stack->hash == hash && stack->depth == depth 
+            && frames_equal(&prof->frames[stack->first], frames, depth)) {
+            stack->samples++;
+            prof->samples++;
+            return;
+        }
+    }
+
+    prof->dropped++;
+}
+
+static void profiler_on_signal(int signal) {
+    (void) signal;
+    LoxProfiler * prof = active_profiler;
+    if(prof == NULL) return;
+
+    LoxVM * vm   = prof->vm;
+    size_t count = vm->frames_count;
+    if(count == 0) return;
+
+    LoxProfileFrame frames[PROFILE_MAX_DEPTH];
+    uint32_t depth = 0;
+
+    // the outermost frame goes first, a too deep stack gets a NULL root instead of its oldest frames
+    size_t first = 0;
+    if(count > PROFILE_MAX_DEPTH) {
+        first = count - (PROFILE_MAX_DEPTH - 1);
+        frames[depth++] = (LoxProfileFrame) { .func = NULL, .line = 0 };
+    }
+
+    for(size_t i = first; i < count; i++) {
+        const LoxCallFrame * frame = &vm->frames[i];
+        frames[depth++] = (LoxProfileFrame) {
+            .func = frame->func,
+            .line = vm_frame_line(vm, frame),
+        };
+    }
+
+    profiler_record(prof, frames, depth);
+}
+
+// fails with EBUSY while another vm is being profiled
+bool profiler_start(LoxProfiler * prof, LoxVM * vm, unsigned hz) {
+    LoxProfiler * none = NULL;
+    if(!atomic_compare_exchange_strong(&active_profiler, &none, prof)) {
+        errno = EBUSY;
+        return false;
+    }
+
+    prof->vm            = vm;
+    prof->stacks        = mem_alloc(sizeof(LoxProfileStack) * PROFILE_MAX_STACKS);
+    prof->frames        = mem_alloc(sizeof(LoxProfileFrame) * PROFILE_MAX_FRAMES);
+    prof->frames_length = 0;
+    prof->samples       = 0;
+    prof->dropped       = 0;
+    memset(prof->stacks, 0, sizeof(LoxProfileStack) * PROFILE_MAX_STACKS);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = profiler_on_signal;
+    action.sa_flags   = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+
+    struct itimerval timer = {
+        .it_interval = { .tv_sec = 0, .tv_usec = 1000000 / hz },
+        .it_value    = { .tv_sec = 0, .tv_usec = 1000000 / hz },
+    };
+
+    if(sigaction(SIGPROF, &action, &prof->previous) != 0) {
+        active_profiler = NULL;
+        return false;
+    }
+    if(setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+        sigaction(SIGPROF, &prof->previous, NULL);
+        active_profiler = NULL;
+        return false;
+    }
+    return true;
+}
+
+// A tick may still be pending once the timer is off, and SIGPROF kills the process by
+// default, so the host gets its handler back unless it had none, in which case the
+// signal is ignored from now on.
+void profiler_stop(LoxProfiler * prof) {
+    ASSERT(active_profiler == prof);
+    struct itimerval timer = {0};
+    setitimer(ITIMER_PROF, &timer, NULL);
+
+    if(prof->previous.sa_handler == SIG_DFL && !(prof->previous.sa_flags & SA_SIGINFO)) {
+        prof->previous.sa_handler = SIG_IGN;
+        prof->previous.sa_flags   = 0;
+    }
+    sigaction(SIGPROF, &prof->previous, NULL);
+    active_profiler = NULL;
+}
+
+void profiler_mark(LoxGC * gc, const LoxProfiler * prof) {
+    for(size_t i = 0; i < prof->frames_length; i++) {
+        if(prof->frames[i].func != NULL)
+            gc_mark_object(gc, (LoxObject *) prof->frames[i].func);
+    }
+}
+
+static void print_frame(const LoxProfileFrame * frame, FILE * out) {
+    if(frame->func == NULL) {
+        fputs("[truncated]", out);
+        return;
+    }
+
+    switch(frame->func->type) {
+        case FUNC_SCRIPT   : fputs("<script>", out);    break;
+        case FUNC_ANONYMOUS: fputs("<anonymous>", out); break;
+        case FUNC_ORDINARY : fputs(frame->func->name->chars, out); break;
+        default: UNREACHABLE();
+    }
+    fprintf(out, ":%u", frame->line);
+}
+
+// one `outermost;...;innermost <samples>` line per stack
+void profiler_write(const LoxProfiler * prof, FILE * out) {
+    for(size_t i = 0; i < PROFILE_MAX_STACKS; i++) {
+        const LoxProfileStack * stack = &prof->stacks[i];
+        if(stack->depth == 0) continue;
+
+        for(uint32_t j = 0; j < stack->depth; j++) {
+            if(j > 0) fputc(';', out);
+            print_frame(&prof->frames[stack->first + j], out);
+        }
+        fprintf(out, " %zu\n", stack->samples);
+    }
+}
+
+void profiler_destroy(LoxProfiler * prof) {
+    mem_dealloc(prof->stacks);
+    mem_dealloc(prof->frames);
+    prof->stacks = NULL;
+    prof->frames = NULL;
+    prof->vm     = NULL;
+}
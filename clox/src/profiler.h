@@ -0,0 +1,49 @@
+#ifndef CLOX_PROFILER_H
+#define CLOX_PROFILER_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <signal.h>
+
+#include "function.h"
+#include "gc.h"
+
+struct __lox_vm__;
+
+typedef struct {
+    const LoxFunction * func; // NULL for the frames cut off a too deep stack
+    uint32_t line;
+} LoxProfileFrame;
+
+typedef struct {
+    uint32_t hash;
+    uint32_t depth; // 0 for empty slots
+    uint32_t first; // index of its outermost frame in `frames`
+    size_t samples;
+} LoxProfileStack;
+
+// Sampling profiler: on every SIGPROF tick the handler walks the vm's call frames
+// and counts the (function, line) stack it finds. Everything the handler touches is
+// allocated upfront, stacks that don't fit anymore are only counted as dropped.
+// The sampled functions are kept alive (see `profiler_mark`) until the profile is
+// written, as folded stacks that flamegraph tools read.
+typedef struct {
+    struct __lox_vm__ * vm;
+
+    LoxProfileStack * stacks; // open addressing table with PROFILE_MAX_STACKS slots
+    LoxProfileFrame * frames; // PROFILE_MAX_FRAMES, shared by all stacks
+    size_t frames_length;
+
+    size_t samples;
+    size_t dropped;
+    struct sigaction previous; // SIGPROF handler the host had, put back by `profiler_stop`
+} LoxProfiler;
+
+bool profiler_start(LoxProfiler * prof, struct __lox_vm__ * vm, unsigned hz);
+void profiler_stop(LoxProfiler * prof);
+void profiler_mark(LoxGC * gc, const LoxProfiler * prof);
+void profiler_write(const LoxProfiler * prof, FILE * out);
+void profiler_destroy(LoxProfiler * prof);
+
+#endif
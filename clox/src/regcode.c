@@ -0,0 +1,731 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "regcode.h"
+#include "chunk.h"
+#include "darray.h"
+#include "memory.h"
+#include "utils.h"
+
+// The register code is lowered from the stack code the compiler emits, one stack
+// instruction at a time: the value at stack position `i` lives in register `i` (so the
+// locals stay in their compiler slots) and the stack depth at every instruction, worked
+// out up front, tells which registers the operands are in.
+//
+// Most pushes need no instruction of their own. The lowering keeps what every stack
+// position holds, either a register (its own, or the local it was read from) or a
+// constant, and only the instructions that consume a position read it from there, so
+// `a + 1` is a single ROP_ADD of the register of `a` and the constant. A position is
+// written to its own register (materialized) when that can't wait: before the local it
+// reads is written, before a call (which takes its window from its callee on) and
+// before every jump and jump target, where all the positions must be in their registers
+// whatever the path taken.
+
+typedef struct {
+    bool is_const;
+    uint32_t index; // register or constant
+} LwEntry;
+
+typedef struct {
+    size_t at;     // unit of the target operand
+    size_t target; // stack code offset jumped to
+} LwFixup;
+
+typedef struct {
+    DaArray(uint16_t) code;
+    DaArray(uint32_t) lines;
+    DaArray(LwFixup) fixups;
+    uint32_t line; // of the stack instruction being lowered
+
+    LwEntry * stack;
+    size_t depth;
+
+    // the last instruction, while nothing may jump between it and the next one
+    size_t last_start; // SIZE_MAX if there's none
+    size_t last_dst;   // unit of its A operand, SIZE_MAX if it can't be given another one
+} Lowering;
+
+static const size_t instr_lengths[] = {
+    [ROP_MOVE]          = 3,
+    [ROP_LOADK]         = 4,
+    [ROP_NIL]           = 2,
+    [ROP_TRUE]          = 2,
+    [ROP_FALSE]         = 2,
+    [ROP_GET_GLOBAL]    = 4,
+    [ROP_SET_GLOBAL]    = 4,
+    [ROP_DEFINE_GLOBAL] = 4,
+    [ROP_NEG]           = 3,
+    [ROP_NOT]           = 3,
+    [ROP_ADD]           = 4,
+    [ROP_SUB]           = 4,
+    [ROP_MULT]          = 4,
+    [ROP_DIV]           = 4,
+    [ROP_EQ]            = 4,
+    [ROP_NOT_EQ]        = 4,
+    [ROP_LESS]          = 4,
+    [ROP_GREATER]       = 4,
+    [ROP_LESS_EQ]       = 4,
+    [ROP_GREATER_EQ]    = 4,
+    [ROP_PRINT]         = 2,
+    [ROP_JUMP]          = 3,
+    [ROP_JUMP_IF_FALSE] = 4,
+    [ROP_JUMP_UNLESS_LESS] = 5,
+    [ROP_CALL]          = 3,
+    [ROP_RETURN]        = 2,
+};
+_Static_assert(sizeof(instr_lengths) / sizeof(instr_lengths[0]) == ROP_CODES_COUNT, "instr_lengths out of sync with RegOpCode");
+
+static const char * opcode_names[] = {
+    [ROP_MOVE]          = "ROP_MOVE",
+    [ROP_LOADK]         = "ROP_LOADK",
+    [ROP_NIL]           = "ROP_NIL",
+    [ROP_TRUE]          = "ROP_TRUE",
+    [ROP_FALSE]         = "ROP_FALSE",
+    [ROP_GET_GLOBAL]    = "ROP_GET_GLOBAL",
+    [ROP_SET_GLOBAL]    = "ROP_SET_GLOBAL",
+    [ROP_DEFINE_GLOBAL] = "ROP_DEFINE_GLOBAL",
+    [ROP_NEG]           = "ROP_NEG",
+    [ROP_NOT]           = "ROP_NOT",
+    [ROP_ADD]           = "ROP_ADD",
+    [ROP_SUB]           = "ROP_SUB",
+    [ROP_MULT]          = "ROP_MULT",
+    [ROP_DIV]           = "ROP_DIV",
+    [ROP_EQ]            = "ROP_EQ",
+    [ROP_NOT_EQ]        = "ROP_NOT_EQ",
+    [ROP_LESS]          = "ROP_LESS",
+    [ROP_GREATER]       = "ROP_GREATER",
+    [ROP_LESS_EQ]       = "ROP_LESS_EQ",
+    [ROP_GREATER_EQ]    = "ROP_GREATER_EQ",
+    [ROP_PRINT]         = "ROP_PRINT",
+    [ROP_JUMP]          = "ROP_JUMP",
+    [ROP_JUMP_IF_FALSE] = "ROP_JUMP_IF_FALSE",
+    [ROP_JUMP_UNLESS_LESS] = "ROP_JUMP_UNLESS_LESS",
+    [ROP_CALL]          = "ROP_CALL",
+    [ROP_RETURN]        = "ROP_RETURN",
+};
+_Static_assert(sizeof(opcode_names) / sizeof(opcode_names[0]) == ROP_CODES_COUNT, "opcode_names out of sync with RegOpCode");
+
+const char * regcode_opcode_name(uint16_t opcode) {
+    return opcode < ROP_CODES_COUNT ? opcode_names[opcode] : "ROP_UNKNOWN";
+}
+
+size_t regcode_instr_length(uint16_t opcode) {
+    ASSERTF(opcode < ROP_CODES_COUNT, "unknown register opcode %u", (unsigned) opcode);
+    return instr_lengths[opcode];
+}
+
+void regcode_free(LoxRegCode * reg) {
+    if(reg == NULL) return;
+    mem_dealloc(reg->code);
+    mem_dealloc(reg->lines);
+    mem_dealloc(reg);
+}
+
+// the quickened instructions are lowered as the generic ones they stand for
+static uint8_t generic_op(uint8_t op) {
+    switch(op) {
+        case OP_ADD_NUM:
+        case OP_ADD_STR : return OP_ADD;
+        default:
+            return op;
+    }
+}
+
+static bool is_jump(uint8_t op) {
+    return op == OP_JUMP || op == OP_LOOP || op == OP_IF_FALSE || op == OP_JUMP_IF_FALSE_POP
+        || op == OP_LESS_LOCAL_CONST_JUMP;
+}
+
+static bool is_unconditional(uint8_t op) {
+    return op == OP_JUMP || op == OP_LOOP || op == OP_RETURN;
+}
+
+static size_t jump_target(const uint8_t * code, size_t offset) {
+    uint8_t op     = code[offset];
+    size_t operand = offset + (op == OP_LESS_LOCAL_CONST_JUMP ? 3 : 1);
+    size_t length  = (size_t) code[operand + 1] << 8 | code[operand];
+    size_t end     = offset + chunk_instr_length(op);
+    return op == OP_LOOP ? end - length : end + length;
+}
+
+static uint32_t long_operand(const uint8_t * code, size_t offset) {
+    return (uint32_t) code[offset + 2] << 16 | (uint32_t) code[offset + 1] << 8 | code[offset];
+}
+
+// how many values the instruction at `offset` leaves on the stack, minus the ones it takes
+static int stack_effect(const uint8_t * code, size_t offset) {
+    switch(generic_op(code[offset])) {
+        case OP_CONST:
+        case OP_CONST_LONG:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_GLOBAL_SLOT:
+        case OP_GET_GLOBAL_SLOT_LONG:
+        case OP_GET_LOCAL:
+        case OP_INC_LOCAL:
+            return 1;
+
+        case OP_POP:
+        case OP_PRINT:
+        case OP_DEFINE_GLOBAL_SLOT:
+        case OP_DEFINE_GLOBAL_SLOT_LONG:
+        case OP_SET_GLOBAL_SLOT_POP:
+        case OP_SET_GLOBAL_SLOT_LONG_POP:
+        case OP_SET_LOCAL_POP:
+        case OP_JUMP_IF_FALSE_POP:
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MULT:
+        case OP_DIV:
+        case OP_EQ:
+        case OP_NOT_EQ:
+        case OP_LESS:
+        case OP_GREATER:
+        case OP_LESS_EQ:
+        case OP_GREATER_EQ:
+            return -1;
+
+        case OP_POPN:
+        case OP_CALL:
+            return -(int) code[offset + 1];
+
+        default:
+            return 0;
+    }
+}
+
+// Stack depth before every instruction, -1 for the ones that can't be reached. The
+// compiler keeps the depth the same on every path to an instruction, which is checked.
+static int32_t * stack_depths(const LoxFunction * func, bool * labels, size_t * max_depth) {
+    const LoxChunk * chunk = &func->chunk;
+    const uint8_t * code   = chunk->code.values;
+    size_t length          = chunk->code.length;
+
+    int32_t * depths = mem_alloc(length * sizeof(int32_t));
+    size_t * work    = mem_alloc(length * sizeof(size_t));
+    size_t work_length = 0;
+    for(size_t i = 0; i < length; i++) {
+        depths[i] = -1;
+        labels[i] = false;
+    }
+
+#define REACH(offset, depth) do {                                                    \
+        size_t __offset__ = (offset);                                                \
+        int32_t __depth__ = (depth);                                                 \
+        ASSERTF(__depth__ >= 0, "negative stack depth at %zu", __offset__);          \
+        if(depths[__offset__] < 0) {                                                 \
+            depths[__offset__] = __depth__;                                          \
+            work[work_length++] = __offset__;                                        \
+        }                                                                            \
+        ASSERTF(depths[__offset__] == __depth__, "stack depths %d and %d meet at %zu", \
+            depths[__offset__], __depth__, __offset__);                              \
+    } while(0)
+
+    // the callee and its arguments
+    REACH(0, 1 + func->arity);
+    *max_depth = 1 + func->arity;
+    while(work_length > 0) {
+        size_t offset = work[--work_length];
+        uint8_t op    = code[offset];
+        int32_t depth = depths[offset] + stack_effect(code, offset);
+        if((size_t) depth > *max_depth) *max_depth = depth;
+
+        size_t next = offset + chunk_instr_length(op);
+        if(!is_unconditional(op) && next < length) REACH(next, depth);
+        if(is_jump(op)) {
+            size_t target = jump_target(code, offset);
+            labels[target] = true;
+            REACH(target, depth);
+        }
+    }
+#undef REACH
+
+    mem_dealloc(work);
+    return depths;
+}
+
+static inline void lw_unit(Lowering * lw, uint32_t unit) {
+    ASSERTF(unit <= UINT16_MAX, "register operand %u out of range", unit);
+    da_push(&lw->code, (uint16_t) unit);
+    da_push(&lw->lines, lw->line);
+}
+
+static inline void lw_long(Lowering * lw, uint32_t operand) {
+    lw_unit(lw, operand & 0xffff);
+    lw_unit(lw, operand >> 16);
+}
+
+static inline void lw_op(Lowering * lw, RegOpCode op) {
+    lw->last_start = lw->code.length;
+    lw->last_dst   = SIZE_MAX;
+    lw_unit(lw, op);
+}
+
+static inline void lw_dst(Lowering * lw, size_t reg) {
+    lw->last_dst = lw->code.length;
+    lw_unit(lw, reg);
+}
+
+static inline LwEntry lw_reg(size_t reg) {
+    return (LwEntry) { .is_const = false, .index = reg };
+}
+
+static inline LwEntry lw_const(size_t index) {
+    return (LwEntry) { .is_const = true, .index = index };
+}
+
+static inline bool lw_is_reg(LwEntry entry, size_t reg) {
+    return !entry.is_const && entry.index == reg;
+}
+
+static inline void lw_push(Lowering * lw, LwEntry entry) {
+    lw->stack[lw->depth++] = entry;
+}
+
+// An entry only ever names the register of a position below its own, and that
+// position is in its register, so writing a position's own register never clobbers
+// what another one holds.
+static void lw_materialize(Lowering * lw, size_t pos) {
+    LwEntry entry = lw->stack[pos];
+    if(lw_is_reg(entry, pos)) return;
+
+    if(entry.is_const) {
+        lw_op(lw, ROP_LOADK);
+        lw_dst(lw, pos);
+        lw_long(lw, entry.index);
+    } else {
+        lw_op(lw, ROP_MOVE);
+        lw_dst(lw, pos);
+        lw_unit(lw, entry.index);
+    }
+    lw->stack[pos] = lw_reg(pos);
+}
+
+static void lw_materialize_from(Lowering * lw, size_t from) {
+    for(size_t pos = from; pos < lw->depth; pos++)
+        lw_materialize(lw, pos);
+}
+
+// the RK operand reading the value at `pos`
+static uint32_t lw_rk(Lowering * lw, size_t pos) {
+    LwEntry entry = lw->stack[pos];
+    if(!entry.is_const) return entry.index;
+    if(entry.index <= RK_MAX_CONST) return RK_CONST | entry.index;
+
+    lw_materialize(lw, pos);
+    return pos;
+}
+
+// the positions still reading `reg` get their value before it changes
+static void lw_before_write(Lowering * lw, size_t reg) {
+    for(size_t pos = 0; pos < lw->depth; pos++) {
+        if(pos != reg && lw_is_reg(lw->stack[pos], reg))
+            lw_materialize(lw, pos);
+    }
+}
+
+static void lw_jump(Lowering * lw, const uint8_t * code, size_t offset) {
+    LwFixup fixup = { .at = lw->code.length, .target = jump_target(code, offset) };
+    da_push(&lw->fixups, fixup);
+    lw_long(lw, 0);
+}
+
+// `local = <top>`, which usually is the last instruction writing the local instead
+static void lw_set_local(Lowering * lw, size_t slot) {
+    size_t top = lw->depth - 1;
+    ASSERT(slot < top);
+    LwEntry value = lw->stack[top];
+    if(lw_is_reg(value, slot)) return;
+
+    bool retarget = lw_is_reg(value, top) && lw->last_dst != SIZE_MAX && lw->code.values[lw->last_dst] == top;
+    for(size_t pos = 0; retarget && pos < lw->depth; pos++)
+        retarget = pos == slot || !lw_is_reg(lw->stack[pos], slot);
+
+    if(retarget) {
+        lw->code.values[lw->last_dst] = slot;
+        lw->stack[top] = lw_reg(slot);
+    } else {
+        lw_before_write(lw, slot);
+        if(value.is_const) {
+            lw_op(lw, ROP_LOADK);
+            lw_unit(lw, slot);
+            lw_long(lw, value.index);
+        } else {
+            lw_op(lw, ROP_MOVE);
+            lw_unit(lw, slot);
+            lw_unit(lw, value.index);
+        }
+    }
+    lw->stack[slot] = lw_reg(slot);
+}
+
+// `local = local + constant`, the value is left on the stack if `push`
+static void lw_inc_local(Lowering * lw, size_t slot, size_t constant, bool push) {
+    lw_materialize(lw, slot);
+    lw_before_write(lw, slot);
+
+    lw_push(lw, lw_const(constant));
+    uint32_t amount = lw_rk(lw, lw->depth - 1);
+    lw->depth--;
+
+    lw_op(lw, ROP_ADD);
+    lw_dst(lw, slot);
+    lw_unit(lw, slot);
+    lw_unit(lw, amount);
+    if(push) lw_push(lw, lw_reg(slot));
+}
+
+static RegOpCode binary_op(uint8_t op) {
+    switch(op) {
+        case OP_ADD        : return ROP_ADD;
+        case OP_SUB        : return ROP_SUB;
+        case OP_MULT       : return ROP_MULT;
+        case OP_DIV        : return ROP_DIV;
+        case OP_EQ         : return ROP_EQ;
+        case OP_NOT_EQ     : return ROP_NOT_EQ;
+        case OP_LESS       : return ROP_LESS;
+        case OP_GREATER    : return ROP_GREATER;
+        case OP_LESS_EQ    : return ROP_LESS_EQ;
+        case OP_GREATER_EQ : return ROP_GREATER_EQ;
+        default:
+            UNREACHABLE();
+    }
+}
+
+// OP_LESS/OP_GREATER right before an OP_JUMP_IF_FALSE_POP become one ROP_JUMP_UNLESS_LESS
+static bool lw_fuse_compare_jump(Lowering * lw, const uint8_t * code, size_t offset) {
+    size_t top = lw->depth - 1;
+    if(lw->last_start == SIZE_MAX || !lw_is_reg(lw->stack[top], top)) return false;
+
+    const uint16_t * last = &lw->code.values[lw->last_start];
+    if((last[0] != ROP_LESS && last[0] != ROP_GREATER) || last[1] != top) return false;
+
+    bool swap  = last[0] == ROP_GREATER;
+    uint32_t a = swap ? last[3] : last[2];
+    uint32_t b = swap ? last[2] : last[3];
+    uint32_t line = lw->lines.values[lw->last_start];
+    lw->code.length  = lw->last_start;
+    lw->lines.length = lw->last_start;
+
+    // the operands are registers in place already, the ones materialized here are below them
+    lw->depth--;
+    lw_materialize_from(lw, 0);
+
+    uint32_t jump_line = lw->line;
+    lw->line = line;
+    lw_op(lw, ROP_JUMP_UNLESS_LESS);
+    lw_unit(lw, a);
+    lw_unit(lw, b);
+    lw_jump(lw, code, offset);
+    lw->line = jump_line;
+    return true;
+}
+
+static void lw_instr(Lowering * lw, const uint8_t * code, size_t offset) {
+    uint8_t op = generic_op(code[offset]);
+    size_t top = lw->depth - 1;
+
+    switch(op) {
+        case OP_CONST      : lw_push(lw, lw_const(code[offset + 1])); break;
+        case OP_CONST_LONG : lw_push(lw, lw_const(long_operand(code, offset + 1))); break;
+
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+            lw_op(lw, op == OP_NIL ? ROP_NIL : (op == OP_TRUE ? ROP_TRUE : ROP_FALSE));
+            lw_dst(lw, lw->depth);
+            lw_push(lw, lw_reg(lw->depth));
+            break;
+
+        case OP_POP  : lw->depth--; break;
+        case OP_POPN : lw->depth -= code[offset + 1]; break;
+
+        case OP_NEG:
+        case OP_NOT: {
+            uint32_t value = lw_rk(lw, top);
+            lw_op(lw, op == OP_NEG ? ROP_NEG : ROP_NOT);
+            lw_dst(lw, top);
+            lw_unit(lw, value);
+            lw->stack[top] = lw_reg(top);
+        } break;
+
+        case OP_ADD: case OP_SUB: case OP_MULT: case OP_DIV:
+        case OP_EQ: case OP_NOT_EQ: case OP_LESS: case OP_GREATER: case OP_LESS_EQ: case OP_GREATER_EQ: {
+            uint32_t a = lw_rk(lw, top - 1);
+            uint32_t b = lw_rk(lw, top);
+            lw_op(lw, binary_op(op));
+            lw_dst(lw, top - 1);
+            lw_unit(lw, a);
+            lw_unit(lw, b);
+            lw->depth--;
+            lw->stack[top - 1] = lw_reg(top - 1);
+        } break;
+
+        case OP_PRINT: {
+            uint32_t value = lw_rk(lw, top);
+            lw_op(lw, ROP_PRINT);
+            lw_unit(lw, value);
+            lw->depth--;
+        } break;
+
+        case OP_GET_GLOBAL_SLOT:
+        case OP_GET_GLOBAL_SLOT_LONG: {
+            uint32_t slot = op == OP_GET_GLOBAL_SLOT ? code[offset + 1] : long_operand(code, offset + 1);
+            lw_op(lw, ROP_GET_GLOBAL);
+            lw_dst(lw, lw->depth);
+            lw_long(lw, slot);
+            lw_push(lw, lw_reg(lw->depth));
+        } break;
+
+        case OP_DEFINE_GLOBAL_SLOT:
+        case OP_DEFINE_GLOBAL_SLOT_LONG:
+        case OP_SET_GLOBAL_SLOT:
+        case OP_SET_GLOBAL_SLOT_LONG:
+        case OP_SET_GLOBAL_SLOT_POP:
+        case OP_SET_GLOBAL_SLOT_LONG_POP: {
+            bool is_short = op == OP_DEFINE_GLOBAL_SLOT || op == OP_SET_GLOBAL_SLOT || op == OP_SET_GLOBAL_SLOT_POP;
+            bool define   = op == OP_DEFINE_GLOBAL_SLOT || op == OP_DEFINE_GLOBAL_SLOT_LONG;
+            uint32_t slot = is_short ? code[offset + 1] : long_operand(code, offset + 1);
+            uint32_t value = lw_rk(lw, top);
+            lw_op(lw, define ? ROP_DEFINE_GLOBAL : ROP_SET_GLOBAL);
+            lw_long(lw, slot);
+            lw_unit(lw, value);
+            if(stack_effect(code, offset) < 0) lw->depth--;
+        } break;
+
+        case OP_GET_LOCAL: {
+            size_t slot = code[offset + 1];
+            lw_materialize(lw, slot);
+            lw_push(lw, lw_reg(slot));
+        } break;
+
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_POP:
+            lw_set_local(lw, code[offset + 1]);
+            if(op == OP_SET_LOCAL_POP) lw->depth--;
+            break;
+
+        case OP_INC_LOCAL:
+        case OP_INC_LOCAL_POP:
+            lw_inc_local(lw, code[offset + 1], code[offset + 2], op == OP_INC_LOCAL);
+            break;
+
+        case OP_JUMP:
+        case OP_LOOP:
+            lw_materialize_from(lw, 0);
+            lw_op(lw, ROP_JUMP);
+            lw_jump(lw, code, offset);
+            break;
+
+        case OP_IF_FALSE:
+            lw_materialize_from(lw, 0);
+            lw_op(lw, ROP_JUMP_IF_FALSE);
+            lw_unit(lw, top);
+            lw_jump(lw, code, offset);
+            break;
+
+        case OP_JUMP_IF_FALSE_POP: {
+            if(lw_fuse_compare_jump(lw, code, offset)) break;
+
+            uint32_t value = lw_rk(lw, top);
+            lw->depth--;
+            lw_materialize_from(lw, 0);
+            lw_op(lw, ROP_JUMP_IF_FALSE);
+            lw_unit(lw, value);
+            lw_jump(lw, code, offset);
+        } break;
+
+        case OP_LESS_LOCAL_CONST_JUMP: {
+            size_t slot = code[offset + 1];
+            lw_materialize(lw, slot);
+            lw_push(lw, lw_const(code[offset + 2]));
+            uint32_t limit = lw_rk(lw, lw->depth - 1);
+            lw->depth--;
+
+            lw_materialize_from(lw, 0);
+            lw_op(lw, ROP_JUMP_UNLESS_LESS);
+            lw_unit(lw, slot);
+            lw_unit(lw, limit);
+            lw_jump(lw, code, offset);
+        } break;
+
+        case OP_CALL: {
+            size_t args_nr = code[offset + 1];
+            size_t callee  = lw->depth - 1 - args_nr;
+            lw_materialize_from(lw, callee);
+            lw_op(lw, ROP_CALL);
+            lw_unit(lw, callee);
+            lw_unit(lw, args_nr);
+            lw->depth = callee + 1;
+            lw->stack[callee] = lw_reg(callee);
+        } break;
+
+        // the script has popped everything, its own slot included, and returns nothing
+        case OP_RETURN: {
+            uint32_t value = lw->depth > 0 ? lw_rk(lw, top) : 0;
+            lw_op(lw, ROP_RETURN);
+            lw_unit(lw, value);
+        } break;
+
+        default:
+            UNREACHABLE();
+    }
+}
+
+static void regcode_lower_chunk(LoxFunction * func) {
+    const LoxChunk * chunk = &func->chunk;
+    const uint8_t * code   = chunk->code.values;
+    size_t length          = chunk->code.length;
+
+    bool * labels     = mem_alloc(length * sizeof(bool));
+    size_t max_depth  = 0;
+    int32_t * depths  = stack_depths(func, labels, &max_depth);
+    size_t * offsets  = mem_alloc(length * sizeof(size_t));
+
+    // room for the constant operand pushed by the local instructions, see `lw_inc_local`
+    Lowering lw = {
+        .stack      = mem_alloc((max_depth + 1) * sizeof(LwEntry)),
+        .depth      = 0,
+        .last_start = SIZE_MAX,
+        .last_dst   = SIZE_MAX,
+    };
+    da_init(&lw.code);
+    da_init(&lw.lines);
+    da_init(&lw.fixups);
+
+    bool falls_through = false; // into the instruction at `offset`
+    size_t run = 0, run_left = chunk->lines.values[0].length;
+    for(size_t offset = 0; offset < length;) {
+        uint8_t op        = code[offset];
+        size_t instr_size = chunk_instr_length(op);
+        lw.line           = chunk->lines.values[run].line;
+
+        if(depths[offset] >= 0) {
+            if(!falls_through) {
+                lw.depth = depths[offset];
+                for(size_t pos = 0; pos < lw.depth; pos++) lw.stack[pos] = lw_reg(pos);
+            } else if(labels[offset]) {
+                lw_materialize_from(&lw, 0);
+            }
+            ASSERT(lw.depth == (size_t) depths[offset]);
+            if(labels[offset]) lw.last_start = lw.last_dst = SIZE_MAX;
+
+            offsets[offset] = lw.code.length;
+            lw_instr(&lw, code, offset);
+            falls_through = !is_unconditional(op);
+        } else {
+            falls_through = false;
+        }
+
+        for(size_t i = 0; i < instr_size; i++) {
+            if(--run_left == 0 && offset + i + 1 < length)
+                run_left = chunk->lines.values[++run].length;
+        }
+        offset += instr_size;
+    }
+
+    for(size_t i = 0; i < lw.fixups.length; i++) {
+        LwFixup fixup   = lw.fixups.values[i];
+        size_t target   = offsets[fixup.target];
+        lw.code.values[fixup.at]     = target & 0xffff;
+        lw.code.values[fixup.at + 1] = target >> 16;
+    }
+
+    LoxRegCode * reg = mem_alloc(sizeof(LoxRegCode));
+    reg->code       = lw.code.values;
+    reg->lines      = lw.lines.values;
+    reg->length     = lw.code.length;
+    reg->frame_size = max_depth + 1;
+    func->reg = reg;
+
+    da_destroy(&lw.fixups);
+    mem_dealloc(lw.stack);
+    mem_dealloc(offsets);
+    mem_dealloc(depths);
+    mem_dealloc(labels);
+}
+
+void regcode_lower(LoxFunction * func) {
+    if(func->reg != NULL) return;
+    regcode_lower_chunk(func);
+
+    const LoxChunk * chunk = &func->chunk;
+    for(size_t i = 0; i < chunk->constants.length; i++) {
+        LoxValue value = chunk->constants.values[i];
+        if(VAL_IS_FUNC(value)) regcode_lower(VAL_AS_FUNC(value));
+    }
+}
+
+static void print_rk(const LoxValue * constants, uint16_t operand) {
+    if(operand & RK_CONST) {
+        putchar(' ');
+        LoxValue value = constants[operand & RK_MAX_CONST];
+        bool is_str = VAL_IS_STRING(value);
+        if(is_str) putchar('"');
+        value_print(value);
+        if(is_str) putchar('"');
+    } else {
+        printf(" r%u", (unsigned) operand);
+    }
+}
+
+static inline uint32_t read_long(const uint16_t * code) {
+    return (uint32_t) code[1] << 16 | code[0];
+}
+
+// the constants are the ones of the chunk the code was lowered from
+size_t regcode_instr_debug(const LoxFunction * func, size_t offset) {
+    const LoxRegCode * reg     = func->reg;
+    const LoxValue * constants = func->chunk.constants.values;
+    const uint16_t * instr = &reg->code[offset];
+    uint16_t op = instr[0];
+
+    printf("%04zu ", offset);
+    if(offset > 0 && reg->lines[offset - 1] == reg->lines[offset])
+        fputs("   | ", stdout);
+    else
+        printf("%4u ", reg->lines[offset]);
+    printf("%-20s", regcode_opcode_name(op));
+
+    switch(op) {
+        case ROP_MOVE   : printf(" r%u r%u", instr[1], instr[2]); break;
+        case ROP_LOADK  : printf(" r%u", instr[1]); print_rk(constants, RK_CONST | read_long(&instr[2])); break;
+        case ROP_NIL:
+        case ROP_TRUE:
+        case ROP_FALSE  : printf(" r%u", instr[1]); break;
+        case ROP_GET_GLOBAL : printf(" r%u g%u", instr[1], read_long(&instr[2])); break;
+        case ROP_SET_GLOBAL:
+        case ROP_DEFINE_GLOBAL:
+            printf(" g%u", read_long(&instr[1]));
+            print_rk(constants, instr[3]);
+            break;
+        case ROP_NEG:
+        case ROP_NOT:
+            printf(" r%u", instr[1]);
+            print_rk(constants, instr[2]);
+            break;
+        case ROP_PRINT:
+        case ROP_RETURN:
+            print_rk(constants, instr[1]);
+            break;
+        case ROP_JUMP : printf(" (%04u)", read_long(&instr[1])); break;
+        case ROP_JUMP_IF_FALSE:
+            print_rk(constants, instr[1]);
+            printf(" (%04u)", read_long(&instr[2]));
+            break;
+        case ROP_JUMP_UNLESS_LESS:
+            print_rk(constants, instr[1]);
+            print_rk(constants, instr[2]);
+            printf(" (%04u)", read_long(&instr[3]));
+            break;
+        case ROP_CALL : printf(" r%u %u", instr[1], instr[2]); break;
+        default:
+            printf(" r%u", instr[1]);
+            print_rk(constants, instr[2]);
+            print_rk(constants, instr[3]);
+    }
+    putchar('\n');
+    return offset + regcode_instr_length(op);
+}
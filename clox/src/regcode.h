@@ -0,0 +1,76 @@
+#ifndef CLOX_REGCODE_H
+#define CLOX_REGCODE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "value.h"
+
+// Register code, run by the register backend (see `vm_run_register`). Every function
+// has a window of `frame_size` registers on the vm stack, starting at its callee slot:
+// register 0 is the callee, the arguments and the locals follow in their compiler
+// slots (the `LocalVar` ones) and the temporaries of the expressions come after.
+//
+// The code is a sequence of 16 bit units, the opcode first and then its operands:
+//   A, B, C  a register
+//   RK       a register, or a constant when RK_CONST is set (`RK_CONST | index`)
+//   K, S, T  a constant index, a global slot and a jump target (absolute unit offset),
+//            32 bits each, low unit first
+// Every instruction reads its operands before writing A, so A may be one of them.
+typedef enum {
+    ROP_MOVE,           // A B: R[A] = R[B]
+    ROP_LOADK,          // A K: R[A] = constant K
+    ROP_NIL,            // A
+    ROP_TRUE,           // A
+    ROP_FALSE,          // A
+
+    ROP_GET_GLOBAL,     // A S
+    ROP_SET_GLOBAL,     // S RK
+    ROP_DEFINE_GLOBAL,  // S RK
+
+    ROP_NEG,            // A RK
+    ROP_NOT,            // A RK
+    ROP_ADD,            // A RK RK, and so on up to ROP_GREATER_EQ
+    ROP_SUB,
+    ROP_MULT,
+    ROP_DIV,
+    ROP_EQ,
+    ROP_NOT_EQ,
+    ROP_LESS,
+    ROP_GREATER,
+    ROP_LESS_EQ,
+    ROP_GREATER_EQ,
+
+    ROP_PRINT,          // RK
+
+    ROP_JUMP,           // T
+    ROP_JUMP_IF_FALSE,  // RK T
+    ROP_JUMP_UNLESS_LESS, // RK RK T: jumps unless `RK < RK`
+
+    ROP_CALL,           // A <args>: calls R[A] with R[A + 1]... and puts the result in R[A]
+    ROP_RETURN,         // RK
+
+    ROP_CODES_COUNT, // not an instruction, keep it last
+} RegOpCode;
+
+#define RK_CONST     0x8000u
+#define RK_MAX_CONST 0x7fffu // the constants past it are loaded into a register first
+
+typedef struct __lox_reg_code__ {
+    uint16_t * code;
+    uint32_t * lines; // line of every code unit
+    size_t length;
+    size_t frame_size; // registers of the window, the callee included
+} LoxRegCode;
+
+// Lowers the stack code of `func`, and of the functions it defines, into register code
+// (`func->reg`). The functions that have it already are left alone, so shared code
+// lowered before being frozen is never written again.
+void regcode_lower(LoxFunction * func);
+void regcode_free(LoxRegCode * reg);
+
+const char * regcode_opcode_name(uint16_t opcode);
+size_t regcode_instr_length(uint16_t opcode); // opcode and operands, in units
+size_t regcode_instr_debug(const LoxFunction * func, size_t offset);
+
+#endif
@@ -0,0 +1,204 @@
+#include "stats.h"
+#include "memory.h"
+#include "utils.h"
+
+#include <string.h>
+
+#define STATS_TOP_PAIRS 20
+
+void stats_init(LoxStats * stats) {
+    memset(stats->ops, 0, sizeof(stats->ops));
+    memset(stats->pairs, 0, sizeof(stats->pairs));
+    stats->previous       = OP_CODES_COUNT;
+    stats->native_calls   = 0;
+    stats->lox_calls      = 0;
+    stats->funcs          = NULL;
+    stats->funcs_length   = 0;
+    stats->funcs_capacity = 0;
+}
+
+void stats_destroy(LoxStats * stats) {
+    mem_dealloc(stats->funcs);
+    stats->funcs          = NULL;
+    stats->funcs_length   = 0;
+    stats->funcs_capacity = 0;
+}
+
+static LoxFuncCalls * find_func(LoxFuncCalls * funcs, size_t capacity, const LoxFunction * func) {
+    size_t mask = capacity - 1;
+    for(size_t idx = ((uintptr_t) func >> 4) & mask;; idx = (idx + 1) & mask) {
+        if(funcs[idx].func == func || funcs[idx].func == NULL)
+            return &funcs[idx];
+    }
+}
+
+void stats_record_call(LoxStats * stats, const LoxFunction * func) {
+    stats->lox_calls++;
+
+    if(2 * (stats->funcs_length + 1) > stats->funcs_capacity) {
+        size_t capacity = stats->funcs_capacity < 16 ? 16 : 2 * stats->funcs_capacity;
+        LoxFuncCalls * funcs = mem_alloc(sizeof(LoxFuncCalls) * capacity);
+        memset(funcs, 0, sizeof(LoxFuncCalls) * capacity);
+
+        for(size_t i = 0; i < stats->funcs_capacity; i++) {
+            if(stats->funcs[i].func != NULL)
+                *find_func(funcs, capacity, stats->funcs[i].func) = stats->funcs[i];
+        }
+
+        mem_dealloc(stats->funcs);
+        stats->funcs          = funcs;
+        stats->funcs_capacity = capacity;
+    }
+
+    LoxFuncCalls * entry = find_func(stats->funcs, stats->funcs_capacity, func);
+    if(entry->func == NULL) {
+        entry->func = func;
+        stats->funcs_length++;
+    }
+    entry->calls++;
+}
+
+void stats_mark(LoxGC * gc, const LoxStats * stats) {
+    for(size_t i = 0; i < stats->funcs_capacity; i++) {
+        if(stats->funcs[i].func != NULL)
+            gc_mark_object(gc, (LoxObject *) stats->funcs[i].func);
+    }
+}
+
+// names are only unique for ordinary functions, anonymous ones get their first line
+static void print_func_name(const LoxFunction * func, FILE * out) {
+    switch(func->type) {
+        case FUNC_SCRIPT   : fputs("<script>", out); break;
+        case FUNC_ORDINARY : fputs(func->name->chars, out); break;
+        case FUNC_ANONYMOUS: 
+            fprintf(out, "<anonymous:%u>", func->chunk.code.length > 0 ? chunk_get_line(&func->chunk, 0) : 0);
+            break;
+        default: UNREACHABLE();
+    }
+}
+
+typedef struct {
+    uint8_t first;
+    uint8_t second;
+    uint64_t count;
+} OpPair;
+
+static int cmp_pairs(const void * a, const void * b) {
+    uint64_t x = ((const OpPair *) a)->count, y = ((const OpPair *) b)->count;
+    return x < y ? 1 : (x > y ? -1 : 0);
+}
+
+static int cmp_funcs(const void * a, const void * b) {
+    uint64_t x = ((const LoxFuncCalls *) a)->calls, y = ((const LoxFuncCalls *) b)->calls;
+    return x < y ? 1 : (x > y ? -1 : 0);
+}
+
+// every counter sorted in decreasing order (the first opcode's "pair" is left out)
+static size_t sorted_pairs(const LoxStats * stats, OpPair * pairs) {
+    size_t length = 0;
+    for(size_t i = 0; i < OP_CODES_COUNT; i++) {
+        for(size_t j = 0; j < OP_CODES_COUNT; j++) {
+            if(stats->pairs[i][j] > 0)
+                pairs[length++] = (OpPair) { .first = i, .second = j, .count = stats->pairs[i][j] };
+        }
+    }
+    qsort(pairs, length, sizeof(OpPair), cmp_pairs);
+    return length;
+}
+
+static size_t sorted_funcs(const LoxStats * stats, LoxFuncCalls * funcs) {
+    size_t length = 0;
+    for(size_t i = 0; i < stats->funcs_capacity; i++) {
+        if(stats->funcs[i].func != NULL)
+            funcs[length++] = stats->funcs[i];
+    }
+    qsort(funcs, length, sizeof(LoxFuncCalls), cmp_funcs);
+    return length;
+}
+
+static void print_table(const LoxStats * stats, uint64_t total, OpPair * pairs, size_t pairs_length, 
+                        LoxFuncCalls * funcs, size_t funcs_length, FILE * out) {
+    OpPair ops[OP_CODES_COUNT];
+    size_t ops_length = 0;
+    for(size_t i = 0; i < OP_CODES_COUNT; i++) {
+        if(stats->ops[i] > 0)
+            ops[ops_length++] = (OpPair) { .first = i, .count = stats->ops[i] };
+    }
+    qsort(ops, ops_length, sizeof(OpPair), cmp_pairs);
+
+    fprintf(out, "instructions: %lu\n", (unsigned long) total);
+    fprintf(out, "\n%-26s %14s %7s\n", "opcode", "count", "%");
+    for(size_t i = 0; i < ops_length; i++) {
+        fprintf(out, "%-26s %14lu %6.2f%%\n", chunk_opcode_name(ops[i].first), 
+                (unsigned long) ops[i].count, 100.0 * ops[i].count / total);
+    }
+
+    fprintf(out, "\n%-26s %-26s %14s %7s\n", "first", "second", "count", "%");
+    for(size_t i = 0; i < pairs_length && i < STATS_TOP_PAIRS; i++) {
+        fprintf(out, "%-26s %-26s %14lu %6.2f%%\n", chunk_opcode_name(pairs[i].first), chunk_opcode_name(pairs[i].second),
+                (unsigned long) pairs[i].count, 100.0 * pairs[i].count / total);
+    }
+
+    fprintf(out, "\ncalls: %lu to lox functions, %lu to native functions\n", 
+            (unsigned long) stats->lox_calls, (unsigned long) stats->native_calls);
+    for(size_t i = 0; i < funcs_length; i++) {
+        fprintf(out, "%14lu  ", (unsigned long) funcs[i].calls);
+        print_func_name(funcs[i].func, out);
+        fputc('\n', out);
+    }
+}
+
+static void print_json(const LoxStats * stats, uint64_t total, OpPair * pairs, size_t pairs_length, 
+                       LoxFuncCalls * funcs, size_t funcs_length, FILE * out) {
+    fputs("{\n", out);
+    fprintf(out, "  \"instructions\": %lu,\n", (unsigned long) total);
+
+    fputs("  \"opcodes\": {", out);
+    bool first = true;
+    for(size_t i = 0; i < OP_CODES_COUNT; i++) {
+        if(stats->ops[i] == 0) continue;
+        fprintf(out, "%s\n    \"%s\": %lu", first ? "" : ",", chunk_opcode_name(i), (unsigned long) stats->ops[i]);
+        first = false;
+    }
+    fputs("\n  },\n", out);
+
+    fputs("  \"pairs\": [", out);
+    for(size_t i = 0; i < pairs_length; i++) {
+        fprintf(out, "%s\n    { \"first\": \"%s\", \"second\": \"%s\", \"count\": %lu }", i == 0 ? "" : ",",
+                chunk_opcode_name(pairs[i].first), chunk_opcode_name(pairs[i].second), (unsigned long) pairs[i].count);
+    }
+    fputs("\n  ],\n", out);
+
+    fprintf(out, "  \"calls\": { \"lox\": %lu, \"native\": %lu },\n", 
+            (unsigned long) stats->lox_calls, (unsigned long) stats->native_calls);
+
+    // lox identifiers need no escaping
+    fputs("  \"functions\": [", out);
+    for(size_t i = 0; i < funcs_length; i++) {
+        fprintf(out, "%s\n    { \"name\": \"", i == 0 ? "" : ",");
+        print_func_name(funcs[i].func, out);
+        fprintf(out, "\", \"calls\": %lu }", (unsigned long) funcs[i].calls);
+    }
+    fputs("\n  ]\n}\n", out);
+}
+
+void stats_print(const LoxStats * stats, LoxStatsFormat format, FILE * out) {
+    uint64_t total = 0;
+    for(size_t i = 0; i < OP_CODES_COUNT; i++) 
+        total += stats->ops[i];
+
+    OpPair * pairs = mem_alloc(sizeof(OpPair) * OP_CODES_COUNT * OP_CODES_COUNT);
+    size_t pairs_length = sorted_pairs(stats, pairs);
+
+    LoxFuncCalls * funcs = mem_alloc(sizeof(LoxFuncCalls) * (stats->funcs_length + 1));
+    size_t funcs_length  = sorted_funcs(stats, funcs);
+
+    switch(format) {
+        case STATS_TABLE: print_table(stats, total, pairs, pairs_length, funcs, funcs_length, out); break;
+        case STATS_JSON : print_json(stats, total, pairs, pairs_length, funcs, funcs_length, out);  break;
+        default: UNREACHABLE();
+    }
+
+    mem_dealloc(pairs);
+    mem_dealloc(funcs);
+}
@@ -0,0 +1,47 @@
+#ifndef CLOX_STATS_H
+#define CLOX_STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "lox.h"
+#include "chunk.h"
+#include "gc.h"
+
+typedef struct {
+    const LoxFunction * func;
+    uint64_t calls;
+} LoxFuncCalls;
+
+// Execution counters for --stats: how many times each opcode ran, how often each
+// opcode followed another one and what got called. The vm only pays for them when
+// they are enabled.
+typedef struct {
+    uint64_t ops[OP_CODES_COUNT];
+    uint64_t pairs[OP_CODES_COUNT + 1][OP_CODES_COUNT]; // the extra row is for the first opcode
+    uint8_t previous;
+
+    uint64_t native_calls;
+    uint64_t lox_calls;
+
+    // open addressing by function address (power of two capacity), the functions are
+    // kept alive by `stats_mark`
+    LoxFuncCalls * funcs;
+    size_t funcs_length;
+    size_t funcs_capacity;
+} LoxStats;
+
+void stats_init(LoxStats * stats);
+void stats_destroy(LoxStats * stats);
+
+static inline void stats_record_op(LoxStats * stats, uint8_t op) {
+    stats->ops[op]++;
+    stats->pairs[stats->previous][op]++;
+    stats->previous = op;
+}
+
+void stats_record_call(LoxStats * stats, const LoxFunction * func);
+void stats_mark(LoxGC * gc, const LoxStats * stats);
+void stats_print(const LoxStats * stats, LoxStatsFormat format, FILE * out);
+
+#endif
@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <time.h>
+#include <sys/stat.h>
 
 #include "utils.h"
 
@@ -32,3 +34,24 @@ void assert(struct __location__ loc, int condition, char * expr, char * message,
 
     exit(EXIT_FAILURE);
 }
+
+uint64_t time_monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+char * read_file(const char * path) {
+    FILE * file = fopen(path, "r");
+    if(file == NULL) return NULL;
+
+    struct stat st;
+    char * data = NULL;
+    if(fstat(fileno(file), &st) == 0 && (data = malloc(st.st_size + 1)) != NULL) {
+        size_t length = fread(data, sizeof(char), st.st_size, file);
+        data[length] = '\0';
+    }
+
+    fclose(file);
+    return data;
+}
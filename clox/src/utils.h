@@ -3,13 +3,22 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 // TODO: create a set of functions that these macros call c:
 
 #define UNREACHABLE() unreachable(CURRENT_LOCATION())
 #define TODO(msg)     todo(CURRENT_LOCATION(), msg)
+
+// release builds (NDEBUG, see RELEASE in the Makefile) drop the checks, the expression
+// is still type checked but never evaluated
+#ifdef NDEBUG
+#define ASSERTF(expr, msg, ...) ((void) sizeof(!(expr)))
+#define ASSERT(expr)            ((void) sizeof(!(expr)))
+#else
 #define ASSERTF(expr, msg, ...) assert(CURRENT_LOCATION(), expr, #expr, msg __VA_OPT__(,) __VA_ARGS__)
 #define ASSERT(expr) assert(CURRENT_LOCATION(), expr, #expr, 0)
+#endif
 
 #define CURRENT_LOCATION() ((struct __location__) { .file = __FILE__, .function = __func__, .line = __LINE__ } )
 
@@ -24,4 +33,9 @@ void assert(struct __location__ loc, int condition, char * expr, char * message,
 void unreachable(struct __location__ loc) __attribute__((noreturn));
 void todo(struct __location__ loc, char * message) __attribute__((noreturn));
 
+uint64_t time_monotonic_ns(void);
+
+// the whole file, null terminated, NULL (with errno set) if it can't be read
+char * read_file(const char * path);
+
 #endif
@@ -6,81 +6,138 @@
 #include "utils.h"
 #include "chunk.h"
 #include "hash-map.h"
+#include "gc.h"
 
 void value_print(LoxValue value){
-    switch(value.type) {
-        case VAL_NUMBER:
-            printf("%g", value.as.number);
-            break;
-        case VAL_BOOL:
-            fputs(value.as.boolean ? "true" : "false", stdout);
-           break;
-        case VAL_NIL:
-            fputs("nil", stdout);
-            break;
-        case VAL_OBJ:
-            switch(value.as.object->type) {
-                case OBJ_STRING:
-                    fputs(VAL_AS_CSTRING(value), stdout);
-                    break;
-                case OBJ_NATIVE_FN:
-                    fputs("<native fn>", stdout);
-                    break;
-                case OBJ_FUNC: {
-                    LoxFunction * func = VAL_AS_FUNC(value);
-
-                    switch(func->type) {
-                        case FUNC_SCRIPT    : fputs("<script fn>", stdout);      break;
-                        case FUNC_ANONYMOUS : fputs("<anonymous fn>", stdout);   break;
-                        case FUNC_ORDINARY  : printf("<fn %s>", func->name->chars); break;
-                        default: UNREACHABLE();
-                    }
-                } break;
-                default: UNREACHABLE();
+    value_fprint(stdout, value);
+}
+
+void value_fprint(FILE * out, LoxValue value){
+    if(VAL_IS_NUMBER(value)) {
+        fprintf(out, "%g", VAL_AS_NUMBER(value));
+    } else if(VAL_IS_BOOL(value)) {
+        fputs(VAL_AS_BOOL(value) ? "true" : "false", out);
+    } else if(VAL_IS_NIL(value)) {
+        fputs("nil", out);
+    } else if(VAL_IS_OBJ(value)) {
+        switch(VAL_AS_OBJ(value)->type) {
+            case OBJ_STRING:
+                fputs(VAL_AS_CSTRING(value), out);
+                break;
+            case OBJ_NATIVE_FN:
+                fputs("<native fn>", out);
+                break;
+            case OBJ_FUNC: {
+                LoxFunction * func = VAL_AS_FUNC(value);
+
+                switch(func->type) {
+                    case FUNC_SCRIPT    : fputs("<script fn>", out);      break;
+                    case FUNC_ANONYMOUS : fputs("<anonymous fn>", out);   break;
+                    case FUNC_ORDINARY  : fprintf(out, "<fn %s>", func->name->chars); break;
+                    default: UNREACHABLE();
+                }
             } break;
-        default: UNREACHABLE();
+            default: UNREACHABLE();
+        }
+    } else {
+        UNREACHABLE();
     }
 }
 
+size_t value_format(LoxValue value, char * buffer) {
+    if(VAL_IS_NUMBER(value))
+        return snprintf(buffer, VALUE_FORMAT_MAX, "%g", VAL_AS_NUMBER(value));
+    if(VAL_IS_BOOL(value))
+        return snprintf(buffer, VALUE_FORMAT_MAX, "%s", VAL_AS_BOOL(value) ? "true" : "false");
+    if(VAL_IS_NIL(value))
+        return snprintf(buffer, VALUE_FORMAT_MAX, "nil");
+    UNREACHABLE();
+}
+
 bool value_eq(LoxValue v1, LoxValue v2) {
+#ifdef NAN_BOXING
+    // numbers still follow IEEE 754 (NaN != NaN and 0 == -0)
+    if(VAL_IS_NUMBER(v1) && VAL_IS_NUMBER(v2))
+        return VAL_AS_NUMBER(v1) == VAL_AS_NUMBER(v2);
+    return v1 == v2;
+#else
     if(v1.type != v2.type) return false;
 
     switch(v1.type) {
         case VAL_NIL:
             return true;
         case VAL_NUMBER:
-            return v1.as.number == v2.as.number;
+            return VAL_AS_NUMBER(v1) == VAL_AS_NUMBER(v2);
         case VAL_BOOL:
-            return v1.as.boolean == v2.as.boolean;
+            return VAL_AS_BOOL(v1) == VAL_AS_BOOL(v2);
         case VAL_OBJ:
-            return v1.as.object == v2.as.object;
+            return VAL_AS_OBJ(v1) == VAL_AS_OBJ(v2);
         default:
             UNREACHABLE();
     }
     return false;
+#endif
 }
 
-LoxString * lox_str_take(const char * str, size_t length, uint32_t hash) {
-    LoxString * lstr = mem_alloc(sizeof(LoxString));
+// Stricter than `value_eq`: numbers are compared bit by bit, so 0 and -0 are
+// different values while a NaN is identical to itself (and objects to themselves).
+bool value_identical(LoxValue v1, LoxValue v2) {
+#ifdef NAN_BOXING
+    return v1 == v2;
+#else
+    if(v1.type != v2.type) return false;
 
-    lstr->obj.type = OBJ_STRING;
-    lstr->obj.next = NULL;
+    switch(v1.type) {
+        case VAL_NIL:
+        case VAL_UNDEFINED:
+            return true;
+        case VAL_NUMBER:
+            return memcmp(&v1.as.number, &v2.as.number, sizeof(double)) == 0;
+        case VAL_BOOL:
+            return VAL_AS_BOOL(v1) == VAL_AS_BOOL(v2);
+        case VAL_OBJ:
+            return VAL_AS_OBJ(v1) == VAL_AS_OBJ(v2);
+        default:
+            UNREACHABLE();
+    }
+#endif
+}
 
-    lstr->chars  = str;
-    lstr->length = length;
-    lstr->hash   = hash;
-    return lstr;
+// hash consistent with `value_identical`
+uint32_t value_identity_hash(LoxValue value) {
+    uint64_t bits;
+#ifdef NAN_BOXING
+    bits = value;
+#else
+    switch(value.type) {
+        case VAL_NUMBER: memcpy(&bits, &value.as.number, sizeof(bits)); break;
+        case VAL_BOOL:   bits = VAL_AS_BOOL(value);                      break;
+        case VAL_OBJ:    bits = (uintptr_t) VAL_AS_OBJ(value);           break;
+        default:         bits = 0;                                       break;
+    }
+    bits ^= (uint64_t) value.type << 56;
+#endif
+    // the fmix64 step of MurmurHash3, pointers and small integers spread poorly otherwise
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdu;
+    bits ^= bits >> 33;
+    bits *= 0xc4ceb9fe1a85ec53u;
+    bits ^= bits >> 33;
+    return (uint32_t) bits;
 }
 
-LoxString * lox_str_copy(const char * str, size_t length, uint32_t hash) {
-    char * str_value = mem_alloc(length + 1);
+// allocated straight into the old generation
+LoxString * lox_str_copy(LoxGC * gc, const char * str, size_t length, uint32_t hash) {
+    LoxString * lstr = (LoxString *) gc_alloc_object(gc, lox_str_size(length), OBJ_STRING);
 
-    // I could've used `strncpy(str_value, str, size)` but valgrind doesn't like it
+    // I could've used `strncpy(lstr->chars, str, size)` but valgrind doesn't like it
     // so I used the following two lines just to shut it up c:
-    memcpy(str_value, str, length);
-    str_value[length] = 0;
+    memcpy(lstr->chars, str, length);
+    lstr->chars[length] = 0;
 
-    return lox_str_take(str_value, length, hash);
+    lstr->length = length;
+    lstr->hash   = hash;
+    return lstr;
 }
 
 bool lox_str_eq(const LoxString * s1, const LoxString * s2) {
@@ -89,50 +146,60 @@ bool lox_str_eq(const LoxString * s1, const LoxString * s2) {
         && memcmp(s1->chars, s2->chars, s1->length) == 0;
 }
 
-void lox_obj_destroy(LoxObject * obj) {
-    obj->next = NULL;
-    mem_dealloc(obj);
-}
-
-LoxFunction * lox_func_create(const LoxString * name, LoxFuncType type) {
-    LoxFunction * func = mem_alloc(sizeof(LoxFunction));
-
-    func->obj.type = OBJ_FUNC;
-    func->obj.next = NULL;
+LoxFunction * lox_func_create(LoxGC * gc, const LoxString * name, LoxFuncType type) {
+    LoxFunction * func = (LoxFunction *) gc_alloc_object(gc, sizeof(LoxFunction), OBJ_FUNC);
 
     func->type     = type;
     func->name     = name;
     func->arity    = 0;
+    func->reg      = NULL;
 
     chunk_init(&func->chunk);
     return func;
 }
 
-const LoxString * lox_str_intern(struct __hash_map__ * strings, const char * str, size_t length) {
+// Allocates a string whose characters (and hash) are filled in by the caller,
+// small ones are born in the nursery.
+LoxString * lox_str_alloc(LoxGC * gc, size_t length) {
+    LoxString * str = (LoxString *) gc_alloc_young(gc, lox_str_size(length), OBJ_STRING);
+    if(str == NULL)
+        str = (LoxString *) gc_alloc_object(gc, lox_str_size(length), OBJ_STRING);
+
+    str->chars[length] = 0;
+    str->length = length;
+    str->hash   = 0;
+    return str;
+}
+
+// for strings that are likely short lived, e.g. the ones built at runtime
+const LoxString * lox_str_intern_young(LoxGC * gc, HashMap * strings, const char * str, size_t length) {
     uint32_t hash = str_hash(str, length);
     const LoxString * lox_str;
     if((lox_str = map_find_str(strings, str, length, hash)) == NULL) {
-        lox_str = lox_str_copy(str, length, hash);
-        map_set(strings, lox_str, BOOL_VAL(true));
+        LoxString * new_str = lox_str_alloc(gc, length);
+        memcpy(new_str->chars, str, length);
+        new_str->hash = hash;
+
+        map_set(strings, new_str, BOOL_VAL(true));
+        lox_str = new_str;
     }
     return lox_str;
 }
 
-bool lox_make_callable(LoxCallable * callable, const LoxValue value) {
-    if(VAL_IS_FUNC(value)) {
-        LoxFunction * func = VAL_AS_FUNC(value);
-        callable->arity = func->arity;
-        callable->name  = 
-            func->type == FUNC_ORDINARY ? func->name->chars 
-                : (func->type == FUNC_SCRIPT ? "<script fn>" : "<anonymous fn>" );
-        return true;
-    } 
-
-    if(VAL_IS_NATIVE_FN(value)) {
-        callable->arity = VAL_AS_NATIVE_FN(value)->arity;
-        callable->name  = "<native fn>";
-        return true;
+// for strings referenced by code (constants and globals names), which are always old
+const LoxString * lox_str_intern(LoxGC * gc, HashMap * strings, const char * str, size_t length) {
+    uint32_t hash = str_hash(str, length);
+    const LoxString * lox_str = map_find_str(strings, str, length, hash);
+
+    if(lox_str != NULL && gc_is_young(gc, &lox_str->obj)) {
+        // promotes it if anything still uses it, otherwise it is gone
+        gc_minor_collect(gc);
+        lox_str = map_find_str(strings, str, length, hash);
     }
 
-    return false;
+    if(lox_str == NULL) {
+        lox_str = lox_str_copy(gc, str, length, hash);
+        map_set(strings, lox_str, BOOL_VAL(true));
+    }
+    return lox_str;
 }
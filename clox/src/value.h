@@ -1,30 +1,23 @@
 #ifndef CLOX_VALUE_H
 #define CLOX_VALUE_H
 
+#include <stdio.h>
 #include <stdbool.h>
 #include <sys/types.h>
 #include <stdint.h>
+#include <string.h>
 #include "darray.h"
 
-#define VAL_IS_BOOL(value)   ((value).type == VAL_BOOL)
-#define VAL_IS_NIL(value)    ((value).type == VAL_NIL)
-#define VAL_IS_NUMBER(value) ((value).type == VAL_NUMBER)
-#define VAL_IS_OBJ(value)    ((value).type == VAL_OBJ)
 #define VAL_IS_STRING(value) value_is_of_object_type((value), OBJ_STRING)
 
-#define VAL_AS_STRING(value)  ((LoxString *) (value).as.object)
+#define VAL_AS_STRING(value)  ((LoxString *) VAL_AS_OBJ(value))
 #define VAL_AS_CSTRING(value) (VAL_AS_STRING(value)->chars)
 
-#define VAL_AS_FUNC(value)  ((LoxFunction *) (value).as.object)
+#define VAL_AS_FUNC(value)  ((LoxFunction *) VAL_AS_OBJ(value))
 #define VAL_IS_FUNC(value)  value_is_of_object_type((value), OBJ_FUNC)
 
 #define VAL_IS_NATIVE_FN(value)  value_is_of_object_type((value), OBJ_NATIVE_FN)
-#define VAL_AS_NATIVE_FN(value)  ((LoxNativeFn *) (value).as.object)
-
-#define BOOL_VAL(val)    ((LoxValue) { .type = VAL_BOOL,   .as.boolean = (val) })
-#define NUMBER_VAL(val)  ((LoxValue) { .type = VAL_NUMBER, .as.number  = (val)  })
-#define OBJ_VAL(val)     ((LoxValue) { .type = VAL_OBJ,    .as.object  = (LoxObject *) (val) })
-#define NIL_VAL          ((LoxValue) { .type = VAL_NIL,    .as.number  = 0 })
+#define VAL_AS_NATIVE_FN(value)  ((LoxNativeFn *) VAL_AS_OBJ(value))
 
 typedef enum {
     OBJ_STRING,
@@ -34,23 +27,78 @@ typedef enum {
 
 typedef struct __lox_object__ {
     LoxObjectType type;
+    bool is_marked;
     struct __lox_object__ * next;
 } LoxObject;
 
+// the characters (plus the final '\0') live in the same allocation as the header
 typedef struct {
     LoxObject obj;
     size_t length;
     uint32_t hash;
-    const char * chars;
+    char chars[];
 } LoxString;
 
+static inline size_t lox_str_size(size_t length) {
+    return sizeof(LoxString) + length + 1;
+}
+
 typedef enum {
     VAL_NIL,
     VAL_OBJ,
     VAL_BOOL,
     VAL_NUMBER,
+    VAL_UNDEFINED, // never seen by lox code, marks global slots that weren't defined
 } LoxValueType;
 
+#ifdef NAN_BOXING
+
+// Every double that isn't a quiet NaN is stored as is. Everything else lives in the
+// payload of a quiet NaN: objects set the sign bit and keep their pointer on the low
+// 48 bits, the singletons (nil, true, false and undefined) use small tags on the lowest bits.
+typedef uint64_t LoxValue;
+
+#define SIGN_BIT ((uint64_t) 0x8000000000000000)
+#define QNAN     ((uint64_t) 0x7ffc000000000000)
+
+#define TAG_NIL   1
+#define TAG_FALSE 2
+#define TAG_TRUE  3
+#define TAG_UNDEFINED 4
+
+#define FALSE_VAL ((LoxValue) (QNAN | TAG_FALSE))
+#define TRUE_VAL  ((LoxValue) (QNAN | TAG_TRUE))
+
+#define VAL_IS_BOOL(value)   (((value) | 1) == TRUE_VAL)
+#define VAL_IS_NIL(value)    ((value) == NIL_VAL)
+#define VAL_IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+#define VAL_IS_NUMBER(value) (((value) & QNAN) != QNAN)
+#define VAL_IS_OBJ(value)    (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+#define VAL_AS_BOOL(value)   ((value) == TRUE_VAL)
+#define VAL_AS_NUMBER(value) value_to_number(value)
+#define VAL_AS_OBJ(value)    ((LoxObject *) (uintptr_t) ((value) & ~(SIGN_BIT | QNAN)))
+
+#define BOOL_VAL(val)    ((val) ? TRUE_VAL : FALSE_VAL)
+#define NUMBER_VAL(val)  number_to_value(val)
+#define OBJ_VAL(val)     ((LoxValue) (SIGN_BIT | QNAN | (uint64_t) (uintptr_t) (val)))
+#define NIL_VAL          ((LoxValue) (QNAN | TAG_NIL))
+#define UNDEFINED_VAL    ((LoxValue) (QNAN | TAG_UNDEFINED))
+
+static inline double value_to_number(LoxValue value) {
+    double number;
+    memcpy(&number, &value, sizeof(double));
+    return number;
+}
+
+static inline LoxValue number_to_value(double number) {
+    LoxValue value;
+    memcpy(&value, &number, sizeof(double));
+    return value;
+}
+
+#else
+
 typedef struct {
     LoxValueType type;
     union {
@@ -60,13 +108,33 @@ typedef struct {
     } as;
 } LoxValue;
 
+#define VAL_IS_BOOL(value)   ((value).type == VAL_BOOL)
+#define VAL_IS_NIL(value)    ((value).type == VAL_NIL)
+#define VAL_IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
+#define VAL_IS_NUMBER(value) ((value).type == VAL_NUMBER)
+#define VAL_IS_OBJ(value)    ((value).type == VAL_OBJ)
+
+#define VAL_AS_BOOL(value)   ((value).as.boolean)
+#define VAL_AS_NUMBER(value) ((value).as.number)
+#define VAL_AS_OBJ(value)    ((value).as.object)
+
+#define BOOL_VAL(val)    ((LoxValue) { .type = VAL_BOOL,   .as.boolean = (val) })
+#define NUMBER_VAL(val)  ((LoxValue) { .type = VAL_NUMBER, .as.number  = (val)  })
+#define OBJ_VAL(val)     ((LoxValue) { .type = VAL_OBJ,    .as.object  = (LoxObject *) (val) })
+#define NIL_VAL          ((LoxValue) { .type = VAL_NIL,    .as.number  = 0 })
+#define UNDEFINED_VAL    ((LoxValue) { .type = VAL_UNDEFINED, .as.number = 0 })
+
+#endif
+
+// consecutive bytes of code that came from the same source line
 typedef struct {
     uint32_t line;
-    uint8_t  op_code;
-} Instruction;
+    uint32_t length;
+} LoxLineRun;
 
 typedef struct {
-    DaArray(Instruction) code;
+    DaArray(uint8_t) code;
+    DaArray(LoxLineRun) lines;
     DaArray(LoxValue) constants;
 } LoxChunk;
 
@@ -79,6 +147,7 @@ typedef enum {
 typedef struct {
     LoxObject obj;
     LoxChunk chunk;
+    struct __lox_reg_code__ * reg; // the chunk lowered for the register backend, NULL until then
     const LoxString * name;
     LoxFuncType type;
     uint8_t arity;
@@ -93,27 +162,30 @@ typedef struct {
     Fn executor;
 } LoxNativeFn;
 
-typedef struct {
-    const char * name;
-    uint32_t arity;
-} LoxCallable;
-
 void value_print(LoxValue value);
+void value_fprint(FILE * out, LoxValue value);
+
+// The text `+` concatenates for a number, a boolean or nil, `buffer` must have room for
+// VALUE_FORMAT_MAX characters. Returns its length.
+#define VALUE_FORMAT_MAX 32
+size_t value_format(LoxValue value, char * buffer);
 bool value_eq(LoxValue v1, LoxValue v2);
+bool value_identical(LoxValue v1, LoxValue v2);
+uint32_t value_identity_hash(LoxValue value);
 static inline bool value_is_of_object_type(LoxValue value, LoxObjectType type) {
-    return VAL_IS_OBJ(value) && value.as.object->type == type;
+    return VAL_IS_OBJ(value) && VAL_AS_OBJ(value)->type == type;
 }
 
+// objects are allocated through (and owned by) the garbage collector
 struct __hash_map__;
-const LoxString * lox_str_intern(struct __hash_map__ * strings, const char * str, size_t length);
+struct __lox_gc__;
+const LoxString * lox_str_intern(struct __lox_gc__ * gc, struct __hash_map__ * strings, const char * str, size_t length);
 
-LoxString * lox_str_copy(const char * str, size_t length, uint32_t hash);
-LoxString * lox_str_take(const char * str, size_t length, uint32_t hash);
+LoxString * lox_str_copy(struct __lox_gc__ * gc, const char * str, size_t length, uint32_t hash);
+LoxString * lox_str_alloc(struct __lox_gc__ * gc, size_t length);
+const LoxString * lox_str_intern_young(struct __lox_gc__ * gc, struct __hash_map__ * strings, const char * str, size_t length);
 bool lox_str_eq(const LoxString * s1, const LoxString * s2);
-void lox_obj_destroy(LoxObject * obj);
-
-LoxFunction * lox_func_create(const LoxString * name, LoxFuncType type);
 
-bool lox_make_callable(LoxCallable * callable, const LoxValue value);
+LoxFunction * lox_func_create(struct __lox_gc__ * gc, const LoxString * name, LoxFuncType type);
 
 #endif 
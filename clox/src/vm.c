@@ -8,34 +8,114 @@
 
 #include "constants.h"
 #include "native-fn.h"
+#include "loxc.h"
+#include "optimizer.h"
+#include "regcode.h"
 
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <errno.h>
 
-static void vm_init(LoxVM * vm){
+// computed gotos are a GNU extension, everything else gets the plain switch
+#if defined(__GNUC__) && !defined(VM_SWITCH_DISPATCH)
+#define VM_THREADED_DISPATCH
+#endif
+
+void vm_config_init(LoxVMConfig * config) {
+    config->gc_min_heap    = GC_MIN_HEAP;
+    config->gc_grow_factor = GC_HEAP_GROW_FACTOR;
+    config->max_frames     = VM_MAX_FRAMES;
+    config->gc_stats       = false;
+    config->profile_path   = NULL;
+    config->stats          = STATS_NONE;
+    config->cache_path     = NULL;
+    config->source_mtime   = 0;
+    config->out            = NULL;
+    config->optimize       = false;
+    config->backend        = BACKEND_STACK;
+}
+
+// The stack is scanned up to its top on every collection, young or full, so pushes
+// need no barrier. Globals are only scanned by full collections, which is why the
+// ones that were given a young value are remembered (see `vm_global_write_barrier`).
+static void vm_mark_roots(LoxGC * gc, void * ctx, bool young_only) {
+    LoxVM * vm = ctx;
+
+    for(size_t i = 0; i < vm->stack.length; i++)
+        gc_visit_root(gc, &vm->stack.values[i]);
+    for(LoxHandle * handle = vm->handles; handle != NULL; handle = handle->next)
+        gc_visit_root(gc, &handle->value);
+    for(LoxHandle * handle = vm->native_handles; handle != NULL; handle = handle->next)
+        gc_visit_root(gc, &handle->value);
+
+    if(young_only) {
+        for(size_t i = 0; i < vm->young_globals.length; i++)
+            gc_visit_root(gc, &vm->globals.values.values[vm->young_globals.values[i]]);
+        vm->young_globals.length = 0;
+        return;
+    }
+
+    for(size_t i = 0; i < vm->frames_count; i++)
+        gc_mark_object(gc, (LoxObject *) vm->frames[i].func);
+
+    globals_mark(gc, &vm->globals);
+    if(vm->profiler != NULL) profiler_mark(gc, vm->profiler);
+    if(vm->stats != NULL) stats_mark(gc, vm->stats);
+}
+
+static void vm_init(LoxVM * vm, const LoxVMConfig * config){
     map_init(&vm->strings);
-    map_init(&vm->globals);
-    vm->objects      = NULL;
-    vm->stack.length = 0;
-    vm->frames_count = 0;
+    globals_init(&vm->globals);
+    da_init(&vm->young_globals);
+    vm->handles        = NULL;
+    vm->native_handles = NULL;
+    gc_init(&vm->gc, &vm->strings, vm_mark_roots, vm);
+    gc_configure(&vm->gc, config->gc_min_heap, config->gc_grow_factor);
+    vm->stack.values   = mem_alloc(VM_STACK_INITIAL * sizeof(LoxValue));
+    vm->stack.length   = 0;
+    vm->stack.capacity = VM_STACK_INITIAL;
+
+    vm->frames          = mem_alloc(VM_FRAMES_INITIAL * sizeof(LoxCallFrame));
+    vm->frames_count    = 0;
+    vm->frames_capacity = VM_FRAMES_INITIAL;
+    vm->max_frames      = config->max_frames;
+
+    vm->profiler     = NULL;
+    vm->stats        = NULL;
+    vm->config       = *config;
+    vm->out          = config->out != NULL ? config->out : stdout;
 
 } 
 
-static void vm_free_objects(LoxVM * vm){
-    for(LoxObject * curr = vm->objects; curr;) {
-        LoxObject * next = curr->next;
-        lox_obj_destroy(curr);
-        curr = next;
+static void vm_free_handles(LoxHandle * handle) {
+    while(handle != NULL) {
+        LoxHandle * next = handle->next;
+        mem_dealloc(handle);
+        handle = next;
     }
-    vm->objects = NULL;
 }
 
 static void vm_destroy(LoxVM * vm){
-    vm_free_objects(vm);
+    vm_free_handles(vm->handles);
+    vm_free_handles(vm->native_handles);
+    vm->handles        = NULL;
+    vm->native_handles = NULL;
+    gc_destroy(&vm->gc);
+    da_destroy(&vm->young_globals);
     map_destroy(&vm->strings);
-    map_destroy(&vm->globals);
-    vm->stack.length = 0;
+    globals_destroy(&vm->globals);
+
+    mem_dealloc(vm->stack.values);
+    vm->stack.values   = NULL;
+    vm->stack.length   = 0;
+    vm->stack.capacity = 0;
+
+    mem_dealloc(vm->frames);
+    vm->frames          = NULL;
+    vm->frames_count    = 0;
+    vm->frames_capacity = 0;
 }
 
 static inline LoxValue vm_stack_get(LoxVM * vm, size_t idx){
@@ -53,45 +133,45 @@ static inline LoxCallFrame * vm_current_frame(LoxVM * vm) {
     return &vm->frames[vm->frames_count - 1];
 }
 
-static inline LoxValue vm_get_constant(LoxVM * vm, uint8_t idx){
-    return chunk_get_constant(&vm_current_frame(vm)->func->chunk, idx);
-}
-
-static void vm_register_object(LoxVM * vm, LoxObject * obj){
-    ASSERTF(obj->next == NULL, "invalid object: obj->next field not null");
-    obj->next   = vm->objects;
-    vm->objects = obj;
+static inline void vm_global_write_barrier(LoxVM * vm, size_t slot, LoxValue value) {
+    if(gc_is_young_value(&vm->gc, value))
+        da_push(&vm->young_globals, slot);
 }
 
 void vm_define_native_fn(LoxVM * vm, const char * name, Fn executor, uint8_t arity) {
-    const LoxString * fn_name = lox_str_intern(&vm->strings, name, strlen(name));
-    LoxNativeFn * fn = mem_alloc(sizeof(LoxNativeFn));
-
-    fn->obj = (LoxObject) {
-        .type = OBJ_NATIVE_FN,
-        .next = NULL,
-    };
+    LoxNativeFn * fn = (LoxNativeFn *) gc_alloc_object(&vm->gc, sizeof(LoxNativeFn), OBJ_NATIVE_FN);
     fn->arity    = arity;
     fn->executor = executor;
 
-    vm_register_object(vm, &fn->obj);
-    map_set(&vm->globals, fn_name, OBJ_VAL(fn));
+    gc_push_root(&vm->gc, OBJ_VAL(fn));
+    const LoxString * fn_name = lox_str_intern(&vm->gc, &vm->strings, name, strlen(name));
+    size_t slot = globals_resolve(&vm->globals, fn_name);
+    vm->globals.values.values[slot] = OBJ_VAL(fn);
+    gc_pop_root(&vm->gc);
 }
 
-void vm_stack_push(LoxVM * vm, LoxValue value){
-    ASSERTF(vm->stack.length < MAX_STACK_SIZE, "stack overflow");
-    vm->stack.values[vm->stack.length++] = value;
-}
+// the frames point into the stack, so they're moved along with it
+void vm_stack_grow(LoxVM * vm) {
+    LoxValue * old_values = vm->stack.values;
+    vm->stack.capacity *= 2;
+    vm->stack.values    = mem_realloc(old_values, vm->stack.capacity * sizeof(LoxValue));
 
-LoxValue vm_stack_pop(LoxVM * vm){
-    ASSERT(vm->stack.length > 0);
-    return vm->stack.values[--vm->stack.length];
+    for(size_t i = 0; i < vm->frames_count; i++)
+        vm->frames[i].locals = vm->stack.values + (vm->frames[i].locals - old_values);
 }
 
-LoxValue vm_stack_peek(LoxVM * vm, size_t distance){
-    size_t idx = vm->stack.length - (1 + distance);
-    ASSERT(idx <= MAX_STACK_SIZE);
-    return vm->stack.values[idx];
+// The ip points past the instruction being run (or at the first one of a fresh frame).
+// The profiler's signal handler calls this too, the offset is checked for it.
+uint32_t vm_frame_line(const LoxVM * vm, const LoxCallFrame * frame) {
+    if(vm->config.backend == BACKEND_REGISTER) {
+        const LoxRegCode * reg = frame->func->reg;
+        size_t offset = frame->rip > reg->code ? (size_t) (frame->rip - reg->code) - 1 : 0;
+        return offset < reg->length ? reg->lines[offset] : 0;
+    }
+
+    const LoxChunk * chunk = &frame->func->chunk;
+    size_t offset = frame->ip > chunk->code.values ? (size_t) (frame->ip - chunk->code.values) - 1 : 0;
+    return offset < chunk->code.length ? chunk_get_line(chunk, offset) : 0;
 }
 
 void vm_report_runtime_error(LoxVM * vm, const char * format, ...) {
@@ -101,11 +181,17 @@ void vm_report_runtime_error(LoxVM * vm, const char * format, ...) {
     vfprintf(stderr, format, list);
     va_end(list);
 
+    // a deep stack (e.g. runaway recursion) only gets its innermost and outermost frames shown
+    size_t shown = VM_TRACE_FRAMES / 2;
     for(ssize_t i = vm->frames_count - 1; i >= 0; i--) {
-        LoxCallFrame * frame = &vm->frames[i];
-        Instruction instr = frame->ip[-1];
+        if(vm->frames_count > VM_TRACE_FRAMES && (size_t) i == vm->frames_count - 1 - shown) {
+            fprintf(stderr, "\n... %zu more frames ...", vm->frames_count - 2 * shown);
+            i = shown;
+            continue;
+        }
 
-        fprintf(stderr, "\n[line %u] in ", instr.line);
+        LoxCallFrame * frame = &vm->frames[i];
+        fprintf(stderr, "\n[line %u] in ", vm_frame_line(vm, frame));
         switch(frame->func->type) {
             case FUNC_SCRIPT   : fputs("script\n", stderr); break;
             case FUNC_ORDINARY : 
@@ -119,43 +205,107 @@ void vm_report_runtime_error(LoxVM * vm, const char * format, ...) {
     }
 }
 
+__attribute__((noinline, cold)) static void vm_report_arity_error(LoxVM * vm, LoxValue callee, uint8_t args_nr) {
+    const char * name = "<native fn>";
+    uint8_t arity;
+    if(VAL_IS_FUNC(callee)) {
+        const LoxFunction * func = VAL_AS_FUNC(callee);
+        arity = func->arity;
+        name  = func->type == FUNC_ORDINARY ? func->name->chars
+            : (func->type == FUNC_SCRIPT ? "<script fn>" : "<anonymous fn>");
+    } else {
+        arity = VAL_AS_NATIVE_FN(callee)->arity;
+    }
+
+    vm_report_runtime_error(
+        vm, "function '%s' expects %u arguments but %u was provided",
+        name, (unsigned) arity, (unsigned) args_nr
+    );
+}
+
 static const LoxString * vm_stingify_value(LoxVM * vm, LoxValue value){
     if(VAL_IS_STRING(value)) return VAL_AS_STRING(value);
 
-    char buffer[256];
-    if(VAL_IS_NUMBER(value))
-        sprintf(buffer, "%g", value.as.number);
-    else if(VAL_IS_BOOL(value)) 
-        strcpy(buffer, value.as.boolean ? "true" : "false");
-    else if(VAL_IS_NIL(value))
-        strcpy(buffer, "nil");
-    else {
-        UNREACHABLE();
-    }
+    char buffer[VALUE_FORMAT_MAX];
+    size_t length = value_format(value, buffer);
+    return lox_str_intern_young(&vm->gc, &vm->strings, buffer, length);
+}
 
-    size_t length = strlen(buffer);
-    uint32_t hash = str_hash(buffer, length);
+// Replaces the two values on top of the stack by their concatenation, at least one
+// of them must be a string. The number case is handled by the callers themselves.
+static bool vm_add_strings(LoxVM * vm) {
+    LoxValue b = vm_stack_peek(vm, 0);
+    LoxValue a = vm_stack_peek(vm, 1);
 
-    const LoxString * str;
-    if((str = map_find_str(&vm->strings, buffer, length, hash)) == NULL) {
-        str = lox_str_copy(buffer, length, hash);
-        map_set(&vm->strings, str, BOOL_VAL(true));
-        vm_register_object(vm, (LoxObject*) str);
+    if(!VAL_IS_STRING(a) && !VAL_IS_STRING(b)) {
+        vm_report_runtime_error(vm, "operator '+' expects either two integers or at least 1 string");
+        return false;
     }
-    return str;
+
+    // The operands are replaced by their string form while they are still on the
+    // stack: any allocation may trigger a collection, which can move young strings,
+    // so they are only read back from the stack after the last allocation.
+    vm_stack_set(vm, vm->stack.length - 1, OBJ_VAL(vm_stingify_value(vm, b)));
+    vm_stack_set(vm, vm->stack.length - 2, OBJ_VAL(vm_stingify_value(vm, vm_stack_peek(vm, 1))));
+    size_t length = VAL_AS_STRING(vm_stack_peek(vm, 0))->length + VAL_AS_STRING(vm_stack_peek(vm, 1))->length;
+
+    const LoxString * result;
+    { 
+        LoxString * str = lox_str_alloc(&vm->gc, length);
+        const LoxString * str2 = VAL_AS_STRING(vm_stack_peek(vm, 0));
+        const LoxString * str1 = VAL_AS_STRING(vm_stack_peek(vm, 1));
+
+        memcpy(str->chars, str1->chars, str1->length);
+        memcpy(str->chars + str1->length, str2->chars, str2->length);
+        str->hash = str_hash(str->chars, length);
+
+        // a duplicate is simply left behind for the collector
+        if((result = map_find_str(&vm->strings, str->chars, length, str->hash)) == NULL) {
+            map_set(&vm->strings, str, BOOL_VAL(true));
+            result = str;
+        }
+    }
+
+    vm_stack_pop(vm);
+    vm_stack_pop(vm);
+    vm_stack_push(vm, OBJ_VAL(result));
+    return true;
 }
 
 static bool is_falsely(LoxValue v) {
-    return v.type == VAL_NIL || (v.type == VAL_BOOL && !v.as.boolean);
+    return VAL_IS_NIL(v) || (VAL_IS_BOOL(v) && !VAL_AS_BOOL(v));
 }
 
-static LoxCallFrame * vm_frames_push(LoxVM * vm, LoxFunction * func, uint8_t args_nr) {
-    ASSERTF(vm->frames_count < MAX_STACK_FRAMES, "call frame overflow");
+// The profiler's signal handler may walk the frames at any point, so the new array is
+// filled before it's published and the old one only freed afterwards.
+__attribute__((noinline, cold)) static void vm_frames_grow(LoxVM * vm) {
+    size_t capacity       = vm->frames_capacity * 2;
+    LoxCallFrame * frames = mem_alloc(capacity * sizeof(LoxCallFrame));
+    memcpy(frames, vm->frames, vm->frames_count * sizeof(LoxCallFrame));
+
+    LoxCallFrame * old_frames = vm->frames;
+    atomic_signal_fence(memory_order_release);
+    vm->frames = frames;
+    atomic_signal_fence(memory_order_release);
+    vm->frames_capacity = capacity;
+    mem_dealloc(old_frames);
+}
+
+// the caller checks `max_frames`, see OP_CALL, and `locals` starts at the callee
+static LoxCallFrame * vm_frames_push(LoxVM * vm, LoxFunction * func, LoxValue * locals) {
+    if(vm->frames_count == vm->frames_capacity) vm_frames_grow(vm);
 
-    LoxCallFrame * frame = &vm->frames[vm->frames_count++];
+    LoxCallFrame * frame = &vm->frames[vm->frames_count];
     frame->func    = func;
-    frame->ip      = func->chunk.code.values;
-    frame->locals  = &vm->stack.values[vm->stack.length - (1 + args_nr)];
+    if(vm->config.backend == BACKEND_REGISTER)
+        frame->rip = func->reg->code;
+    else
+        frame->ip  = func->chunk.code.values;
+    frame->locals  = locals;
+
+    // the profiler's signal handler must never see a frame that isn't set up
+    atomic_signal_fence(memory_order_release);
+    vm->frames_count++;
     return frame;
 }
 
@@ -165,240 +315,1076 @@ static LoxCallFrame * vm_frames_pop(LoxVM * vm) {
     return vm->frames_count == 0 ? NULL : &vm->frames[vm->frames_count - 1];
 }
 
+#ifdef DEBUG_TRACE_EXECUTION
+static void vm_trace_execution(LoxVM * vm, LoxCallFrame * frame) {
+    fputs("          ", stdout);
+    if(vm->stack.length == 0)
+        puts("[ ]");
+    else {
+        for(size_t i = 0; i < vm->stack.length; i++) {
+            LoxValue curr = vm->stack.values[i];
+            bool is_str = VAL_IS_STRING(curr);
+            fputs(is_str ? "[ \"" : "[ ", stdout);
+            value_print(curr);
+            fputs(is_str ? "\" ]" : " ]", stdout);
+        }
+        putchar('\n');
+    }
+    chunk_instr_debug(&frame->func->chunk, (size_t) (frame->ip - frame->func->chunk.code.values));
+}
+#endif
+
+// `stats` is vm_run's copy of vm->stats, the check is all it costs when they are off.
+// The profiler's signal handler reads `frame->ip`, so while it (or the stats) is on
+// the cached ip is written back before every instruction.
+#define OBSERVE() do {                                          \
+        if(observed) {                                          \
+            frame->ip = ip;                                     \
+            if(stats != NULL) stats_record_op(stats, *ip);      \
+        }                                                       \
+    } while(0)
+
 // TODO:
 //  - [x] Make vm.stack be a static array c:
 //  - [x] About LoxChunk
 //      - [x] change its name to LoxChunk of something similar
-//      - [ ] change the code struct to be just an bytearray and have another struct called metadata with other things
+//      - [x] change the code struct to be just an bytearray and have another struct called metadata with other things
 //  - [x] Add 'utils.c' and take some things from utils.h and and put them into actual functions
 //  - [ ] Add support for anonymous functions and native functions
+//
+// The ip, the stack top and the constants of the running function live in locals (so
+// in registers) and the vm only sees them after a SYNC(): anything that may look at
+// the frames or the stack (errors, calls, allocations, natives) is preceded by one,
+// and followed by a RELOAD() when it may have changed them.
 static LoxInterpretResult vm_run(LoxVM * vm, LoxFunction * script){
-#define BINARY(op, value_constructor) do {                                                 \
-        if(!VAL_IS_NUMBER(vm_stack_peek(vm, 0)) || !VAL_IS_NUMBER(vm_stack_peek(vm, 1))) { \
-            vm_report_runtime_error(vm, "operands should both be numbers");                \
-            return INTERPRET_RUNTIME_ERROR;                                                \
-        }                                                                                  \
-        double b = vm_stack_pop(vm).as.number;                                             \
-        double a = vm_stack_pop(vm).as.number;                                             \
-        vm_stack_push(vm, value_constructor(a op b));                                      \
+#define PEEK(distance) (sp[-1 - (distance)])
+#define POP()          (*--sp)
+#define PUSH(value) do {                                     \
+        LoxValue __pushed__ = (value);                       \
+        if(sp == stack_end) {                                \
+            SYNC();                                          \
+            vm_stack_grow(vm);                               \
+            RELOAD_STACK();                                  \
+        }                                                    \
+        *sp++ = __pushed__;                                  \
     } while(0)
 
-#define READ_BYTE()   (*frame->ip++).op_code
-#define READ_SHORT()  (frame->ip += 2, (uint16_t) frame->ip[-1].op_code << 8 | frame->ip[-2].op_code)
-#define READ_STRING() VAL_AS_STRING(vm_get_constant(vm, READ_BYTE()))
+#define SYNC()  (frame->ip = ip, vm->stack.length = (size_t) (sp - vm->stack.values))
+#define RELOAD_STACK() do {                                  \
+        sp        = vm->stack.values + vm->stack.length;     \
+        stack_end = vm->stack.values + vm->stack.capacity;   \
+    } while(0)
+#define RELOAD_FRAME() do {                                  \
+        ip        = frame->ip;                               \
+        constants = frame->func->chunk.constants.values;     \
+        quicken   = !gc_is_frozen((LoxObject *) frame->func);\
+    } while(0)
 
-    ASSERT(vm->frames_count == 0);
-    vm_stack_push(vm, OBJ_VAL(script));
-    LoxCallFrame * frame = vm_frames_push(vm, script, 0);
-    for(;;){
+// Rewrites the instruction being run (they have no operands) into its quickened form.
+// Frozen (shared) code is read by other threads at the same time, so it's left as is.
+#define QUICKEN(op)  do { if(quicken) ip[-1] = (op); } while(0)
+
+// the guard of a quickened instruction failed, back to (and on to) the generic one
+#define DEOPT(op, generic) do { ip[-1] = (op); goto generic; } while(0)
+
+#define RUNTIME_ERROR(...) do {                              \
+        SYNC();                                              \
+        vm_report_runtime_error(vm, __VA_ARGS__);            \
+        return INTERPRET_RUNTIME_ERROR;                      \
+    } while(0)
+
+#define BINARY(op, value_constructor) do {                                   \
+        if(!VAL_IS_NUMBER(PEEK(0)) || !VAL_IS_NUMBER(PEEK(1)))               \
+            RUNTIME_ERROR("operands should both be numbers");                \
+        double b = VAL_AS_NUMBER(POP());                                     \
+        PEEK(0)  = value_constructor(VAL_AS_NUMBER(PEEK(0)) op b);           \
+    } while(0)
+
+#define NOT_BOOL_VAL(value) BOOL_VAL(!(value))
+
+#define READ_BYTE()   (*ip++)
+#define READ_SHORT()  (ip += 2, (uint16_t) ip[-1] << 8 | ip[-2])
+#define READ_LONG()   (ip += 3, (uint32_t) ip[-1] << 16 | (uint32_t) ip[-2] << 8 | ip[-3])
 
 #ifdef DEBUG_TRACE_EXECUTION
-        fputs("          ", stdout);
-        if(vm->stack.length == 0)
-            puts("[ ]");
-        else {
-            for(size_t i = 0; i < vm->stack.length; i++) {
-                LoxValue curr = vm->stack.values[i];
-                bool is_str = VAL_IS_STRING(curr);
-                fputs(is_str ? "[ \"" : "[ ", stdout);
-                value_print(curr);
-                fputs(is_str ? "\" ]" : " ]", stdout);
-            }
-            putchar('\n');
-        }
-        chunk_instr_debug(&frame->func->chunk, (size_t) (frame->ip - frame->func->chunk.code.values));
+#define TRACE_EXECUTION() do { SYNC(); vm_trace_execution(vm, frame); } while(0)
+#else
+#define TRACE_EXECUTION() ((void) 0)
+#endif
+
+// With labels-as-values every handler ends with its own indirect jump to the next
+// one (see VM_NEXT), which gives the branch predictor one site per opcode instead
+// of the single shared jump of the switch.
+#ifdef VM_THREADED_DISPATCH
+#define VM_SWITCH(instr) goto *dispatch_table[instr];
+#define VM_CASE(op)      do_##op
+#define VM_NEXT()        do { TRACE_EXECUTION(); OBSERVE(); goto *dispatch_table[READ_BYTE()]; } while(0)
+    static void * const dispatch_table[] = {
+        [OP_CONST]         = &&VM_CASE(OP_CONST),
+        [OP_CONST_LONG]    = &&VM_CASE(OP_CONST_LONG),
+        [OP_RETURN]        = &&VM_CASE(OP_RETURN),
+        [OP_POP]           = &&VM_CASE(OP_POP),
+        [OP_POPN]          = &&VM_CASE(OP_POPN),
+        [OP_NEG]           = &&VM_CASE(OP_NEG),
+        [OP_ADD]           = &&VM_CASE(OP_ADD),
+        [OP_SUB]           = &&VM_CASE(OP_SUB),
+        [OP_MULT]          = &&VM_CASE(OP_MULT),
+        [OP_DIV]           = &&VM_CASE(OP_DIV),
+        [OP_EQ]            = &&VM_CASE(OP_EQ),
+        [OP_LESS]          = &&VM_CASE(OP_LESS),
+        [OP_GREATER]       = &&VM_CASE(OP_GREATER),
+        [OP_NOT_EQ]        = &&VM_CASE(OP_NOT_EQ),
+        [OP_LESS_EQ]       = &&VM_CASE(OP_LESS_EQ),
+        [OP_GREATER_EQ]    = &&VM_CASE(OP_GREATER_EQ),
+        [OP_NOT]           = &&VM_CASE(OP_NOT),
+        [OP_NIL]           = &&VM_CASE(OP_NIL),
+        [OP_TRUE]          = &&VM_CASE(OP_TRUE),
+        [OP_FALSE]         = &&VM_CASE(OP_FALSE),
+        [OP_PRINT]         = &&VM_CASE(OP_PRINT),
+        [OP_DEFINE_GLOBAL_SLOT] = &&VM_CASE(OP_DEFINE_GLOBAL_SLOT),
+        [OP_SET_GLOBAL_SLOT] = &&VM_CASE(OP_SET_GLOBAL_SLOT),
+        [OP_GET_GLOBAL_SLOT] = &&VM_CASE(OP_GET_GLOBAL_SLOT),
+        [OP_DEFINE_GLOBAL_SLOT_LONG] = &&VM_CASE(OP_DEFINE_GLOBAL_SLOT_LONG),
+        [OP_SET_GLOBAL_SLOT_LONG] = &&VM_CASE(OP_SET_GLOBAL_SLOT_LONG),
+        [OP_GET_GLOBAL_SLOT_LONG] = &&VM_CASE(OP_GET_GLOBAL_SLOT_LONG),
+        [OP_SET_LOCAL]     = &&VM_CASE(OP_SET_LOCAL),
+        [OP_GET_LOCAL]     = &&VM_CASE(OP_GET_LOCAL),
+        [OP_INC_LOCAL]     = &&VM_CASE(OP_INC_LOCAL),
+        [OP_SET_GLOBAL_SLOT_POP]      = &&VM_CASE(OP_SET_GLOBAL_SLOT_POP),
+        [OP_SET_GLOBAL_SLOT_LONG_POP] = &&VM_CASE(OP_SET_GLOBAL_SLOT_LONG_POP),
+        [OP_SET_LOCAL_POP] = &&VM_CASE(OP_SET_LOCAL_POP),
+        [OP_INC_LOCAL_POP] = &&VM_CASE(OP_INC_LOCAL_POP),
+        [OP_IF_FALSE]      = &&VM_CASE(OP_IF_FALSE),
+        [OP_JUMP_IF_FALSE_POP]     = &&VM_CASE(OP_JUMP_IF_FALSE_POP),
+        [OP_LESS_LOCAL_CONST_JUMP] = &&VM_CASE(OP_LESS_LOCAL_CONST_JUMP),
+        [OP_JUMP]          = &&VM_CASE(OP_JUMP),
+        [OP_LOOP]          = &&VM_CASE(OP_LOOP),
+        [OP_CALL]          = &&VM_CASE(OP_CALL),
+        [OP_ADD_NUM]       = &&VM_CASE(OP_ADD_NUM),
+        [OP_ADD_STR]       = &&VM_CASE(OP_ADD_STR),
+    };
+    _Static_assert(sizeof(dispatch_table) / sizeof(dispatch_table[0]) == OP_CODES_COUNT, "dispatch table out of sync with OpCode");
+#else
+#define VM_SWITCH(instr) switch(instr)
+#define VM_CASE(op)      case op
+#define VM_NEXT()        break
 #endif
 
+    ASSERT(vm->frames_count == 0);
+    LoxStats * const stats = vm->stats;
+    const bool observed    = stats != NULL || vm->profiler != NULL;
+    if(stats != NULL) stats_record_call(stats, script);
+    vm_stack_push(vm, OBJ_VAL(script));
+    LoxCallFrame * frame = vm_frames_push(vm, script, &vm->stack.values[vm->stack.length - 1]);
+
+    uint8_t * ip;
+    const LoxValue * constants;
+    bool quicken;
+    LoxValue * sp;
+    LoxValue * stack_end;
+    RELOAD_FRAME();
+    RELOAD_STACK();
+
+    size_t slot; // operand of the global variable instructions, the long ones jump to the short ones with it
+    bool discard; // whether the store instructions pop the value they store
+    for(;;){
+
+        TRACE_EXECUTION();
+        OBSERVE();
         OpCode instr = READ_BYTE();
-        switch (instr) {
-            case OP_POP   : vm_stack_pop(vm); break;
-            case OP_CONST : {
-                uint8_t data_idx = READ_BYTE();
-                LoxValue data = vm_get_constant(vm, data_idx);
-                vm_stack_push(vm, data);
-            } break;
-
-            case OP_NOT : 
-                if(!VAL_IS_BOOL(vm_stack_peek(vm, 0))) {
-                    vm_report_runtime_error(vm, "expected a boolean operand");
-                    return INTERPRET_RUNTIME_ERROR;
+        VM_SWITCH(instr) {
+            VM_CASE(OP_POP)   : sp--; VM_NEXT();
+            VM_CASE(OP_POPN)  : sp -= READ_BYTE(); VM_NEXT();
+            VM_CASE(OP_CONST) : PUSH(constants[READ_BYTE()]); VM_NEXT();
+            VM_CASE(OP_CONST_LONG) : PUSH(constants[READ_LONG()]); VM_NEXT();
+
+            VM_CASE(OP_NOT) : 
+                if(!VAL_IS_BOOL(PEEK(0)))
+                    RUNTIME_ERROR("expected a boolean operand");
+                PEEK(0) = BOOL_VAL(!VAL_AS_BOOL(PEEK(0)));
+                VM_NEXT();
+
+            VM_CASE(OP_NEG) : 
+                if(!VAL_IS_NUMBER(PEEK(0)))
+                    RUNTIME_ERROR("expected a number operand");
+                PEEK(0) = NUMBER_VAL(-VAL_AS_NUMBER(PEEK(0)));
+                VM_NEXT();
+
+            VM_CASE(OP_ADD) : generic_add:
+                if(VAL_IS_NUMBER(PEEK(0)) && VAL_IS_NUMBER(PEEK(1))) {
+                    QUICKEN(OP_ADD_NUM);
+                    double b = VAL_AS_NUMBER(POP());
+                    PEEK(0)  = NUMBER_VAL(VAL_AS_NUMBER(PEEK(0)) + b);
+                } else {
+                    if(VAL_IS_STRING(PEEK(0)) && VAL_IS_STRING(PEEK(1))) QUICKEN(OP_ADD_STR);
+                    SYNC();
+                    if(!vm_add_strings(vm)) return INTERPRET_RUNTIME_ERROR;
+                    RELOAD_STACK();
                 }
-                vm_stack_push(vm, BOOL_VAL(!vm_stack_pop(vm).as.boolean)); 
-                break;
-
-            case OP_NEG : 
-                if(!VAL_IS_NUMBER(vm_stack_peek(vm, 0))) {
-                    vm_report_runtime_error(vm, "expected a number operand");
-                    return INTERPRET_RUNTIME_ERROR;
+                VM_NEXT();
+
+            VM_CASE(OP_SUB) : BINARY(-, NUMBER_VAL); VM_NEXT();
+            VM_CASE(OP_MULT): BINARY(*, NUMBER_VAL); VM_NEXT();
+            VM_CASE(OP_DIV) : BINARY(/, NUMBER_VAL); VM_NEXT();
+
+            VM_CASE(OP_LESS)    : BINARY(<, BOOL_VAL); VM_NEXT();
+            VM_CASE(OP_GREATER) : BINARY(>, BOOL_VAL); VM_NEXT();
+            VM_CASE(OP_EQ)      : {
+                LoxValue b = POP();
+                PEEK(0) = BOOL_VAL(value_eq(PEEK(0), b));
+            } VM_NEXT();
+
+            // same results as the OP_LESS/OP_GREATER + OP_NOT pairs they replace (NaN included)
+            VM_CASE(OP_LESS_EQ)    : BINARY(>, NOT_BOOL_VAL); VM_NEXT();
+            VM_CASE(OP_GREATER_EQ) : BINARY(<, NOT_BOOL_VAL); VM_NEXT();
+            VM_CASE(OP_NOT_EQ)     : {
+                LoxValue b = POP();
+                PEEK(0) = BOOL_VAL(!value_eq(PEEK(0), b));
+            } VM_NEXT();
+
+            // the quickened forms of OP_ADD check the one operand type they were made for,
+            // a failed guard goes back to the generic instruction
+            VM_CASE(OP_ADD_NUM) :
+                if(!VAL_IS_NUMBER(PEEK(0)) || !VAL_IS_NUMBER(PEEK(1)))
+                    DEOPT(OP_ADD, generic_add);
+                {
+                    double b = VAL_AS_NUMBER(POP());
+                    PEEK(0)  = NUMBER_VAL(VAL_AS_NUMBER(PEEK(0)) + b);
                 }
-                vm_stack_push(vm, NUMBER_VAL(-vm_stack_pop(vm).as.number)); 
-                break;
-
-            case OP_ADD : {
-                LoxValue b = vm_stack_peek(vm, 0);
-                LoxValue a = vm_stack_peek(vm, 1);
-
-                if(VAL_IS_STRING(a) || VAL_IS_STRING(b)) {
-                    const LoxString * str2 = vm_stingify_value(vm, vm_stack_pop(vm));
-                    const LoxString * str1 = vm_stingify_value(vm,vm_stack_pop(vm));
-
-                    const LoxString * result;
-                    { 
-                        size_t length = strlen(str1->chars) + strlen(str2->chars);
-                        char * buffer = mem_alloc(length + 1);
-
-                        buffer[0] = 0;
-                        strcat(buffer, str1->chars);
-                        strcat(buffer + str1->length, str2->chars);
-
-                        uint32_t hash = str_hash(buffer, length);
-                        if((result = map_find_str(&vm->strings, buffer, length, hash)) == NULL) {
-                            result = lox_str_take(buffer, length, hash);
-                            vm_register_object(vm, (LoxObject*) result);
-                        } else {
-                            mem_dealloc(buffer);
-                        }
-                    }
-
-                    vm_stack_push(vm, OBJ_VAL(result));
-                } else if(VAL_IS_NUMBER(a) && VAL_IS_NUMBER(b)) {
-                    vm_stack_push(vm, NUMBER_VAL( vm_stack_pop(vm).as.number + vm_stack_pop(vm).as.number));
+                VM_NEXT();
+
+            VM_CASE(OP_ADD_STR) :
+                if(!VAL_IS_STRING(PEEK(0)) || !VAL_IS_STRING(PEEK(1)))
+                    DEOPT(OP_ADD, generic_add);
+                SYNC();
+                vm_add_strings(vm);
+                RELOAD_STACK();
+                VM_NEXT();
+
+            VM_CASE(OP_TRUE)  : PUSH(BOOL_VAL(true)); VM_NEXT();
+            VM_CASE(OP_FALSE) : PUSH(BOOL_VAL(false)); VM_NEXT();
+            VM_CASE(OP_NIL)   : PUSH(NIL_VAL); VM_NEXT();
+
+            VM_CASE(OP_PRINT) : 
+                value_fprint(vm->out, POP()); 
+                fputc('\n', vm->out);
+                VM_NEXT();
+
+            VM_CASE(OP_DEFINE_GLOBAL_SLOT_LONG) : slot = READ_LONG(); goto define_global;
+            VM_CASE(OP_DEFINE_GLOBAL_SLOT) : slot = READ_BYTE();
+            define_global: {
+                vm_global_write_barrier(vm, slot, PEEK(0));
+                vm->globals.values.values[slot] = POP();
+            } VM_NEXT();
+
+            VM_CASE(OP_SET_GLOBAL_SLOT_LONG_POP) : slot = READ_LONG(); discard = true; goto set_global;
+            VM_CASE(OP_SET_GLOBAL_SLOT_POP) : slot = READ_BYTE(); discard = true; goto set_global;
+            VM_CASE(OP_SET_GLOBAL_SLOT_LONG) : slot = READ_LONG(); discard = false; goto set_global;
+            VM_CASE(OP_SET_GLOBAL_SLOT) : slot = READ_BYTE(); discard = false;
+            set_global: {
+                LoxValue * value = &vm->globals.values.values[slot];
+                if(VAL_IS_UNDEFINED(*value))
+                    RUNTIME_ERROR("assigment variable '%s' not defined", vm->globals.names.values[slot]->chars);
+                vm_global_write_barrier(vm, slot, PEEK(0));
+                *value = PEEK(0);
+                if(discard) sp--;
+            } VM_NEXT();
+
+            VM_CASE(OP_GET_GLOBAL_SLOT_LONG) : slot = READ_LONG(); goto get_global;
+            VM_CASE(OP_GET_GLOBAL_SLOT) : slot = READ_BYTE();
+            get_global: {
+                LoxValue value = vm->globals.values.values[slot];
+                if(VAL_IS_UNDEFINED(value))
+                    RUNTIME_ERROR("undefined identifier '%s'", vm->globals.names.values[slot]->chars);
+                PUSH(value);
+            } VM_NEXT();
+
+            VM_CASE(OP_GET_LOCAL): PUSH(frame->locals[READ_BYTE()]); VM_NEXT();
+            VM_CASE(OP_SET_LOCAL): frame->locals[READ_BYTE()] = PEEK(0); VM_NEXT();
+            VM_CASE(OP_SET_LOCAL_POP): frame->locals[READ_BYTE()] = POP(); VM_NEXT();
+
+            VM_CASE(OP_INC_LOCAL_POP): {
+                uint8_t slot    = READ_BYTE();
+                LoxValue amount = constants[READ_BYTE()];
+                LoxValue * local = &frame->locals[slot];
+
+                if(VAL_IS_NUMBER(*local) && VAL_IS_NUMBER(amount)) {
+                    *local = NUMBER_VAL(VAL_AS_NUMBER(*local) + VAL_AS_NUMBER(amount));
                 } else {
-                    vm_report_runtime_error(vm, "operator '+' expects either two integers or at least 1 string");
-                    return INTERPRET_RUNTIME_ERROR;
+                    PUSH(*local);
+                    PUSH(amount);
+                    SYNC();
+                    if(!vm_add_strings(vm)) return INTERPRET_RUNTIME_ERROR;
+                    RELOAD_STACK();
+                    frame->locals[slot] = POP();
                 }
-            } break;
-
-            case OP_SUB : BINARY(-, NUMBER_VAL); break;
-            case OP_MULT: BINARY(*, NUMBER_VAL); break;
-            case OP_DIV : BINARY(/, NUMBER_VAL); break;
-
-            case OP_LESS    : BINARY(<, BOOL_VAL); break;
-            case OP_GREATER : BINARY(>, BOOL_VAL); break;
-            case OP_EQ      : 
-                vm_stack_push(vm, BOOL_VAL(value_eq(vm_stack_pop(vm), vm_stack_pop(vm))));
-                break;
-
-            case OP_TRUE  : vm_stack_push(vm, BOOL_VAL(true)); break;
-            case OP_FALSE : vm_stack_push(vm, BOOL_VAL(false)); break;
-            case OP_NIL   : vm_stack_push(vm, NIL_VAL); break;
+            } VM_NEXT();
 
-            case OP_PRINT : 
-                value_print(vm_stack_pop(vm)); 
-                putchar('\n');
-                break;
+            VM_CASE(OP_INC_LOCAL): {
+                uint8_t slot    = READ_BYTE();
+                LoxValue amount = constants[READ_BYTE()];
+                LoxValue * local = &frame->locals[slot];
 
-            case OP_DEFINE_GLOBAL : {
-                LoxString * name = READ_STRING();
-                map_set(&vm->globals, name, vm_stack_peek(vm, 0));
-                vm_stack_pop(vm);
-            } break;
-
-            case OP_SET_GLOBAL : {
-                LoxString * name = READ_STRING();
-                LoxValue * value = map_get_mut(&vm->globals, name);
-                if(value == NULL) {
-                    vm_report_runtime_error(vm, "assigment variable '%s' not defined", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                *value = vm_stack_peek(vm, 0);
-            } break;
-
-            case OP_GET_GLOBAL : {
-                LoxString * name       = READ_STRING();
-                const LoxValue * value = map_get(&vm->globals, name);
-                if(value == NULL) {
-                    vm_report_runtime_error(vm, "undefined identifier '%s'", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
+                if(VAL_IS_NUMBER(*local) && VAL_IS_NUMBER(amount)) {
+                    *local = NUMBER_VAL(VAL_AS_NUMBER(*local) + VAL_AS_NUMBER(amount));
+                    PUSH(*local);
+                } else {
+                    PUSH(*local);
+                    PUSH(amount);
+                    SYNC();
+                    if(!vm_add_strings(vm)) return INTERPRET_RUNTIME_ERROR;
+                    RELOAD_STACK();
+                    frame->locals[slot] = PEEK(0);
                 }
-                vm_stack_push(vm, *value);
-            } break;
+            } VM_NEXT();
 
-            case OP_GET_LOCAL: vm_stack_push(vm, frame->locals[READ_BYTE()]);        break;
-            case OP_SET_LOCAL: frame->locals[READ_BYTE()] = vm_stack_peek(vm, 0); break;
+            VM_CASE(OP_IF_FALSE) : {
+                uint16_t offset = READ_SHORT();
+                if(is_falsely(PEEK(0))) 
+                    ip += offset;
+            } VM_NEXT();
+
+            VM_CASE(OP_JUMP_IF_FALSE_POP) : {
+                uint16_t offset = READ_SHORT();
+                if(is_falsely(POP())) 
+                    ip += offset;
+            } VM_NEXT();
 
-            case OP_IF_FALSE : {
+            VM_CASE(OP_LESS_LOCAL_CONST_JUMP) : {
+                LoxValue a = frame->locals[READ_BYTE()];
+                LoxValue b = constants[READ_BYTE()];
                 uint16_t offset = READ_SHORT();
-                if(is_falsely(vm_stack_peek(vm, 0))) 
-                    frame->ip += offset;
-            } break;
 
-            case OP_JUMP : {
+                if(!VAL_IS_NUMBER(a) || !VAL_IS_NUMBER(b))
+                    RUNTIME_ERROR("operands should both be numbers");
+                if(!(VAL_AS_NUMBER(a) < VAL_AS_NUMBER(b)))
+                    ip += offset;
+            } VM_NEXT();
+
+            VM_CASE(OP_JUMP) : {
                 uint16_t offset = READ_SHORT();
-                frame->ip += offset;
-            } break;
+                ip += offset;
+            } VM_NEXT();
 
-            case OP_LOOP : {
+            VM_CASE(OP_LOOP) : {
                 uint16_t offset = READ_SHORT();
-                frame->ip -= offset;
-            } break;
+                ip -= offset;
+            } VM_NEXT();
 
-            case OP_CALL : {
+            // Lox functions come first and cost a type test, an arity compare and the
+            // frame push, the error messages are only worked out when they're needed
+            VM_CASE(OP_CALL) : {
                 uint8_t args_nr = READ_BYTE();
-                LoxValue value  = vm_stack_peek(vm, args_nr);
+                LoxValue value  = PEEK(args_nr);
+                SYNC();
 
-                LoxCallable callable;
-                if(!lox_make_callable(&callable, value)) {
-                    vm_report_runtime_error(vm, "can only call functions");
-                    return INTERPRET_RUNTIME_ERROR;
+                if(VAL_IS_FUNC(value)) {
+                    LoxFunction * func = VAL_AS_FUNC(value);
+                    if(func->arity != args_nr) {
+                        vm_report_arity_error(vm, value, args_nr);
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    if(vm->frames_count == vm->max_frames)
+                        RUNTIME_ERROR("stack overflow (more than %zu nested calls)", vm->max_frames);
+
+                    if(stats != NULL) stats_record_call(stats, func);
+                    frame = vm_frames_push(vm, func, sp - (1 + args_nr));
+                    RELOAD_FRAME();
+                    VM_NEXT();
                 }
 
-                if(callable.arity != args_nr) {
-                    vm_report_runtime_error(
-                        vm, "function '%s' expects %u arguments but %u was provided", 
-                        callable.name, (unsigned) callable.arity, (unsigned) args_nr
-                    );
+                if(!VAL_IS_NATIVE_FN(value))
+                    RUNTIME_ERROR("can only call functions");
+
+                LoxNativeFn * native = VAL_AS_NATIVE_FN(value);
+                if(native->arity != args_nr) {
+                    vm_report_arity_error(vm, value, args_nr);
                     return INTERPRET_RUNTIME_ERROR;
                 }
+                if(stats != NULL) stats->native_calls++;
+
+                // the result replaces the native and its arguments
+                size_t callee = vm->stack.length - (1 + args_nr);
+                native->executor(vm);
+#ifndef NDEBUG
+                if(callee + args_nr + 2 != vm->stack.length)
+                    RUNTIME_ERROR("native function call left stack in bad state");
+#endif
+                vm->stack.values[callee] = vm->stack.values[vm->stack.length - 1];
+                vm->stack.length = callee + 1;
+                RELOAD_STACK();
+            } VM_NEXT();
+
+            VM_CASE(OP_RETURN): {
+                LoxValue * locals = frame->locals;
+                frame = vm_frames_pop(vm);
+                if(frame == NULL) {
+                    ASSERT(sp == vm->stack.values);
+                    vm->stack.length = 0;
+                    return INTERPRET_OK;
+                }
+
+                // the result replaces the callee and its locals, so there's room for it
+                locals[0] = PEEK(0);
+                sp = locals + 1;
+                RELOAD_FRAME();
+            } VM_NEXT();
+#ifndef VM_THREADED_DISPATCH
+            default:
+                UNREACHABLE();
+#endif
+        }
+    }
 
-                if(VAL_IS_FUNC(value))
-                    frame = vm_frames_push(vm, VAL_AS_FUNC(value), args_nr);
-                else {
-                    size_t stack_top = vm->stack.length;
-                    VAL_AS_NATIVE_FN(value)->executor(vm);
+#undef PEEK
+#undef POP
+#undef PUSH
+#undef SYNC
+#undef RELOAD_STACK
+#undef RELOAD_FRAME
+#undef RUNTIME_ERROR
+#undef QUICKEN
+#undef DEOPT
+#undef BINARY
+#undef NOT_BOOL_VAL
+#undef READ_BYTE
+#undef READ_SHORT
+#undef READ_LONG
+#undef TRACE_EXECUTION
+#undef OBSERVE
+#undef VM_SWITCH
+#undef VM_CASE
+#undef VM_NEXT
+}
+
+static inline LoxValue rk_value(uint16_t operand, const LoxValue * regs, const LoxValue * constants) {
+    return operand & RK_CONST ? constants[operand & RK_MAX_CONST] : regs[operand];
+}
+
+// The registers of a frame are its window of the stack (see regcode.h), starting at
+// its callee. The stack length is kept at the top of the running window, or of its
+// caller's when that one is higher, and the collector scans up to it: a call clears
+// the registers it adds past the length and a return cuts it back to the caller's.
+static LoxCallFrame * vm_register_frames_push(LoxVM * vm, LoxFunction * func, size_t callee) {
+    size_t top = callee + func->reg->frame_size;
+    while(top > vm->stack.capacity) vm_stack_grow(vm);
+    for(size_t i = vm->stack.length; i < top; i++)
+        vm->stack.values[i] = NIL_VAL;
+    if(top > vm->stack.length) vm->stack.length = top;
+
+    return vm_frames_push(vm, func, &vm->stack.values[callee]);
+}
 
-                    if(stack_top + 1 != vm->stack.length) {
-                        vm_report_runtime_error(vm, "native function call left stack in bad state");
+#ifdef DEBUG_TRACE_EXECUTION
+static void vm_trace_register(LoxVM * vm, LoxCallFrame * frame) {
+    (void) vm;
+    fputs("          ", stdout);
+    for(size_t i = 0; i < frame->func->reg->frame_size; i++) {
+        LoxValue curr = frame->locals[i];
+        bool is_str = VAL_IS_STRING(curr);
+        fputs(is_str ? "[ \"" : "[ ", stdout);
+        value_print(curr);
+        fputs(is_str ? "\" ]" : " ]", stdout);
+    }
+    putchar('\n');
+    regcode_instr_debug(frame->func, (size_t) (frame->rip - frame->func->reg->code));
+}
+#endif
+
+// The register backend (--backend=register), with the same error messages as vm_run.
+// The ip, the registers and the constants of the running function live in locals, the
+// registers have to be reloaded after anything that may grow the stack (calls, natives
+// and the string concatenation, which pushes its operands).
+static LoxInterpretResult vm_run_register(LoxVM * vm, LoxFunction * script){
+#define SYNC() (frame->rip = ip)
+#define RELOAD_FRAME() do {                                  \
+        ip        = frame->rip;                              \
+        code      = frame->func->reg->code;                  \
+        regs      = frame->locals;                           \
+        constants = frame->func->chunk.constants.values;     \
+    } while(0)
+
+#define RUNTIME_ERROR(...) do {                              \
+        SYNC();                                              \
+        vm_report_runtime_error(vm, __VA_ARGS__);            \
+        return INTERPRET_RUNTIME_ERROR;                      \
+    } while(0)
+
+#define READ()       (*ip++)
+#define READ_LONG()  (ip += 2, (uint32_t) ip[-1] << 16 | ip[-2])
+#define READ_RK()    rk_value(READ(), regs, constants)
+
+#define BINARY(op, value_constructor) do {                                   \
+        uint16_t dst = READ();                                               \
+        LoxValue a   = READ_RK();                                            \
+        LoxValue b   = READ_RK();                                            \
+        if(!VAL_IS_NUMBER(a) || !VAL_IS_NUMBER(b))                           \
+            RUNTIME_ERROR("operands should both be numbers");                \
+        regs[dst] = value_constructor(VAL_AS_NUMBER(a) op VAL_AS_NUMBER(b)); \
+    } while(0)
+
+#define NOT_BOOL_VAL(value) BOOL_VAL(!(value))
+
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_EXECUTION() do { SYNC(); vm_trace_register(vm, frame); } while(0)
+#else
+#define TRACE_EXECUTION() ((void) 0)
+#endif
+
+// the profiler's signal handler reads `frame->rip`
+#define OBSERVE() do { if(observed) SYNC(); } while(0)
+
+#ifdef VM_THREADED_DISPATCH
+#define VM_SWITCH(instr) goto *dispatch_table[instr];
+#define VM_CASE(op)      do_##op
+#define VM_NEXT()        do { TRACE_EXECUTION(); OBSERVE(); goto *dispatch_table[READ()]; } while(0)
+    static void * const dispatch_table[] = {
+        [ROP_MOVE]          = &&VM_CASE(ROP_MOVE),
+        [ROP_LOADK]         = &&VM_CASE(ROP_LOADK),
+        [ROP_NIL]           = &&VM_CASE(ROP_NIL),
+        [ROP_TRUE]          = &&VM_CASE(ROP_TRUE),
+        [ROP_FALSE]         = &&VM_CASE(ROP_FALSE),
+        [ROP_GET_GLOBAL]    = &&VM_CASE(ROP_GET_GLOBAL),
+        [ROP_SET_GLOBAL]    = &&VM_CASE(ROP_SET_GLOBAL),
+        [ROP_DEFINE_GLOBAL] = &&VM_CASE(ROP_DEFINE_GLOBAL),
+        [ROP_NEG]           = &&VM_CASE(ROP_NEG),
+        [ROP_NOT]           = &&VM_CASE(ROP_NOT),
+        [ROP_ADD]           = &&VM_CASE(ROP_ADD),
+        [ROP_SUB]           = &&VM_CASE(ROP_SUB),
+        [ROP_MULT]          = &&VM_CASE(ROP_MULT),
+        [ROP_DIV]           = &&VM_CASE(ROP_DIV),
+        [ROP_EQ]            = &&VM_CASE(ROP_EQ),
+        [ROP_NOT_EQ]        = &&VM_CASE(ROP_NOT_EQ),
+        [ROP_LESS]          = &&VM_CASE(ROP_LESS),
+        [ROP_GREATER]       = &&VM_CASE(ROP_GREATER),
+        [ROP_LESS_EQ]       = &&VM_CASE(ROP_LESS_EQ),
+        [ROP_GREATER_EQ]    = &&VM_CASE(ROP_GREATER_EQ),
+        [ROP_PRINT]         = &&VM_CASE(ROP_PRINT),
+        [ROP_JUMP]          = &&VM_CASE(ROP_JUMP),
+        [ROP_JUMP_IF_FALSE] = &&VM_CASE(ROP_JUMP_IF_FALSE),
+        [ROP_JUMP_UNLESS_LESS] = &&VM_CASE(ROP_JUMP_UNLESS_LESS),
+        [ROP_CALL]          = &&VM_CASE(ROP_CALL),
+        [ROP_RETURN]        = &&VM_CASE(ROP_RETURN),
+    };
+    _Static_assert(sizeof(dispatch_table) / sizeof(dispatch_table[0]) == ROP_CODES_COUNT, "dispatch table out of sync with RegOpCode");
+#else
+#define VM_SWITCH(instr) switch(instr)
+#define VM_CASE(op)      case op
+#define VM_NEXT()        break
+#endif
+
+    ASSERT(vm->frames_count == 0 && vm->stack.length == 0);
+    LoxStats * const stats = vm->stats;
+    const bool observed    = vm->profiler != NULL;
+    if(stats != NULL) stats_record_call(stats, script);
+    vm_stack_push(vm, OBJ_VAL(script));
+    LoxCallFrame * frame = vm_register_frames_push(vm, script, 0);
+
+    const uint16_t * ip;
+    const uint16_t * code;
+    LoxValue * regs;
+    const LoxValue * constants;
+    RELOAD_FRAME();
+
+    for(;;){
+
+        TRACE_EXECUTION();
+        OBSERVE();
+        uint16_t instr = READ();
+        VM_SWITCH(instr) {
+            VM_CASE(ROP_MOVE) : {
+                uint16_t dst = READ();
+                regs[dst] = regs[READ()];
+            } VM_NEXT();
+
+            VM_CASE(ROP_LOADK) : {
+                uint16_t dst = READ();
+                regs[dst] = constants[READ_LONG()];
+            } VM_NEXT();
+
+            VM_CASE(ROP_NIL)   : regs[READ()] = NIL_VAL; VM_NEXT();
+            VM_CASE(ROP_TRUE)  : regs[READ()] = BOOL_VAL(true); VM_NEXT();
+            VM_CASE(ROP_FALSE) : regs[READ()] = BOOL_VAL(false); VM_NEXT();
+
+            VM_CASE(ROP_GET_GLOBAL) : {
+                uint16_t dst   = READ();
+                size_t slot    = READ_LONG();
+                LoxValue value = vm->globals.values.values[slot];
+                if(VAL_IS_UNDEFINED(value))
+                    RUNTIME_ERROR("undefined identifier '%s'", vm->globals.names.values[slot]->chars);
+                regs[dst] = value;
+            } VM_NEXT();
+
+            VM_CASE(ROP_SET_GLOBAL) : {
+                size_t slot     = READ_LONG();
+                LoxValue value  = READ_RK();
+                LoxValue * global = &vm->globals.values.values[slot];
+                if(VAL_IS_UNDEFINED(*global))
+                    RUNTIME_ERROR("assigment variable '%s' not defined", vm->globals.names.values[slot]->chars);
+                vm_global_write_barrier(vm, slot, value);
+                *global = value;
+            } VM_NEXT();
+
+            VM_CASE(ROP_DEFINE_GLOBAL) : {
+                size_t slot    = READ_LONG();
+                LoxValue value = READ_RK();
+                vm_global_write_barrier(vm, slot, value);
+                vm->globals.values.values[slot] = value;
+            } VM_NEXT();
+
+            VM_CASE(ROP_NEG) : {
+                uint16_t dst   = READ();
+                LoxValue value = READ_RK();
+                if(!VAL_IS_NUMBER(value))
+                    RUNTIME_ERROR("expected a number operand");
+                regs[dst] = NUMBER_VAL(-VAL_AS_NUMBER(value));
+            } VM_NEXT();
+
+            VM_CASE(ROP_NOT) : {
+                uint16_t dst   = READ();
+                LoxValue value = READ_RK();
+                if(!VAL_IS_BOOL(value))
+                    RUNTIME_ERROR("expected a boolean operand");
+                regs[dst] = BOOL_VAL(!VAL_AS_BOOL(value));
+            } VM_NEXT();
+
+            // the strings are concatenated on top of the stack, above every window
+            VM_CASE(ROP_ADD) : {
+                uint16_t dst = READ();
+                LoxValue a   = READ_RK();
+                LoxValue b   = READ_RK();
+                if(VAL_IS_NUMBER(a) && VAL_IS_NUMBER(b)) {
+                    regs[dst] = NUMBER_VAL(VAL_AS_NUMBER(a) + VAL_AS_NUMBER(b));
+                } else {
+                    SYNC();
+                    vm_stack_push(vm, a);
+                    vm_stack_push(vm, b);
+                    if(!vm_add_strings(vm)) return INTERPRET_RUNTIME_ERROR;
+                    regs = frame->locals;
+                    regs[dst] = vm_stack_pop(vm);
+                }
+            } VM_NEXT();
+
+            VM_CASE(ROP_SUB)  : BINARY(-, NUMBER_VAL); VM_NEXT();
+            VM_CASE(ROP_MULT) : BINARY(*, NUMBER_VAL); VM_NEXT();
+            VM_CASE(ROP_DIV)  : BINARY(/, NUMBER_VAL); VM_NEXT();
+
+            VM_CASE(ROP_LESS)       : BINARY(<, BOOL_VAL); VM_NEXT();
+            VM_CASE(ROP_GREATER)    : BINARY(>, BOOL_VAL); VM_NEXT();
+            VM_CASE(ROP_LESS_EQ)    : BINARY(>, NOT_BOOL_VAL); VM_NEXT();
+            VM_CASE(ROP_GREATER_EQ) : BINARY(<, NOT_BOOL_VAL); VM_NEXT();
+
+            VM_CASE(ROP_EQ) : {
+                uint16_t dst = READ();
+                LoxValue a   = READ_RK();
+                LoxValue b   = READ_RK();
+                regs[dst] = BOOL_VAL(value_eq(a, b));
+            } VM_NEXT();
+
+            VM_CASE(ROP_NOT_EQ) : {
+                uint16_t dst = READ();
+                LoxValue a   = READ_RK();
+                LoxValue b   = READ_RK();
+                regs[dst] = BOOL_VAL(!value_eq(a, b));
+            } VM_NEXT();
+
+            VM_CASE(ROP_PRINT) :
+                value_fprint(vm->out, READ_RK());
+                fputc('\n', vm->out);
+                VM_NEXT();
+
+            VM_CASE(ROP_JUMP) : {
+                uint32_t target = READ_LONG();
+                ip = code + target;
+            } VM_NEXT();
+
+            VM_CASE(ROP_JUMP_IF_FALSE) : {
+                LoxValue value  = READ_RK();
+                uint32_t target = READ_LONG();
+                if(is_falsely(value))
+                    ip = code + target;
+            } VM_NEXT();
+
+            VM_CASE(ROP_JUMP_UNLESS_LESS) : {
+                LoxValue a      = READ_RK();
+                LoxValue b      = READ_RK();
+                uint32_t target = READ_LONG();
+                if(!VAL_IS_NUMBER(a) || !VAL_IS_NUMBER(b))
+                    RUNTIME_ERROR("operands should both be numbers");
+                if(!(VAL_AS_NUMBER(a) < VAL_AS_NUMBER(b)))
+                    ip = code + target;
+            } VM_NEXT();
+
+            VM_CASE(ROP_CALL) : {
+                uint16_t callee = READ();
+                uint8_t args_nr = READ();
+                LoxValue value  = regs[callee];
+                size_t window   = (size_t) (regs - vm->stack.values) + callee;
+                SYNC();
+
+                if(VAL_IS_FUNC(value)) {
+                    LoxFunction * func = VAL_AS_FUNC(value);
+                    if(func->arity != args_nr) {
+                        vm_report_arity_error(vm, value, args_nr);
                         return INTERPRET_RUNTIME_ERROR;
                     }
+                    if(vm->frames_count == vm->max_frames)
+                        RUNTIME_ERROR("stack overflow (more than %zu nested calls)", vm->max_frames);
 
-                    LoxValue return_value = vm_stack_pop(vm);
-                    vm_stack_pop(vm);
-                    vm_stack_push(vm, return_value);
+                    if(stats != NULL) stats_record_call(stats, func);
+                    frame = vm_register_frames_push(vm, func, window);
+                    RELOAD_FRAME();
+                    VM_NEXT();
                 }
-            } break;
 
-            case OP_RETURN: {
-                LoxCallFrame * old = frame;
+                if(!VAL_IS_NATIVE_FN(value))
+                    RUNTIME_ERROR("can only call functions");
+
+                LoxNativeFn * native = VAL_AS_NATIVE_FN(value);
+                if(native->arity != args_nr) {
+                    vm_report_arity_error(vm, value, args_nr);
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                if(stats != NULL) stats->native_calls++;
+
+                // natives take their arguments from the top of the stack, so they're copied there
+                size_t top = vm->stack.length;
+                for(size_t i = 0; i <= args_nr; i++)
+                    vm_stack_push(vm, vm->stack.values[window + i]);
+                native->executor(vm);
+#ifndef NDEBUG
+                if(top + args_nr + 2 != vm->stack.length)
+                    RUNTIME_ERROR("native function call left stack in bad state");
+#endif
+                LoxValue result  = vm->stack.values[vm->stack.length - 1];
+                vm->stack.length = top;
+                regs = frame->locals;
+                regs[callee] = result;
+            } VM_NEXT();
+
+            VM_CASE(ROP_RETURN): {
+                LoxValue result  = READ_RK();
+                LoxValue * locals = frame->locals;
                 frame = vm_frames_pop(vm);
                 if(frame == NULL) {
-                    ASSERT(vm->stack.length == 0);
+                    vm->stack.length = 0;
                     return INTERPRET_OK;
                 }
 
-                LoxValue value   = vm_stack_pop(vm);
-                vm->stack.length = old->locals - vm->stack.values;
-                vm_stack_push(vm, value);
-            } break;
+                locals[0] = result;
+                vm->stack.length = (size_t) (frame->locals - vm->stack.values) + frame->func->reg->frame_size;
+                RELOAD_FRAME();
+            } VM_NEXT();
+#ifndef VM_THREADED_DISPATCH
             default:
                 UNREACHABLE();
+#endif
         }
     }
 
-    ASSERT(vm->frames_count == 0);
+#undef SYNC
+#undef RELOAD_FRAME
+#undef RUNTIME_ERROR
+#undef READ
+#undef READ_LONG
+#undef READ_RK
 #undef BINARY
-#undef READ_BYTE
-#undef READ_STRING
+#undef NOT_BOOL_VAL
+#undef TRACE_EXECUTION
+#undef OBSERVE
+#undef VM_SWITCH
+#undef VM_CASE
+#undef VM_NEXT
+}
+
+static void vm_start_profiler(LoxVM * vm) {
+    LoxProfiler * prof = mem_alloc(sizeof(LoxProfiler));
+    if(profiler_start(prof, vm, PROFILE_HZ)) {
+        vm->profiler = prof;
+    } else {
+        fprintf(stderr, "Failed to start the profiler: %s\n", strerror(errno));
+        profiler_destroy(prof);
+        mem_dealloc(prof);
+    }
+}
+
+static void vm_stop_profiler(LoxVM * vm, const char * path) {
+    LoxProfiler * prof = vm->profiler;
+    profiler_stop(prof);
+
+    FILE * out = fopen(path, "w");
+    if(out == NULL) {
+        fprintf(stderr, "Failed to write the profile to '%s': %s\n", path, strerror(errno));
+    } else {
+        profiler_write(prof, out);
+        fclose(out);
+        if(prof->dropped > 0)
+            fprintf(stderr, "profiler: %zu of %zu samples dropped\n", prof->dropped, prof->samples + prof->dropped);
+    }
+
+    profiler_destroy(prof);
+    mem_dealloc(prof);
+    vm->profiler = NULL;
+}
+
+// the profiler and the stats cover the whole life of the vm
+static void vm_start_reporting(LoxVM * vm) {
+    if(vm->config.profile_path != NULL)
+        vm_start_profiler(vm);
+    if(vm->config.stats != STATS_NONE) {
+        vm->stats = mem_alloc(sizeof(LoxStats));
+        stats_init(vm->stats);
+    }
+}
+
+LoxVM * lox_vm_create(const LoxVMConfig * config) {
+    LoxVMConfig defaults;
+    if(config == NULL) {
+        vm_config_init(&defaults);
+        config = &defaults;
+    }
+
+    LoxVM * vm = mem_alloc(sizeof(LoxVM));
+    vm_init(vm, config);
+    load_native_funcs(vm);
+    vm_start_reporting(vm);
+    return vm;
 }
 
-LoxInterpretResult interpret(const char * source){
-    LoxVM vm;
-    vm_init(&vm);
-    load_native_funcs(&vm);
+void lox_vm_destroy(LoxVM * vm) {
+    const LoxVMConfig * config = &vm->config;
+    if(vm->profiler != NULL) vm_stop_profiler(vm, config->profile_path);
+
+    if(config->gc_stats) gc_print_stats(&vm->gc, stderr);
+    if(vm->stats != NULL) {
+        stats_print(vm->stats, config->stats, stderr);
+        stats_destroy(vm->stats);
+        mem_dealloc(vm->stats);
+        vm->stats = NULL;
+    }
+
+    vm_destroy(vm);
+    mem_dealloc(vm);
+}
 
-    LoxFunction * script = compile(source, &vm.strings);
-    LoxInterpretResult res = script == NULL ? INTERPRET_COMPILE_ERROR : vm_run(&vm, script);
+static LoxInterpretResult vm_eval_script(LoxVM * vm, LoxFunction * script) {
+    if(script == NULL) return INTERPRET_COMPILE_ERROR;
 
-    vm_destroy(&vm);
+    LoxInterpretResult res;
+    if(vm->config.backend == BACKEND_REGISTER) {
+        regcode_lower(script);
+        res = vm_run_register(vm, script);
+    } else {
+        res = vm_run(vm, script);
+    }
+    // a runtime error leaves the frames that were running behind
+    vm->stack.length = 0;
+    vm->frames_count = 0;
     return res;
 }
+
+static LoxFunction * vm_compile(LoxVM * vm, const char * source) {
+    LoxFunction * script = compile(source, &vm->gc, &vm->strings, &vm->globals);
+    if(script != NULL && vm->config.optimize) optimize_function(script);
+    return script;
+}
+
+// The shared vm only compiles, it never runs the script nor collects again after
+// freezing. The collection right before promotes the young objects and drops the
+// garbage of the compiler, so only what the script references is frozen.
+LoxShared * lox_shared_create(const char * source, const LoxVMConfig * config) {
+    LoxVMConfig shared_config;
+    vm_config_init(&shared_config);
+    if(config != NULL) shared_config.optimize = config->optimize;
+
+    LoxVM * vm = mem_alloc(sizeof(LoxVM));
+    vm_init(vm, &shared_config);
+    load_native_funcs(vm);
+
+    // optimized (if asked to) before it's lowered and frozen, neither allows it after
+    LoxFunction * script = vm_compile(vm, source);
+    if(script == NULL) {
+        vm_destroy(vm);
+        mem_dealloc(vm);
+        return NULL;
+    }
+
+    // lowered for the register backend whatever the isolates run, it can't be once frozen
+    regcode_lower(script);
+    gc_push_root(&vm->gc, OBJ_VAL(script));
+    gc_collect(&vm->gc);
+    gc_pop_root(&vm->gc);
+    gc_freeze(&vm->gc);
+
+    LoxShared * shared = mem_alloc(sizeof(LoxShared));
+    shared->vm     = vm;
+    shared->script = script;
+    return shared;
+}
+
+void lox_shared_destroy(LoxShared * shared) {
+    vm_destroy(shared->vm);
+    mem_dealloc(shared->vm);
+    mem_dealloc(shared);
+}
+
+// The isolate starts with the interned strings of the shared vm, so its natives and
+// everything it interns later reuse the shared strings, and with the shared global
+// slots, which the shared code refers to by index.
+LoxVM * lox_vm_create_isolate(const LoxVMConfig * config, const LoxShared * shared) {
+    LoxVMConfig defaults;
+    if(config == NULL) {
+        vm_config_init(&defaults);
+        config = &defaults;
+    }
+
+    LoxVM * vm = mem_alloc(sizeof(LoxVM));
+    vm_init(vm, config);
+    map_add_all(&vm->strings, &shared->vm->strings);
+    load_native_funcs(vm);
+
+    const LoxGlobals * globals = &shared->vm->globals;
+    for(size_t slot = 0; slot < globals->names.length; slot++) {
+        size_t isolate_slot = globals_resolve(&vm->globals, globals->names.values[slot]);
+        ASSERTF(isolate_slot == slot, "shared global slot %zu resolved to %zu", slot, isolate_slot);
+    }
+
+    vm_start_reporting(vm);
+    if(vm_eval_script(vm, shared->script) != INTERPRET_OK) {
+        lox_vm_destroy(vm);
+        return NULL;
+    }
+    return vm;
+}
+
+LoxInterpretResult lox_vm_eval(LoxVM * vm, const char * source) {
+    return vm_eval_script(vm, vm_compile(vm, source));
+}
+
+// compiles the source, unless the cache has it compiled already
+static LoxFunction * vm_load_script(LoxVM * vm, const char * source) {
+    const LoxVMConfig * config = &vm->config;
+    if(config->cache_path == NULL)
+        return vm_compile(vm, source);
+
+    LoxcKey key = {
+        .source_hash  = loxc_source_hash(source, strlen(source)),
+        .source_mtime = config->source_mtime,
+        .optimized    = config->optimize,
+    };
+    LoxFunction * script = loxc_load(config->cache_path, key, &vm->gc, &vm->strings, &vm->globals);
+    if(script != NULL) return script;
+
+    script = vm_compile(vm, source);
+    // failing to write the cache only costs the next run a compilation
+    if(script != NULL) loxc_save(config->cache_path, key, script, &vm->globals);
+    return script;
+}
+
+LoxInterpretResult vm_eval_cached(LoxVM * vm, const char * source) {
+    return vm_eval_script(vm, vm_load_script(vm, source));
+}
+
+LoxInterpretResult interpret(const char * source, const LoxVMConfig * config){
+    LoxVM * vm = lox_vm_create(config);
+    LoxInterpretResult res = vm_eval_cached(vm, source);
+    lox_vm_destroy(vm);
+    return res;
+}
+
+void lox_vm_define_native(LoxVM * vm, const char * name, LoxNative native, uint8_t arity) {
+    vm_define_native_fn(vm, name, native, arity);
+}
+
+// Natives only run with frames on the vm, the host gets its handles with none.
+static LoxHandle * vm_handle_new(LoxVM * vm, LoxValue value) {
+    LoxHandle ** list = vm->frames_count > 0 ? &vm->native_handles : &vm->handles;
+    LoxHandle * handle = mem_alloc(sizeof(LoxHandle));
+    handle->value = value;
+    handle->prev  = NULL;
+    handle->next  = *list;
+    if(*list != NULL) (*list)->prev = handle;
+    *list = handle;
+    return handle;
+}
+
+void lox_handle_release(LoxVM * vm, LoxHandle * handle) {
+    if(handle->prev != NULL)
+        handle->prev->next = handle->next;
+    else if(vm->handles == handle)
+        vm->handles = handle->next;
+    else
+        vm->native_handles = handle->next;
+
+    if(handle->next != NULL) handle->next->prev = handle->prev;
+    mem_dealloc(handle);
+}
+
+LoxHandle * lox_vm_nil(LoxVM * vm) {
+    return vm_handle_new(vm, NIL_VAL);
+}
+
+LoxHandle * lox_vm_bool(LoxVM * vm, bool value) {
+    return vm_handle_new(vm, BOOL_VAL(value));
+}
+
+LoxHandle * lox_vm_number(LoxVM * vm, double value) {
+    return vm_handle_new(vm, NUMBER_VAL(value));
+}
+
+LoxHandle * lox_vm_string(LoxVM * vm, const char * chars, size_t length) {
+    return vm_handle_new(vm, OBJ_VAL(lox_str_intern(&vm->gc, &vm->strings, chars, length)));
+}
+
+bool lox_handle_is_nil(const LoxHandle * handle)    { return VAL_IS_NIL(handle->value); }
+bool lox_handle_is_bool(const LoxHandle * handle)   { return VAL_IS_BOOL(handle->value); }
+bool lox_handle_is_number(const LoxHandle * handle) { return VAL_IS_NUMBER(handle->value); }
+bool lox_handle_is_string(const LoxHandle * handle) { return VAL_IS_STRING(handle->value); }
+
+bool lox_handle_as_bool(const LoxHandle * handle) {
+    ASSERT(VAL_IS_BOOL(handle->value));
+    return VAL_AS_BOOL(handle->value);
+}
+
+double lox_handle_as_number(const LoxHandle * handle) {
+    ASSERT(VAL_IS_NUMBER(handle->value));
+    return VAL_AS_NUMBER(handle->value);
+}
+
+const char * lox_handle_as_string(const LoxHandle * handle, size_t * length) {
+    ASSERT(VAL_IS_STRING(handle->value));
+    const LoxString * str = VAL_AS_STRING(handle->value);
+    if(length != NULL) *length = str->length;
+    return str->chars;
+}
+
+// `idx` counts from the first argument, the last one is on the top of the stack
+LoxHandle * lox_native_arg(LoxVM * vm, uint8_t arity, uint8_t idx) {
+    ASSERTF(idx < arity, "argument %u of a native taking %u", (unsigned) idx, (unsigned) arity);
+    return vm_handle_new(vm, vm_func_get_arg(vm, arity - 1 - idx));
+}
+
+void lox_native_return(LoxVM * vm, const LoxHandle * result) {
+    vm_stack_push(vm, result->value);
+    vm_free_handles(vm->native_handles);
+    vm->native_handles = NULL;
+}
+
+LoxHandle * lox_vm_get_global(LoxVM * vm, const char * name) {
+    size_t length = strlen(name);
+    const LoxString * str = map_find_str(&vm->strings, name, length, str_hash(name, length));
+    ssize_t slot = str == NULL ? -1 : globals_find(&vm->globals, str);
+    if(slot < 0 || VAL_IS_UNDEFINED(vm->globals.values.values[slot]))
+        return NULL;
+
+    return vm_handle_new(vm, vm->globals.values.values[slot]);
+}
+
+// interning the name may run a minor collection, the value is read from the handle after it
+void lox_vm_set_global(LoxVM * vm, const char * name, const LoxHandle * value) {
+    const LoxString * str = lox_str_intern(&vm->gc, &vm->strings, name, strlen(name));
+    size_t slot = globals_resolve(&vm->globals, str);
+
+    vm_global_write_barrier(vm, slot, value->value);
+    vm->globals.values.values[slot] = value->value;
+}
@@ -1,39 +1,89 @@
 #ifndef CLOX_VM_H
 #define CLOX_VM_H
 
+#include "lox.h"
 #include "hash-map.h"
+#include "gc.h"
+#include "globals.h"
+#include "profiler.h"
+#include "stats.h"
 #include "function.h"
 #include "constants.h"
 #include "utils.h"
 
-#define MAX_STACK_SIZE (MAX_LOCALS * MAX_STACK_FRAMES)
-
 typedef struct {
     LoxFunction * func;
-    Instruction * ip;
+    union {
+        uint8_t * ip;          // stack backend
+        const uint16_t * rip;  // register backend, into `func->reg` (see regcode.h)
+    };
     LoxValue * locals;
 } LoxCallFrame;
 
+// A value held by the host (see lox.h). The live ones are linked in a list of the vm,
+// which the collector visits as roots, so a young value is followed when it moves.
+typedef struct __lox_handle__ {
+    LoxValue value;
+    struct __lox_handle__ * prev;
+    struct __lox_handle__ * next;
+} LoxHandle;
+
 typedef struct __lox_vm__ {
+    // both live on the heap and grow on demand, see `vm_stack_grow` and `vm_frames_grow`
     struct {
-        LoxValue values[MAX_STACK_SIZE];
+        LoxValue * values;
         size_t length;
+        size_t capacity;
     } stack;
 
-    LoxCallFrame frames[MAX_STACK_FRAMES];
+    LoxCallFrame * frames;
     size_t frames_count;
+    size_t frames_capacity;
+    size_t max_frames;
 
     HashMap strings;
-    HashMap globals;
-    LoxObject * objects;
+    LoxGlobals globals;
+    LoxGC gc;
+    DaArray(size_t) young_globals; // remembered set (of slots) for minor collections
+    LoxHandle * handles;        // released by the host
+    LoxHandle * native_handles; // made by the running native, released when it returns
+
+    LoxProfiler * profiler; // NULL unless profiling
+    LoxStats * stats;       // NULL unless collecting --stats
+    LoxVMConfig config;
+    FILE * out; // config.out or stdout
 } LoxVM;
 
+// Compiled once, read by every isolate. Its objects are frozen (see `gc_freeze`) so
+// the collectors of the isolates that reach them leave them alone.
+typedef struct __lox_shared__ {
+    LoxVM * vm;
+    LoxFunction * script;
+} LoxShared;
+
 void vm_report_runtime_error(LoxVM * vm, const char * format, ...) 
     __attribute__((format (printf, 2, 3)));
 
-LoxValue vm_stack_peek(LoxVM * vm, size_t distance);
-LoxValue vm_stack_pop(LoxVM * vm);
-void vm_stack_push(LoxVM * vm, LoxValue value);
+// line of the instruction the frame is running, whichever the backend
+uint32_t vm_frame_line(const LoxVM * vm, const LoxCallFrame * frame);
+
+__attribute__((noinline, cold)) void vm_stack_grow(LoxVM * vm);
+
+static inline void vm_stack_push(LoxVM * vm, LoxValue value){
+    if(vm->stack.length == vm->stack.capacity) vm_stack_grow(vm);
+    vm->stack.values[vm->stack.length++] = value;
+}
+
+static inline LoxValue vm_stack_pop(LoxVM * vm){
+    ASSERT(vm->stack.length > 0);
+    return vm->stack.values[--vm->stack.length];
+}
+
+static inline LoxValue vm_stack_peek(LoxVM * vm, size_t distance){
+    size_t idx = vm->stack.length - (1 + distance);
+    ASSERT(idx < vm->stack.length);
+    return vm->stack.values[idx];
+}
 
 static inline LoxValue vm_func_get_arg(LoxVM * vm, uint8_t arg_pos) {
     return vm_stack_peek(vm, arg_pos);
@@ -41,12 +91,7 @@ static inline LoxValue vm_func_get_arg(LoxVM * vm, uint8_t arg_pos) {
 
 void vm_define_native_fn(LoxVM * vm, const char * name, Fn executor, uint8_t arity);
 
-typedef enum {
-  INTERPRET_OK,
-  INTERPRET_COMPILE_ERROR,
-  INTERPRET_RUNTIME_ERROR
-} LoxInterpretResult;
-
-LoxInterpretResult interpret(const char * source);
+// like `lox_vm_eval` but going through the cache of `vm->config`, if it has one
+LoxInterpretResult vm_eval_cached(LoxVM * vm, const char * source);
 
 #endif
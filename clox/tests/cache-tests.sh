@@ -0,0 +1,92 @@
+#!/usr/bin/env bash
+# Checks the compiled script cache (.loxc, see src/loxc.h): a second run reuses the
+# cache, and a changed source, mtime, flag or header makes clox compile the script
+# again. The scripts and their caches live in a temporary directory.
+#   usage: ./cache-tests.sh   (from the tests directory, with ../bin/clox built)
+
+CLOX=$(realpath ../bin/clox)
+DIR=$(mktemp -d)
+trap "rm -rf $DIR" EXIT
+SCRIPT=$DIR/script.lox
+CACHE=$DIR/script.loxc
+
+function echo() {
+    command echo -e $*
+}
+
+# a hit maps the cache and leaves it be, a miss writes a new one and renames it over
+function inode() {
+    stat -c %i "$CACHE" 2> /dev/null
+}
+
+errors=0
+test_count=0
+
+# check <name> <expected output> <hit|miss> [clox options]
+function check() {
+    local name=$1 expected=$2 outcome=$3
+    shift 3
+    local before=$(inode)
+    local output=$("$CLOX" "$@" "$SCRIPT" 2>&1)
+    local after=$(inode)
+
+    local passed=1
+    [ "$output" == "$expected" ] || passed=0
+    [ -n "$after" ] || passed=0
+    if [ "$outcome" == "hit" ] ; then
+        [ "$before" == "$after" ] || passed=0
+    else
+        [ "$before" != "$after" ] || passed=0
+    fi
+
+    ((test_count++))
+    if [ $passed -eq 1 ] ; then
+        echo "\033[0;32mPASSED\033[0m cache $name"
+    else
+        echo "\033[0;31mFAILED\033[0m cache $name"
+        ((errors++))
+    fi
+}
+
+cat > $SCRIPT <<'LOX'
+fun twice(x) { return 2 * x; }
+var greeting = "hi";
+print greeting + " " + twice(21);
+LOX
+
+check "first run writes the cache" "hi 42" miss
+check "unchanged script hits" "hi 42" hit
+
+touch -d "+1 second" $SCRIPT
+check "newer mtime recompiles" "hi 42" miss
+check "and hits again" "hi 42" hit
+
+# same mtime, other contents: the source hash tells them apart
+cp -p $SCRIPT $DIR/saved.lox
+sed -i 's/21/8/' $SCRIPT
+touch -r $DIR/saved.lox $SCRIPT
+check "changed source recompiles" "hi 16" miss
+
+check "optimized code is another key" "hi 16" miss -O
+check "optimized run hits" "hi 16" hit -O
+check "plain run recompiles" "hi 16" miss
+
+# version field right after the magic
+printf '\xff' | dd of=$CACHE bs=1 seek=4 conv=notrunc status=none
+check "bad header recompiles" "hi 16" miss
+
+head -c 40 $CACHE > $DIR/short && cat $DIR/short > $CACHE
+check "truncated cache recompiles" "hi 16" miss
+
+rm $CACHE
+"$CLOX" --no-cache $SCRIPT > /dev/null
+((test_count++))
+if [ -e $CACHE ] ; then
+    echo "\033[0;31mFAILED\033[0m cache --no-cache writes nothing"
+    ((errors++))
+else
+    echo "\033[0;32mPASSED\033[0m cache --no-cache writes nothing"
+fi
+
+echo "ran $test_count cache tests where $((test_count - errors)) passed and $errors failed"
+[ $errors -eq 0 ]
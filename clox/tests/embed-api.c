@@ -0,0 +1,112 @@
+// Host side of the embedding API (see src/lox.h), built by `make test-embed` with the
+// collector running on every allocation, so a handle that isn't followed goes stale.
+#include <stdio.h>
+#include <string.h>
+
+#include "lox.h"
+
+static int checks = 0;
+static int failed = 0;
+
+#define CHECK(cond) do {                                                    \
+        checks++;                                                           \
+        if(!(cond)) {                                                       \
+            failed++;                                                       \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        }                                                                   \
+    } while(0)
+
+// greet(name) = "hello " + name, built on the host side
+static void greet(LoxVM * vm) {
+    size_t length;
+    const char * name = lox_handle_as_string(lox_native_arg(vm, 1, 0), &length);
+
+    char buffer[64];
+    int size = snprintf(buffer, sizeof(buffer), "hello %.*s", (int) length, name);
+    lox_native_return(vm, lox_vm_string(vm, buffer, size));
+}
+
+// sub(a, b) = a - b, checks the order of the arguments
+static void sub(LoxVM * vm) {
+    double a = lox_handle_as_number(lox_native_arg(vm, 2, 0));
+    double b = lox_handle_as_number(lox_native_arg(vm, 2, 1));
+    lox_native_return(vm, lox_vm_number(vm, a - b));
+}
+
+static void check_string(LoxVM * vm, const char * global, const char * expected) {
+    LoxHandle * handle = lox_vm_get_global(vm, global);
+    CHECK(handle != NULL && lox_handle_is_string(handle));
+    if(handle == NULL || !lox_handle_is_string(handle)) return;
+
+    size_t length;
+    const char * chars = lox_handle_as_string(handle, &length);
+    CHECK(length == strlen(expected) && memcmp(chars, expected, length) == 0);
+    lox_handle_release(vm, handle);
+}
+
+static void check_output(FILE * out, const char * expected) {
+    char buffer[256] = {0};
+    rewind(out);
+    size_t size = fread(buffer, 1, sizeof(buffer) - 1, out);
+    CHECK(size == strlen(expected) && strcmp(buffer, expected) == 0);
+    rewind(out);
+}
+
+int main(void) {
+    FILE * out = tmpfile();
+    if(out == NULL) {
+        perror("tmpfile");
+        return 1;
+    }
+
+    LoxVMConfig config;
+    vm_config_init(&config);
+    config.out = out;
+
+    LoxVM * vm = lox_vm_create(&config);
+    lox_vm_define_native(vm, "greet", greet, 1);
+    lox_vm_define_native(vm, "sub", sub, 2);
+
+    // a young string read from a global, then stored under a name that has to be interned
+    CHECK(lox_vm_eval(vm, "var a = \"ab\"; var b = a + \"cd\";") == INTERPRET_OK);
+    LoxHandle * b = lox_vm_get_global(vm, "b");
+    CHECK(b != NULL && lox_handle_is_string(b));
+    lox_vm_set_global(vm, "c", b);
+    lox_handle_release(vm, b);
+    check_string(vm, "c", "abcd");
+    CHECK(lox_vm_eval(vm, "print c == b;") == INTERPRET_OK);
+
+    // handles kept across evaluations, which collect
+    LoxHandle * name   = lox_vm_string(vm, "clox", 4);
+    LoxHandle * number = lox_vm_number(vm, 40);
+    LoxHandle * yes    = lox_vm_bool(vm, true);
+    LoxHandle * nil    = lox_vm_nil(vm);
+    CHECK(lox_vm_eval(vm, "var s = \"\"; for(var i = 0; i < 100; i = i + 1) s = s + \"x\";") == INTERPRET_OK);
+    lox_vm_set_global(vm, "name", name);
+    lox_vm_set_global(vm, "number", number);
+    lox_vm_set_global(vm, "yes", yes);
+    lox_vm_set_global(vm, "nothing", nil);
+    CHECK(lox_handle_is_nil(nil) && !lox_handle_is_nil(yes));
+    CHECK(lox_handle_is_bool(yes) && lox_handle_as_bool(yes));
+    CHECK(lox_handle_is_number(number) && lox_handle_as_number(number) == 40);
+    lox_handle_release(vm, nil);
+    lox_handle_release(vm, yes);
+    lox_handle_release(vm, number);
+    lox_handle_release(vm, name);
+
+    // natives, with their results going through the collector
+    CHECK(lox_vm_eval(vm, "var g = greet(name + \"!\"); print g; print sub(number, 2);") == INTERPRET_OK);
+    check_string(vm, "g", "hello clox!");
+    CHECK(lox_vm_eval(vm, "print yes and nothing == nil;") == INTERPRET_OK);
+    check_output(out, "true\nhello clox!\n38\ntrue\n");
+
+    // undefined globals, and a handle that is never released (freed by lox_vm_destroy)
+    CHECK(lox_vm_get_global(vm, "undefined") == NULL);
+    CHECK(lox_vm_get_global(vm, "s") != NULL);
+
+    lox_vm_destroy(vm);
+    fclose(out);
+
+    printf("ran %d embedding api checks where %d passed and %d failed\n", checks, checks - failed, failed);
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,124 @@
+#!/usr/bin/env bash
+# Checks --jobs (see src/pool.h): scripts run in isolates on several threads, all of
+# them starting off with the shared prelude. Every script's output has to come out
+# whole and right, whatever the backend, and a failing script only fails itself (and
+# the exit status). The scripts live in a temporary directory.
+#   usage: ./jobs-tests.sh   (from the tests directory, with ../bin/clox built)
+
+CLOX=$(realpath ../bin/clox)
+DIR=$(mktemp -d)
+trap "rm -rf $DIR" EXIT
+SCRIPTS=8
+
+function echo() {
+    command echo -e $*
+}
+
+errors=0
+test_count=0
+
+function report() {
+    local name=$1 passed=$2
+    ((test_count++))
+    if [ $passed -eq 1 ] ; then
+        echo "\033[0;32mPASSED\033[0m jobs $name"
+    else
+        echo "\033[0;31mFAILED\033[0m jobs $name"
+        ((errors++))
+    fi
+}
+
+# the prelude's global is changed by every script, each isolate has its own copy
+cat > $DIR/prelude.lox <<'LOX'
+var greeting = "hi";
+fun square(x) { return x * x; }
+fun tag(name, value) { return name + ": " + value; }
+LOX
+
+mkdir $DIR/scripts
+for k in $(seq 1 $SCRIPTS) ; do
+    cat > $DIR/scripts/s$k.lox <<LOX
+var name = "s$k";
+greeting = greeting + " " + name;
+print tag(name, greeting);
+var total = 0;
+for (var i = 0; i < $((100 * k)); i = i + 1) total = total + square($k);
+var s = "";
+for (var i = 0; i < 50; i = i + 1) s = s + name;
+print tag(name, total);
+print tag(name, s);
+LOX
+done
+
+# expected block of script k
+function expected() {
+    local k=$1
+    printf "s%d: hi s%d\ns%d: %d\ns%d: " $k $k $k $((100 * k * k * k)) $k
+    for i in $(seq 50) ; do printf "s%d" $k ; done
+    printf "\n"
+}
+
+# Every script's lines have to be there, in order and next to each other: the pool
+# buffers the output of a script and writes it at once.
+function check_blocks() {
+    local output=$1
+    for k in $(seq 1 $SCRIPTS) ; do
+        local block=$(grep -A2 "^s$k: hi" <<< "$output")
+        [ "$block" == "$(expected $k)" ] || return 1
+    done
+    [ $(wc -l <<< "$output") -eq $((3 * SCRIPTS)) ]
+}
+
+# check <name> [clox options]
+function check() {
+    local name=$1
+    shift
+    local output
+    output=$("$CLOX" --no-cache "$@" --jobs=4 --prelude=$DIR/prelude.lox $DIR/scripts 2> $DIR/err)
+    local status=$?
+
+    local passed=1
+    [ $status -eq 0 ] || passed=0
+    [ -s $DIR/err ] && passed=0
+    check_blocks "$output" || passed=0
+    report "$name" $passed
+}
+
+check "stack backend"
+check "register backend" --backend=register
+check "optimized stack backend" -O
+check "optimized register backend" -O --backend=register
+
+# a runtime error fails its script and the exit status, the others still run
+echo 'print tag("bad", undefined_global);' > $DIR/scripts/s0.lox
+output=$("$CLOX" --no-cache --jobs=3 --prelude=$DIR/prelude.lox $DIR/scripts 2> $DIR/err)
+status=$?
+passed=1
+[ $status -ne 0 ] || passed=0
+grep -q "pool: 1 of $((SCRIPTS + 1)) scripts failed" $DIR/err || passed=0
+check_blocks "$output" || passed=0
+report "failing script" $passed
+rm $DIR/scripts/s0.lox
+
+# alloc_count() counts the allocations of the calling thread only, so a script gets
+# the same figure on its own as next to the others
+cat > $DIR/alloc.lox <<'LOX'
+var start = alloc_count();
+var s = "";
+for (var i = 0; i < 500; i = i + 1) s = s + "some text that outgrows the nursery";
+print alloc_count() - start;
+LOX
+alone=$("$CLOX" --no-cache --jobs=1 $DIR/alloc.lox)
+passed=1
+[ -n "$alone" ] && [ "$alone" -gt 0 ] || passed=0
+copies=()
+for k in $(seq 1 6) ; do
+    cp $DIR/alloc.lox $DIR/alloc$k.lox
+    copies+=($DIR/alloc$k.lox)
+done
+output=$("$CLOX" --no-cache --jobs=3 "${copies[@]}")
+[ "$(sort -u <<< "$output")" == "$alone" ] || passed=0
+report "allocation counts are per thread" $passed
+
+echo "ran $test_count jobs tests where $((test_count - errors)) passed and $errors failed"
+[ $errors -eq 0 ]
@@ -0,0 +1,71 @@
+#!/usr/bin/env bash
+# Checks --profile (see src/profiler.h) on a CPU-bound script that runs long enough to be
+# sampled: the file has to hold folded stacks, one `<script>:N;...;f:N <count>` line per
+# stack, and profiling must not change the output nor the exit status of the script.
+# The lines are the ones the runtime errors report.
+#   usage: ./profile-tests.sh   (from the tests directory, with ../bin/clox built)
+
+CLOX=$(realpath ../bin/clox)
+DIR=$(mktemp -d)
+trap "rm -rf $DIR" EXIT
+SCRIPT=$DIR/loops.lox
+FOLDED=$DIR/out.folded
+
+function echo() {
+    command echo -e $*
+}
+
+errors=0
+test_count=0
+
+function report() {
+    local name=$1 passed=$2
+    ((test_count++))
+    if [ $passed -eq 1 ] ; then
+        echo "\033[0;32mPASSED\033[0m profile $name"
+    else
+        echo "\033[0;31mFAILED\033[0m profile $name"
+        ((errors++))
+    fi
+}
+
+# nearly all of the time goes to the loop of inner
+cat > $SCRIPT <<'LOX'
+fun inner(n) { var s = 0; for (var i = 0; i < n; i = i + 1) s = s + i; return s; }
+fun outer(k) { var t = 0; for (var j = 0; j < k; j = j + 1) t = t + inner(1000); return t; }
+print outer(20000) > 0;
+LOX
+
+# check <name> [clox options]
+function check() {
+    local name=$1
+    shift
+    rm -f $FOLDED
+    local output=$("$CLOX" --no-cache --profile=$FOLDED "$@" $SCRIPT)
+    local status=$?
+
+    local passed=1
+    [ $status -eq 0 ] && [ "$output" == "true" ] || passed=0
+    [ -s $FOLDED ] || passed=0
+    grep -Evq '^<script>:[0-9]+(;[A-Za-z_]+:[0-9]+)* [1-9][0-9]*$' $FOLDED && passed=0
+    grep -Eq '^<script>:2;outer:1;inner:0 [1-9][0-9]*$' $FOLDED || passed=0
+
+    # the stacks are merged, none comes up twice
+    [ -z "$(cut -d' ' -f1 $FOLDED | sort | uniq -d)" ] || passed=0
+    report "$name" $passed
+}
+
+check "stack backend"
+check "register backend" --backend=register
+check "optimized stack backend" -O
+
+# without a path the stacks go to the default file, in the working directory
+output=$(cd $DIR && "$CLOX" --no-cache --profile $SCRIPT)
+status=$?
+passed=1
+[ $status -eq 0 ] && [ "$output" == "true" ] || passed=0
+grep -Eq '^<script>:2;outer:1;inner:0 [1-9][0-9]*$' $DIR/clox-profile.folded || passed=0
+report "default path" $passed
+
+echo "ran $test_count profile tests where $((test_count - errors)) passed and $errors failed"
+[ $errors -eq 0 ]
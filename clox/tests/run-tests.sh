@@ -2,6 +2,13 @@
 
 TMP_FILE=/tmp/out.txt
 USAGE="usage $0: [ --all | --help | <test-name> ]"
+# extra clox options for every test, e.g. CLOX_FLAGS=--backend=register to run them on
+# the register vm
+CLOX_FLAGS=${CLOX_FLAGS:-}
+# every test runs as is and then optimized, a test that needs more options puts them
+# in a `// flags: <options>` first line
+PASSES=("" "-O")
+# the tests never leave .loxc files behind, the cache has its own checks (cache-tests.sh)
 
 function echo() {
     command echo -e $*
@@ -16,8 +23,15 @@ function get_test_name() {
     echo ${1/.lox/}
 }
 
+function test_flags() {
+    local first
+    read -r first < "$1"
+    [[ "$first" =~ ^//\ flags:\ (.*)$ ]] && command echo "${BASH_REMATCH[1]}"
+}
+
 function run_test() {
     local test_name=$1
+    local pass=$2
     local out="$test_name.out"
     local in="$test_name.lox"
 
@@ -25,27 +39,30 @@ function run_test() {
         error "test file '$test_name.lox' not found"
     fi
 
+    local flags="$CLOX_FLAGS $pass $(test_flags "$in")"
     local passed=0
     if [ -f "$test_name.out" ] ; then
-        ../bin/clox "$in" > "$TMP_FILE"
+        ../bin/clox --no-cache $flags "$in" > "$TMP_FILE"
         diff "$out" "$TMP_FILE" > /dev/null
         passed=$?
     else
-        ../bin/clox "$in" > /dev/null 2> "$TMP_FILE"
+        ../bin/clox --no-cache $flags "$in" > /dev/null 2> "$TMP_FILE"
         [ $? -eq 0 ] && passed=1
     fi
 
     [ $passed -eq 0 ] && echo -n "\033[0;32mPASSED" || echo -n "\033[0;31mFAILED"
-    echo "\033[0m $test_name"
+    echo "\033[0m $test_name${pass:+ ($pass)}"
     return $passed
 }
 
 function run_all_test() {
     local errors=0
     local test_count=0
-    for file in *.lox ; do 
-        run_test $(get_test_name $file) || ((errors++))
-        ((test_count++))
+    for pass in "${PASSES[@]}" ; do
+        for file in *.lox ; do 
+            run_test $(get_test_name $file) "$pass" || ((errors++))
+            ((test_count++))
+        done
     done
 
     local passed=$((test_count - errors))
@@ -60,9 +77,12 @@ function main() {
         *) 
             local test_name=$(get_test_name $1)
             local out="$test_name.out"
-            if ! run_test "$test_name" && [ -f "$out" ]; then
-                vimdiff $TMP_FILE "$out"
-            fi
+            for pass in "${PASSES[@]}" ; do
+                if ! run_test "$test_name" "$pass" && [ -f "$out" ]; then
+                    vimdiff $TMP_FILE "$out"
+                    break
+                fi
+            done
     esac
 }
 
@@ -0,0 +1,86 @@
+#!/usr/bin/env bash
+# Checks the --stats counters (see src/stats.h) on a fixed script, in both formats. The
+# counts are exact: a change to the compiler that alters them has to update them here.
+#   usage: ./stats-tests.sh   (from the tests directory, with ../bin/clox built)
+
+CLOX=$(realpath ../bin/clox)
+DIR=$(mktemp -d)
+trap "rm -rf $DIR" EXIT
+SCRIPT=$DIR/fib.lox
+
+function echo() {
+    command echo -e $*
+}
+
+errors=0
+test_count=0
+
+function report() {
+    local name=$1 passed=$2
+    ((test_count++))
+    if [ $passed -eq 1 ] ; then
+        echo "\033[0;32mPASSED\033[0m stats $name"
+    else
+        echo "\033[0;31mFAILED\033[0m stats $name"
+        ((errors++))
+    fi
+}
+
+# 177 calls of fib, the script itself and one native
+cat > $SCRIPT <<'LOX'
+fun fib(n) { if (n < 2) return n; return fib(n - 1) + fib(n - 2); }
+var start = clock();
+print fib(10);
+LOX
+
+# json_field <file> <pattern>: the number following the pattern
+function json_field() {
+    grep -o "$2 *[0-9]*" "$1" | head -1 | grep -o '[0-9]*$'
+}
+
+# check_json <name> [clox options]
+function check_json() {
+    local name=$1
+    shift
+    local output=$("$CLOX" --no-cache --stats=json "$@" $SCRIPT 2> $DIR/stats.json)
+    local status=$?
+
+    local passed=1
+    [ $status -eq 0 ] && [ "$output" == "55" ] || passed=0
+    [ "$(json_field $DIR/stats.json '"instructions":')" == "1422" ] || passed=0
+    [ "$(json_field $DIR/stats.json '"lox":')" == "178" ] || passed=0
+    [ "$(json_field $DIR/stats.json '"native":')" == "1" ] || passed=0
+    [ "$(json_field $DIR/stats.json '"name": "fib", "calls":')" == "177" ] || passed=0
+    [ "$(json_field $DIR/stats.json '"name": "<script>", "calls":')" == "1" ] || passed=0
+
+    # the opcode counts add up to the instructions
+    local sum=$(sed -n '/"opcodes"/,/}/p' $DIR/stats.json | grep -o ': [0-9]*' | awk '{ sum += $2 } END { print sum }')
+    [ "$sum" == "1422" ] || passed=0
+    report "$name" $passed
+}
+
+check_json "json counters"
+check_json "json counters with -O" -O
+
+output=$("$CLOX" --no-cache --stats $SCRIPT 2> $DIR/stats.txt)
+status=$?
+passed=1
+[ $status -eq 0 ] && [ "$output" == "55" ] || passed=0
+grep -q "^instructions: 1422$" $DIR/stats.txt || passed=0
+grep -q "^calls: 178 to lox functions, 1 to native functions$" $DIR/stats.txt || passed=0
+grep -Eq "^ +177  fib$" $DIR/stats.txt || passed=0
+report "table counters" $passed
+
+# the register backend doesn't count opcodes, so the two don't go together
+output=$("$CLOX" --no-cache --stats --backend=register $SCRIPT 2> /dev/null)
+status=$?
+passed=1
+[ $status -ne 0 ] && [ -z "$output" ] || passed=0
+report "--stats with the register backend is rejected" $passed
+
+"$CLOX" --no-cache --stats=xml $SCRIPT > /dev/null 2>&1
+[ $? -ne 0 ] && passed=1 || passed=0
+report "unknown --stats format is rejected" $passed
+
+echo "ran $test_count stats tests where $((test_count - errors)) passed and $errors failed"
+[ $errors -eq 0 ]
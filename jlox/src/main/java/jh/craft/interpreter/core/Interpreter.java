@@ -9,6 +9,7 @@ import jh.craft.interpreter.scanner.Token;
 import jh.craft.interpreter.scanner.TokenType;
 import jh.craft.interpreter.utils.Utils;
 
+import java.time.Instant;
 import java.util.ArrayList;
 import java.util.HashMap;
 import java.util.List;
@@ -37,7 +38,9 @@ public class Interpreter implements Expr.Visitor<Object>, Stmt.Visitor<Void> {
 
             @Override
             public Object call(Interpreter interpreter, List<Object> arguments) {
-                return (Double) (System.currentTimeMillis() / 1000.0);
+                // seconds since the epoch with sub-millisecond precision, same as clox's clock
+                var now = Instant.now();
+                return (Double) (now.getEpochSecond() + now.getNano() / 1e9);
             }
 
             @Override